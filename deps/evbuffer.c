@@ -38,6 +38,9 @@
 #endif
 
 #define EVENT__HAVE_MMAP
+#ifndef _WIN32
+#define EVENT__HAVE_SYS_UIO_H /* writev stops at sendfile chains */
+#endif
 
 #include <sys/types.h>
 
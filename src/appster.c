@@ -1,35 +1,167 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE /* accept4, CPU affinity, splice */
+#endif
+
 #include "appster.h"
 #include "appster_struct.h"
 
 #include "log.h"
+#include "arena.h"
+#include "format.h"
 #include "evbuffer.h"
 #include "schema.h"
+#include "router.h"
+#include "stack.h"
+#include "wheel.h"
 #include "http_parser.h"
+#include "h2.h"
+#include "hpack.h"
+#include "zip.h"
+#include "files.h"
+#include "microcache.h"
+#include "histogram.h"
 
 #ifdef HAS_CRYPTO
     #include "crypto.h"
 #endif
+#ifdef HAS_IO_URING
+    #include "uring.h"
+#endif
 
 #include <stdlib.h>
+#include <limits.h>
+#include <strings.h>
 #include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <uv.h>
 #include <libdill.h>
 
+#ifdef __linux__
+    #include <linux/filter.h>
+#endif
+
 typedef struct error_cb_s {
     as_route_cb_t cb;
     void* user_data;
 } error_cb_t;
 
+#define METRICS_ROUTE 0 /* time in the route callback */
+#define METRICS_REQUEST 1 /* from the headers to the reply */
+#define METRICS_CLASSES 6 /* by the first digit of the status, 0 is none */
+
+typedef struct route_metrics_s {
+    histogram_t* latency[2][METRICS_CLASSES]; /* made on first use, in microseconds */
+} route_metrics_t;
+
+typedef struct metrics_writer_s {
+    appster_t* a;
+    histogram_t* merged; /* of all loops, for one series at a time */
+    int kind;
+} metrics_writer_t;
+
+typedef struct inflight_s {
+    uint32_t count; /* running routes */
+    uint32_t max; /* 0 is no limit */
+    double limit; /* adapted to the latency, at most max */
+    uint64_t hold; /* no cut before this time */
+} inflight_t;
+
+typedef struct loop_s {
+    uv_loop_t uv;
+    appster_t* a;
+    struct listener_s* lsnr;
+    unsigned idx;
+    int cpu; /* cpu the loop thread is pinned to or -1 */
+    appster_loop_stats_t stats;
+    struct rblock_s* rblocks; /* free read blocks */
+    unsigned rblocks_count;
+    uv_timer_t date_timer;
+    char date[48]; /* rendered Date header line */
+    uint32_t date_len;
+    int pipe[2]; /* splices request bodies to files, made on first use */
+    stack_pool_t* stacks; /* made by the loop thread so the memory is local */
+    timer_wheel_t* wheel; /* connection timeouts */
+    uv_timer_t wheel_timer;
+    inflight_t inflight;
+    inflight_t* routes; /* by route index */
+    struct connection_s* conns;
+    uv_async_t stop; /* as_shutdown wakes the loop from any thread */
+    uv_timer_t stop_timer; /* closes what is left at the deadline */
+    zip_t* zip; /* deflate streams and compressed files, NULL when disabled */
+    file_cache_t* files; /* open static files, NULL without static routes */
+    uv_poll_t files_poll; /* watched directories changed */
+    microcache_t** caches; /* by route index, NULL for routes without a cache */
+    struct context_s* woken; /* waited on a finished fill, dispatched again */
+    uv_idle_t wake_idle; /* runs while requests are woken */
+    route_metrics_t* metrics; /* by route index, then requests without a route */
+    unsigned stopping:1;
+#ifdef HAS_IO_URING
+    uring_t* ring; /* accepts and writes replies when set */
+    uv_poll_t ring_poll; /* completions are waiting */
+    uv_prepare_t ring_prepare; /* submits what the iteration queued */
+#endif
+} loop_t;
+
+typedef struct rblock_s {
+    struct rblock_s* next;
+    uint32_t size;
+    uint32_t len;
+    char data[];
+} rblock_t;
+
+typedef struct header_s {
+    struct header_s* next;
+    const char* key;
+    const char* value;
+    uint32_t key_len;
+    uint32_t value_len;
+} header_t;
+
 typedef struct context_s {
     struct connection_s* con;
+    arena_t* arena; /* request scoped memory, the context lives in it too */
+    h2_stream_t* stream; /* NULL once reset */
     uv_write_t* write;
-    hashmap_t* headers,* send_headers;
+    header_t* headers;
+    header_t* known[AH_UNKNOWN]; /* latest header of each interned name */
+    hashmap_t* send_headers;
     evbuffer_t* body,* send_body;
+    evbuffer_t* chunk; /* streamed output not framed yet */
+    uint64_t body_max; /* 0 is no limit */
+    uint64_t body_len; /* received so far */
+    uint64_t bypass; /* body left once splicing took it over, the parser never sees it */
     value_t** vars;
     schema_t* sh;
+    uint64_t allow; /* methods the path is routed for when the request's is not */
     appster_channel_t read_ch;
+    appster_channel_t write_ch; /* streaming route waits for the wire to drain */
+    cstack_t* stack;
+    uint64_t start; /* when the route started, for the adaptive limits and metrics */
+    uint64_t ready; /* when the headers were in, for the request latency */
     int handle;
-    char* str;
+    const char* url,* key; /* slices of the read buffer */
+    uint32_t url_len, key_len;
+    int method;
+    uint64_t body_acked; /* HTTP/2 body the client may send again */
+    zstream_t* zs; /* compresses the streamed reply */
+    evbuffer_t* zipped; /* the file of the reply compressed ahead */
+    uint64_t zipped_len; /* length of the reply when it was */
+    fc_file_t* file; /* static file of the reply, its headers go with the head */
+    uint32_t max_age; /* of the static route, 0 sends no Cache-Control */
+    uint64_t range_first, range_len; /* part of the file in a 206 */
+    mc_entry_t* cached; /* reply from the route cache, its headers go with the head */
+    mc_fill_t* fill; /* the route runs for the others with the same key */
+    mc_waiter_t waiter; /* waits for another request to fill the cache */
+    struct context_s* woken_next;
     struct {
         unsigned parse_error:1;
         unsigned parsed_arguments:1;
@@ -37,17 +169,72 @@ typedef struct context_s {
         unsigned should_keepalive:1;
         unsigned body_done:1;
         unsigned connection_closed:1;
+        unsigned has_file:1; /* reply body has file segments */
+        unsigned sendfile:1; /* they go to the socket with sendfile, unmapped */
+        unsigned headers_done:1; /* ready to run */
+        unsigned reply_ready:1; /* finished out of turn, reply is queued */
+        unsigned abort:1; /* close the connection once it's our turn */
+        unsigned replied:1; /* reply is completely on the wire */
+        unsigned http10:1; /* no chunked encoding, stream until close */
+        unsigned streaming:1; /* head is out, body goes in chunks */
+        unsigned stream_done:1; /* last chunk is queued */
+        unsigned body_too_large:1; /* rejected with 413, the rest is not read */
+        unsigned splicing:1; /* the route moves the body past the parser */
+        unsigned done:1; /* the route returned */
+        unsigned shed:1; /* refused over the inflight limit */
+        unsigned framed:1; /* HTTP/2 headers are out, the body goes in DATA frames */
+        unsigned encoding:2; /* content coding of the reply body */
+        unsigned vary:1; /* the coding depends on Accept-Encoding */
+        unsigned range:1; /* 206 or 416 with a Content-Range */
+        unsigned woken:1; /* queued on the loop to be dispatched again */
     } flag;
-#define appster con->handle.loop->data
+#define appster con->loop->a
 } context_t;
 
 typedef struct connection_s {
     http_parser_t parser[1];
     vector_t contexts;
+    arena_t* spare_arena; /* of the last request, for the next one */
+    evbuffer_t* spare[2]; /* drained buffers kept for the next requests */
+    /*
+     Requests are parsed in place. Blocks never move so headers and the url
+     are kept as slices until the request is gone. A token still being parsed
+     is moved to the next block when the current one fills up.
+     */
+    rblock_t* rbuf; /* current block, older ones are chained behind it */
+    const char* tok;
+    uint32_t tok_len;
+    uint32_t rkeep; /* bytes of the current block referenced by slices */
+    uint32_t linger_left; /* unread data still dropped before closing */
+    unsigned reading:1; /* inside the parser */
+    unsigned dispatching:1; /* retiring replies and starting the next ones */
+    unsigned writing:1; /* front reply is waiting for write_poll */
+    unsigned throttled:1; /* unread body is over the watermark, stop reading */
+    unsigned expired:1; /* timed out, nothing more is read */
+    unsigned spoken:1; /* enough of the first bytes were read to settle the protocol */
+    unsigned h2_pending:1; /* output was queued while flushing */
+    unsigned lingering:1; /* replied and shut down, unread data is drained before closing */
+    h2_t* h2; /* the connection speaks HTTP/2, contexts are its streams */
+    uint32_t h2_turn; /* stream to go first on the next flush */
+#ifdef HAS_IO_URING
+    unsigned sending:1; /* the front reply is in the ring */
+    unsigned released:1; /* closed while sending, freed on completion */
+    ur_op_t send_op;
+    struct iovec* send_iov; /* read by the kernel until the write completes */
+#endif
+    tw_timer_t timer; /* idle, header or body timeout, whichever applies */
+    tw_timer_t request_timer; /* the whole request has to arrive in time */
+    struct connection_s* next,* prev; /* connections of the loop */
+    loop_t* loop;
     uv_poll_t handle;
     int fd;
 #ifdef HAS_CRYPTO
     ssl_t* ssl;
+    unsigned handshaken:1; /* counted in the loop stats */
+    unsigned ktls:1; /* the kernel encrypts writes, the socket is written directly */
+    uint32_t tls_retry; /* length of the write that has to be repeated */
+    uint64_t tls_sent; /* bytes written since the connection went idle */
+    uint64_t tls_active; /* loop time of the last write */
 #endif
 } connection_t;
 
@@ -58,15 +245,167 @@ typedef union addr_u {
     struct sockaddr_in6 sin6[1];
 } addr_t;
 
+typedef struct static_route_s {
+    struct static_route_s* next;
+    char* root; /* without the trailing slash */
+    char* index;
+    uint32_t max_age;
+} static_route_t;
+
+typedef struct route_cache_s {
+    uint32_t ttl;
+    size_t size;
+} route_cache_t;
+
 typedef struct listener_s {
     uv_poll_t handle;
     int fd;
+    int spare_fd; /* reserved to shed connections when out of descriptors */
 #ifdef HAS_CRYPTO
     ssl_ctx_t* ssl_ctx;
 #endif
+#ifdef HAS_IO_URING
+    loop_t* loop;
+    ur_op_t accept_op;
+    unsigned accepting:1; /* the multishot accept is armed */
+    unsigned closing:1; /* freed after the last accept completion */
+#endif
 } listener_t;
 
+#define ACCEPT_BATCH_DEFAULT 64
+#define CONNECTION_ARENA_SIZE 4096
+#define RBLOCK_SIZE (16 * 1024)
+#define RBLOCK_MIN_READ 2048 /* switch blocks when less space is left */
+#define RBLOCK_CACHE 64 /* free blocks kept per loop */
+
+#define HEADER(id, name) [id] = { name, sizeof(name) - 1 }
+
+static const struct {
+    const char* name;
+    uint32_t len;
+} header_names[AH_UNKNOWN] = {
+    HEADER(AH_ACCEPT, "accept"),
+    HEADER(AH_ACCEPT_ENCODING, "accept-encoding"),
+    HEADER(AH_ACCEPT_LANGUAGE, "accept-language"),
+    HEADER(AH_AUTHORIZATION, "authorization"),
+    HEADER(AH_CACHE_CONTROL, "cache-control"),
+    HEADER(AH_CONNECTION, "connection"),
+    HEADER(AH_CONTENT_ENCODING, "content-encoding"),
+    HEADER(AH_CONTENT_LENGTH, "content-length"),
+    HEADER(AH_CONTENT_TYPE, "content-type"),
+    HEADER(AH_COOKIE, "cookie"),
+    HEADER(AH_EXPECT, "expect"),
+    HEADER(AH_HOST, "host"),
+    HEADER(AH_IF_MATCH, "if-match"),
+    HEADER(AH_IF_MODIFIED_SINCE, "if-modified-since"),
+    HEADER(AH_IF_NONE_MATCH, "if-none-match"),
+    HEADER(AH_IF_RANGE, "if-range"),
+    HEADER(AH_IF_UNMODIFIED_SINCE, "if-unmodified-since"),
+    HEADER(AH_ORIGIN, "origin"),
+    HEADER(AH_RANGE, "range"),
+    HEADER(AH_REFERER, "referer"),
+    HEADER(AH_TRANSFER_ENCODING, "transfer-encoding"),
+    HEADER(AH_UPGRADE, "upgrade"),
+    HEADER(AH_USER_AGENT, "user-agent"),
+    HEADER(AH_X_FORWARDED_FOR, "x-forwarded-for"),
+    HEADER(AH_X_REQUEST_ID, "x-request-id"),
+};
+
+#undef HEADER
+
+#define STATUS(num, name, string) \
+    [num - 100] = { "HTTP/1.1 " #num " " #string "\r\n", sizeof("HTTP/1.1 " #num " " #string "\r\n") - 1 },
+
+static const struct {
+    const char* line;
+    uint32_t len;
+} status_lines[500] = {
+    HTTP_STATUS_MAP(STATUS)
+};
+
+#undef STATUS
+
+#define METHOD(num, name, string) [num] = { #string, sizeof(#string) - 1 },
+
+static const struct {
+    const char* name;
+    uint32_t len;
+} method_names[] = {
+    HTTP_METHOD_MAP(METHOD)
+};
+
+#undef METHOD
+
+static const struct {
+    const char* name;
+    const char* help;
+} metrics_names[] = {
+    [METRICS_ROUTE] = { "appster_route_duration_seconds",
+                        "Time from the start of the route until its callback returned." },
+    [METRICS_REQUEST] = { "appster_request_duration_seconds",
+                          "Time from the request headers until the reply was handed to the connection, "
+                          "the head of a streamed one." },
+};
+
+static const char* const metrics_classes[METRICS_CLASSES] = {
+    "none", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+/* bucket bounds of the exposition, the histograms are finer */
+static const struct {
+    uint64_t max; /* microseconds */
+    const char* le;
+} metrics_bounds[] = {
+    { 100, "0.0001" }, { 250, "0.00025" }, { 500, "0.0005" },
+    { 1000, "0.001" }, { 2500, "0.0025" }, { 5000, "0.005" },
+    { 10000, "0.01" }, { 25000, "0.025" }, { 50000, "0.05" },
+    { 100000, "0.1" }, { 250000, "0.25" }, { 500000, "0.5" },
+    { 1000000, "1" }, { 2500000, "2.5" }, { 5000000, "5" },
+    { 10000000, "10" },
+};
+
+#define SERVER_HEADER "Server: Appster\r\n"
+#define REPLY_HEAD_SIZE 1024
+#define REPLY_IOV_MAX 16 /* head plus body chains written in a single writev */
+#define PIPELINE_DEPTH_DEFAULT 1
+#define STREAM_CHUNK_SIZE (16 * 1024) /* staged output framed on its own */
+#define STREAM_HIGH_WATERMARK (256 * 1024) /* route waits above this */
+#define STREAM_LOW_WATERMARK (64 * 1024) /* and resumes below this */
+#define BODY_HIGH_WATERMARK (256 * 1024) /* unread body that pauses reading */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define STACK_SIZE_DEFAULT (256 * 1024)
+#define STACK_KEEP_DEFAULT 256
+#define CHANNEL_CACHE 64 /* idle channels kept per thread */
+#define TIMEOUT_TICK_MS 100
+#define IDLE_TIMEOUT_DEFAULT 60000
+#define HEADER_TIMEOUT_DEFAULT 30000
+#define BODY_TIMEOUT_DEFAULT 60000
+#define LINGER_TIMEOUT 2000 /* unread request data is drained this long before closing */
+#define LINGER_MAX (256 * 1024) /* or up to this much */
+#define RETRY_AFTER_DEFAULT 1
+#define INFLIGHT_DECREASE 0.9 /* cut of the adaptive limit when too slow */
+#define LISTEN_FDS_START 3 /* inherited listeners, same as systemd */
+#define URING_ENTRIES 256
+#define TLS_CACHE_SIZE_DEFAULT 20480
+#define TLS_SESSION_TIMEOUT_DEFAULT 3600
+#define TLS_TICKET_ROTATE_DEFAULT 3600
+#define TLS_RECORD_SMALL 1300 /* fits a single segment */
+#define TLS_RECORD_MAX (16 * 1024)
+#define TLS_WARMUP_BYTES (1024 * 1024) /* small records until this much is out */
+#define TLS_IDLE_MS 1000 /* back to small records after this long */
+#define H2_OUTPUT_HIGH (256 * 1024) /* frames queued before the socket takes them */
+#define H2_QUANTUM (16 * 1024) /* a stream's turn in the output */
+#define ZIP_CACHE_DEFAULT (8 * 1024 * 1024)
+#define FILE_CACHE_DEFAULT 1024 /* open files per loop */
+#define FILE_REVALIDATE_DEFAULT 60000
+#define STATIC_INDEX_DEFAULT "index.html"
+#define CACHE_KEY_MAX 1024 /* requests with longer keys are not cached */
+#define CACHE_HEAD_MAX 512 /* replies with more user headers are not cached */
+#define H2_UPGRADE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
 __thread context_t* __current_ctx = NULL;
+static __thread appster_channel_t __channels[CHANNEL_CACHE];
+static __thread uint32_t __channels_count = 0;
 
 #define __AP_PREAMPLE \
     context_t* ctx; \
@@ -82,23 +421,135 @@ __thread context_t* __current_ctx = NULL;
 #define __AP_EVENT_CB http_parser_t* p
 
 /* misc */
-inline void to_lower(char* str);
+static void channel_recycle(appster_channel_t ch);
 static int hm_cb_free(const void* key, void* value, void* context);
-static int hm_cb_sh_free(const void* key, void* value, void* context);
+static appster_header_id_t header_intern(const char* name, uint32_t len);
+static int method_intern(const char* name, uint32_t len);
 static int basic_error(void* data);
 static void send_reply(context_t* ctx, int status);
+static uint32_t render_head(context_t* ctx, int status, char* dst);
+static void buffer_reply(context_t* ctx, const char* head, size_t head_len);
+static void reply_done(context_t* ctx);
+static void complete_replies(connection_t* con);
+static int write_queued_reply(context_t* ctx);
+static void start_contexts(connection_t* con);
+static void run_context(context_t* ctx);
+static void prepare_route(schema_t* sh, void* user_data);
+static void prepare_route_load(schema_t* sh, void* user_data);
+static int admit_context(context_t* ctx);
+static void shed_context(context_t* ctx);
+static void finish_route(context_t* ctx);
+static void inflight_adapt(inflight_t* in, uint64_t latency, uint64_t target, uint64_t now);
+static evbuffer_t* output_buffer(context_t* ctx);
+static evbuffer_t* file_buffer(context_t* ctx);
+static int stream_pressure(context_t* ctx);
+static int stream_flush(context_t* ctx, int final);
+static void stream_send(context_t* ctx);
+static int stream_wait(context_t* ctx);
+static void stream_wake(context_t* ctx);
+static void close_connection(connection_t* con);
+static void linger_connection(connection_t* con);
+static void linger_poll(uv_poll_t* handle, int status, int events);
+static void arm_timeout(connection_t* con, tw_timer_t* t, uint32_t timeout);
+static void run_timeouts(uv_timer_t* timer);
+static void timeout_expired(tw_timer_t* t);
+static char* put_status_line(char* dst, int status);
+static void update_date(uv_timer_t* timer);
 static int add_header(const void* key, void* value, void* context);
 coroutine void execute_context();
 /* Connection and messages */
-static void bind_listener(uv_loop_t* loop, const addr_t* ad, int backlog);
+static int get_online_cpus(int* cpus, int max);
+static uint32_t inherit_listeners(appster_t* a);
+static int open_listener(loop_t* loop, const addr_t* ad, int backlog);
+static void bind_listener(loop_t* loop, int fd);
+static void free_listener(uv_handle_t* handle);
+static void steer_incoming_cpu(appster_t* a);
 static void run_loop(void* lv);
+static void begin_shutdown(uv_async_t* handle);
+static void stop_expired(uv_timer_t* timer);
+static void finish_shutdown(loop_t* loop);
+static void close_handle(uv_handle_t* handle, void* arg);
 static void accept_poll(uv_poll_t* handle, int status, int events);
+static int accept_connection(listener_t* lsnr, loop_t* loop, int fd);
+static int refuse_connection(listener_t* lsnr);
 static void error_poll(uv_poll_t* handle);
 static void read_poll(uv_poll_t* handle, int status, int events);
 static void write_poll(uv_poll_t* handle, int status, int events);
 static void free_context(context_t* ctx);
 static void free_connection(uv_handle_t* handle);
+static arena_t* arena_get(connection_t* con);
+static evbuffer_t* buffer_get(connection_t* con);
+static void buffer_put(connection_t* con, evbuffer_t* buf);
+static char* rbuf_reserve(connection_t* con, uint32_t* avail);
+static void rbuf_release(connection_t* con);
+static void token_append(context_t* ctx, const char* at, size_t len);
+static const char* token_take(connection_t* con, uint32_t* len);
 static int write_connection(connection_t* con, evbuffer_t* buf);
+#ifdef HAS_CRYPTO
+static int write_tls(connection_t* con, evbuffer_t* buf);
+#endif
+#ifdef HAS_IO_URING
+/* io_uring */
+static void ring_start(loop_t* loop);
+static void ring_submit(uv_prepare_t* handle);
+static void ring_poll(uv_poll_t* handle, int status, int events);
+static void accept_complete(ur_op_t* op, int res, uint32_t flags);
+static int ring_send(context_t* ctx);
+static void send_complete(ur_op_t* op, int res, uint32_t flags);
+#endif
+/* HTTP/2 */
+static int http2_start(connection_t* con, const char* data, size_t len);
+static void http2_session(connection_t* con);
+static int http2_upgrade(context_t* ctx);
+static void http2_poll(uv_poll_t* handle, int status, int events);
+static int http2_execute(connection_t* con, const char* data, size_t len);
+static void http2_flush(connection_t* con);
+static void http2_kick(connection_t* con);
+static size_t http2_send(context_t* ctx, size_t max);
+static void http2_reply(context_t* ctx, int status);
+static int http2_add_header(const void* key, void* value, void* context);
+static void http2_consume(context_t* ctx);
+static void* http2_begin(void* data, h2_stream_t* st);
+static void http2_header(void* data, const char* name, uint32_t name_len, const char* value, uint32_t value_len);
+static void http2_headers(void* data, int end_stream);
+static void http2_data(void* data, const char* at, size_t len, int end_stream);
+static void http2_reset(void* data, uint32_t error);
+/* Compression */
+static int reply_encoding(context_t* ctx, int status);
+static int accept_encoding(const char* value, uint32_t len);
+static int type_compressible(appster_t* a, const char* type);
+static void compress_reply(context_t* ctx, int status);
+static void compress_file(context_t* ctx, const char* path, const struct stat* st);
+static int file_zippable(context_t* ctx, const struct stat* st);
+static int compress_chunk(context_t* ctx, int final);
+/* Static files */
+static int static_serve(void* data);
+static int static_path(static_route_t* sr, const char* rel, char* dst, size_t size);
+static int static_redirect(context_t* ctx);
+static int static_range(context_t* ctx, fc_file_t* f);
+static int etag_match(const char* value, uint32_t len, const fc_file_t* f);
+static int parse_range(const char* value, uint32_t len, uint64_t size, uint64_t* first, uint64_t* count);
+static int parse_date(const char* value, uint32_t len, time_t* t);
+static char* render_file_head(context_t* ctx, int status, char* dst);
+static void http2_file_headers(context_t* ctx, int status, evbuffer_t* block);
+static uint32_t content_range(context_t* ctx, char* dst);
+static void files_poll(uv_poll_t* handle, int status, int events);
+static int hex_digit(int c);
+/* Route cache */
+static int cache_lookup(context_t* ctx);
+static void cache_serve(context_t* ctx, mc_entry_t* e);
+static void cache_fill(context_t* ctx, int status);
+static void cache_abandon(context_t* ctx);
+static void cache_wake(void* data, mc_entry_t* e);
+static void cache_unwake(context_t* ctx);
+static void wake_contexts(uv_idle_t* handle);
+static int cache_status(int status);
+static void http2_cached_headers(mc_entry_t* e, evbuffer_t* block);
+/* Metrics */
+static void record_latency(context_t* ctx, int kind, int status, uint64_t since);
+static void write_route_metrics(schema_t* sh, void* user_data);
+static void write_metrics(metrics_writer_t* w, uint32_t idx, const char* route, const char* method);
+static char* metrics_label(const char* value);
 /* Incoming message parsing functions */
 static int on_parse_error(context_t* ctx);
 static int on_message_begin(__AP_EVENT_CB);
@@ -107,14 +558,39 @@ static int on_inc_header_field(__AP_DATA_CB);
 static int on_inc_header_value(__AP_DATA_CB);
 static int on_inc_headers_complete(__AP_EVENT_CB);
 static int on_inc_body(__AP_DATA_CB);
+static int on_message_complete(__AP_EVENT_CB);
 static int complete_header(__AP_EVENT_CB);
 static int parse_arguments(context_t* ctx);
+static int decode_capture(char* s);
+static int method_not_allowed(context_t* ctx);
+static uint64_t body_limit(context_t* ctx);
+static void reject_body(context_t* ctx);
+static int body_wait(context_t* ctx, uv_poll_cb cb);
+static int body_can_splice(context_t* ctx, int fd);
+static int64_t splice_body(context_t* ctx, int fd, int64_t max);
+static void splice_poll(uv_poll_t* handle, int status, int events);
+static size_t bypass_body(context_t* ctx, const char* at, size_t len);
 /* Casts and getters */
 static context_t* parser_get_context(http_parser_t* p);
 static context_t* parser_get_active_context(http_parser_t* p);
-
-void run_front_context (http_parser_t *p);
  
+static const char* const zip_types_default[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "image/svg+xml",
+    NULL
+};
+
+static const h2_callbacks_t http2_callbacks = {
+    http2_begin,
+    http2_header,
+    http2_headers,
+    http2_data,
+    http2_reset,
+};
+
 static http_parser_settings incoming = {
     on_message_begin,
     on_inc_url,
@@ -123,7 +599,7 @@ static http_parser_settings incoming = {
     on_inc_header_value,
     on_inc_headers_complete,
     on_inc_body,
-    NULL,           /* on_message_complete */
+    on_message_complete,
     NULL,           /* on_chunk */
     NULL,           /* on_chunk_complete */
 };
@@ -132,32 +608,61 @@ appster_t* as_alloc(unsigned threads) {
     __log_set_file(stdout);
 
     int err;
-    uv_loop_t* loop;
+    loop_t* loop;
     appster_t* rc;
 
     rc = calloc(1, sizeof(appster_t));
 
-    vector_setup(rc->loops, threads, sizeof(uv_loop_t*));
+    vector_setup(rc->modules, 10, sizeof(void*));
+    rc->accept_batch = ACCEPT_BATCH_DEFAULT;
+    rc->pipeline_depth = PIPELINE_DEPTH_DEFAULT;
+    rc->stack_size = STACK_SIZE_DEFAULT;
+    rc->stack_keep = STACK_KEEP_DEFAULT;
+    rc->idle_timeout = IDLE_TIMEOUT_DEFAULT;
+    rc->header_timeout = HEADER_TIMEOUT_DEFAULT;
+    rc->body_timeout = BODY_TIMEOUT_DEFAULT;
+    rc->retry_after = RETRY_AFTER_DEFAULT;
+    rc->zip_cache = ZIP_CACHE_DEFAULT;
+    rc->file_cache = FILE_CACHE_DEFAULT;
+    rc->file_revalidate = FILE_REVALIDATE_DEFAULT;
+    rc->general_error_cb = malloc((sizeof(error_cb_t)));
+    rc->general_error_cb->cb = basic_error;
+    rc->general_error_cb->user_data = NULL;
+    rc->router = rt_alloc();
+    rc->error_cbs = hm_alloc(10, NULL, NULL);
+    rc->body_limits = hm_alloc(10, NULL, NULL);
+    rc->stack_sizes = hm_alloc(10, NULL, NULL);
+    rc->inflight_limits = hm_alloc(10, NULL, NULL);
+    rc->route_caches = hm_alloc(10, NULL, NULL);
+
+    if (threads == AS_THREADS_AUTO) {
+        threads = get_online_cpus(NULL, 0);
+    }
+
+    vector_setup(rc->loops, threads, sizeof(loop_t*));
 
-    for (unsigned i = 1; i < threads; i++) {
-        loop = malloc(sizeof(uv_loop_t));
-        err = uv_loop_init(loop);
+    for (unsigned i = 0; i < threads; i++) {
+        loop = calloc(1, sizeof(loop_t));
+        err = uv_loop_init(&loop->uv);
         if (err != 0) {
             ELOG("Failed to initialize uv loop %s", uv_strerror(err));
+            free(loop);
             goto fail;
         }
+        loop->uv.data = loop;
+        loop->a = rc;
+        loop->idx = i;
+        loop->cpu = -1;
+        loop->pipe[0] = -1;
+        loop->pipe[1] = -1;
         vector_push_back(rc->loops, &loop);
     }
 
-    vector_setup(rc->modules, 10, sizeof(void*));
-    rc->general_error_cb = malloc((sizeof(error_cb_t)));
-    rc->general_error_cb->cb = basic_error;
-    rc->general_error_cb->user_data = NULL;
-    rc->routes = hm_alloc(10, NULL, NULL);
-    rc->error_cbs = hm_alloc(10, NULL, NULL);
-
 #ifdef HAS_CRYPTO
     crypto_alloc();
+    rc->tls_cache_size = TLS_CACHE_SIZE_DEFAULT;
+    rc->tls_session_timeout = TLS_SESSION_TIMEOUT_DEFAULT;
+    rc->tls_ticket_rotate = TLS_TICKET_ROTATE_DEFAULT;
 #endif
 
     return rc;
@@ -167,13 +672,49 @@ fail:
     return NULL;
 }
 void as_free(appster_t* a) {
+    loop_t* loop;
+    int err;
+
     if (!a) {
         return;
     }
 
-    VECTOR_FOR_EACH(a->loops, loop) {
-        uv_loop_close(ITERATOR_GET_AS(uv_loop_t*, &loop));
-        free(ITERATOR_GET_AS(uv_loop_t*, &loop));
+    VECTOR_FOR_EACH(a->loops, it) {
+        loop = ITERATOR_GET_AS(loop_t*, &it);
+        err = uv_loop_close(&loop->uv);
+        if (err != 0) {
+            ELOG("Failed to close loop %u %s", loop->idx, uv_strerror(err));
+        }
+        sp_free(loop->stacks);
+        tw_free(loop->wheel);
+        zp_free(loop->zip);
+        fc_free(loop->files);
+        for (uint32_t i = 0; loop->caches && i < a->nroutes; i++) {
+            mc_free(loop->caches[i]);
+        }
+        free(loop->caches);
+        for (uint32_t i = 0; loop->metrics && i <= a->nroutes; i++) {
+            for (int k = 0; k < 2; k++) {
+                for (int c = 0; c < METRICS_CLASSES; c++) {
+                    hg_free(loop->metrics[i].latency[k][c]);
+                }
+            }
+        }
+        free(loop->metrics);
+        free(loop->routes);
+#ifdef HAS_IO_URING
+        ur_free(loop->ring);
+#endif
+        if (loop->pipe[0] != -1) {
+            close(loop->pipe[0]);
+            close(loop->pipe[1]);
+        }
+        while (loop->rblocks) {
+            rblock_t* b = loop->rblocks;
+            loop->rblocks = b->next;
+            free(b);
+        }
+        free(loop);
     }
 
     VECTOR_FOR_EACH(a->modules, module) {
@@ -188,10 +729,31 @@ void as_free(appster_t* a) {
 
     vector_destroy(a->loops);
     vector_destroy(a->modules);
-    hm_foreach(a->routes, hm_cb_sh_free, NULL);
-    hm_free(a->routes);
+    rt_free(a->router);
     hm_foreach(a->error_cbs, hm_cb_free, (void*) 1);
     hm_free(a->error_cbs);
+    hm_foreach(a->body_limits, hm_cb_free, (void*) 1);
+    hm_free(a->body_limits);
+    hm_foreach(a->stack_sizes, hm_cb_free, (void*) 1);
+    hm_free(a->stack_sizes);
+    hm_foreach(a->inflight_limits, hm_cb_free, (void*) 1);
+    hm_free(a->inflight_limits);
+    hm_foreach(a->route_caches, hm_cb_free, (void*) 1);
+    hm_free(a->route_caches);
+    for (char** it = a->zip_types; it && *it; it++) {
+        free(*it);
+    }
+    free(a->zip_types);
+    while (a->statics) {
+        static_route_t* sr = a->statics;
+        a->statics = sr->next;
+        free(sr->root);
+        free(sr->index);
+        free(sr);
+    }
+#ifdef HAS_CRYPTO
+    crypto_free_ctx(a->ssl_ctx);
+#endif
     free(a->general_error_cb);
     free(a);
 }
@@ -209,10 +771,226 @@ void as_load_ssl_cert_and_key(appster_t* a, const char* certificate_chain_path,
     a->cert_chain_file = certificate_chain_path;
     a->key_file = private_key_file_path;
 }
+void as_set_tls_session_cache(appster_t* a, uint32_t size, uint32_t timeout) {
+    lassert(a);
+    a->tls_cache_size = size;
+    a->tls_session_timeout = timeout;
+}
+void as_set_tls_ticket_rotation(appster_t* a, uint32_t interval) {
+    lassert(a);
+    a->tls_ticket_rotate = interval;
+}
+void as_set_ktls(appster_t* a, int enable) {
+    lassert(a);
+    a->ktls = !!enable;
+}
+#endif
+void as_set_accept_batch(appster_t* a, unsigned batch) {
+    lassert(a);
+    a->accept_batch = batch ? batch : 1;
+}
+int as_set_affinity(appster_t* a, const int* cpus, unsigned count) {
+    int online[CPU_SETSIZE];
+    loop_t* loop;
+
+    lassert(a);
+
+    if (!cpus) { /* pin each loop to its own online cpu */
+        count = get_online_cpus(online, CPU_SETSIZE);
+        cpus = online;
+    }
+
+    if (!count) {
+        ELOG("No cpus to pin the loops to");
+        return -1;
+    }
+
+    VECTOR_FOR_EACH(a->loops, it) {
+        loop = ITERATOR_GET_AS(loop_t*, &it);
+        loop->cpu = cpus[loop->idx % count];
+    }
+
+    return 0;
+}
+void as_set_pipeline_depth(appster_t* a, unsigned depth) {
+    lassert(a);
+    a->pipeline_depth = depth ? depth : 1;
+}
+void as_set_http2(appster_t* a, unsigned max_streams) {
+    lassert(a);
+    a->h2_streams = max_streams;
+}
+void as_set_compression(appster_t* a, int level, uint32_t min_length, const char* const* types) {
+    uint32_t n = 0;
+
+    lassert(a);
+    lassert(level >= 0 && level <= 9);
+
+    a->zip_level = level;
+    a->zip_min = min_length;
+
+    for (char** it = a->zip_types; it && *it; it++) {
+        free(*it);
+    }
+    free(a->zip_types);
+
+    if (!types) {
+        types = zip_types_default;
+    }
+    while (types[n]) {
+        n++;
+    }
+
+    a->zip_types = calloc(n + 1, sizeof(char*));
+    for (uint32_t i = 0; i < n; i++) {
+        a->zip_types[i] = strdup(types[i]);
+    }
+}
+void as_set_compression_cache(appster_t* a, size_t size) {
+    lassert(a);
+    a->zip_cache = size;
+}
+void as_set_file_cache(appster_t* a, uint32_t files, uint32_t revalidate) {
+    lassert(a);
+    a->file_cache = files;
+    a->file_revalidate = revalidate;
+}
+void as_set_stack_size(appster_t* a, size_t size) {
+    lassert(a);
+    a->stack_size = size ? size : STACK_SIZE_DEFAULT;
+}
+int as_set_route_stack_size(appster_t* a, const char* path, size_t size) {
+    size_t* stack_size;
+
+    lassert(a);
+    lassert(path);
+
+    stack_size = malloc(sizeof(size_t));
+    *stack_size = size;
+    free(hm_put(a->stack_sizes, strdup(path), stack_size));
+
+    return 0;
+}
+void as_set_stack_pool(appster_t* a, unsigned keep, unsigned warm) {
+    lassert(a);
+    a->stack_keep = keep;
+    a->stack_warm = warm;
+}
+void as_set_stack_hugepages(appster_t* a, int enable) {
+    lassert(a);
+    a->stack_hugepages = !!enable;
+}
+void as_set_idle_timeout(appster_t* a, uint32_t timeout) {
+    lassert(a);
+    a->idle_timeout = timeout;
+}
+void as_set_header_timeout(appster_t* a, uint32_t timeout) {
+    lassert(a);
+    a->header_timeout = timeout;
+}
+void as_set_body_timeout(appster_t* a, uint32_t timeout) {
+    lassert(a);
+    a->body_timeout = timeout;
+}
+void as_set_request_timeout(appster_t* a, uint32_t timeout) {
+    lassert(a);
+    a->request_timeout = timeout;
+}
+void as_set_max_inflight(appster_t* a, unsigned max) {
+    lassert(a);
+    a->max_inflight = max;
+}
+int as_set_route_max_inflight(appster_t* a, const char* path, unsigned max) {
+    uint32_t* limit;
+
+    lassert(a);
+    lassert(path);
+
+    limit = malloc(sizeof(uint32_t));
+    *limit = max;
+    free(hm_put(a->inflight_limits, strdup(path), limit));
+
+    return 0;
+}
+int as_set_route_cache(appster_t* a, const char* path, uint32_t ttl, size_t size) {
+    route_cache_t* cache;
+
+    lassert(a);
+    lassert(path);
+
+    cache = malloc(sizeof(route_cache_t));
+    cache->ttl = ttl;
+    cache->size = size;
+    free(hm_put(a->route_caches, strdup(path), cache));
+
+    return 0;
+}
+void as_set_inflight_target(appster_t* a, uint32_t latency) {
+    lassert(a);
+    a->target_latency = latency;
+}
+void as_set_retry_after(appster_t* a, uint32_t seconds) {
+    lassert(a);
+    a->retry_after = seconds;
+}
+#ifdef HAS_IO_URING
+void as_set_io_uring(appster_t* a, int enable) {
+    lassert(a);
+    a->io_uring = !!enable;
+}
 #endif
+void as_set_incoming_cpu(appster_t* a, int enable) {
+    lassert(a);
+    a->incoming_cpu = !!enable;
+}
+unsigned as_loop_count(appster_t* a) {
+    lassert(a);
+    return vector_size(a->loops);
+}
+int as_serve_metrics(void* data) {
+    context_t* ctx = __current_ctx;
+    metrics_writer_t w;
+
+    lassert(ctx);
+
+    as_write_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+
+    w.a = ctx->appster;
+    w.merged = hg_alloc();
+    for (w.kind = METRICS_ROUTE; w.kind <= METRICS_REQUEST; w.kind++) {
+        as_write_f("# HELP %s %s\n# TYPE %s histogram\n", metrics_names[w.kind].name,
+                   metrics_names[w.kind].help, metrics_names[w.kind].name);
+
+        rt_foreach(w.a->router, write_route_metrics, &w);
+        write_metrics(&w, w.a->nroutes, "", "");
+    }
+    hg_free(w.merged);
+
+    return 200;
+}
+int as_loop_stats(appster_t* a, unsigned loop, appster_loop_stats_t* stats) {
+    lassert(a);
+    lassert(stats);
+
+    if (loop >= vector_size(a->loops)) {
+        return -1;
+    }
+
+    *stats = (VECTOR_GET_AS(loop_t*, a->loops, loop))->stats;
+    stats->inflight = (VECTOR_GET_AS(loop_t*, a->loops, loop))->inflight.count;
+    sp_stats((VECTOR_GET_AS(loop_t*, a->loops, loop))->stacks, &stats->stack_hits, &stats->stack_misses);
+    if ((VECTOR_GET_AS(loop_t*, a->loops, loop))->files) {
+        fc_stats((VECTOR_GET_AS(loop_t*, a->loops, loop))->files, &stats->file_hits, &stats->file_misses);
+    }
+    return 0;
+}
 int as_add_route(appster_t* a, const char* path, as_route_cb_t cb, appster_schema_entry_t* schema, void* user_data) {
+    return as_add_route_method(a, NULL, path, cb, schema, user_data);
+}
+int as_add_route_method(appster_t* a, const char* method, const char* path, as_route_cb_t cb, appster_schema_entry_t* schema, void* user_data) {
     static appster_schema_entry_t empty_schema[] = { { NULL } };
     schema_t* sh;
+    int m = RT_ANY_METHOD;
 
     lassert(a);
     lassert(path);
@@ -220,6 +998,19 @@ int as_add_route(appster_t* a, const char* path, as_route_cb_t cb, appster_schem
     lassert(path[0] == '/');
     lassert(cb);
 
+    if (method) {
+        for (m = 0; strcmp(http_method_str(m), "<unknown>"); m++) {
+            if (!strcmp(http_method_str(m), method)) {
+                break;
+            }
+        }
+
+        if (!strcmp(http_method_str(m), "<unknown>")) {
+            ELOG("Unknown method '%s' for '%s'", method, path);
+            return -1;
+        }
+    }
+
     if (!schema) {
         schema = empty_schema;
     }
@@ -230,7 +1021,13 @@ int as_add_route(appster_t* a, const char* path, as_route_cb_t cb, appster_schem
         return -1;
     }
 
-    hm_put(a->routes, sh_get_path(sh), sh);
+    sh_set_method(sh, m);
+
+    if (rt_add(a->router, m, path, sh)) {
+        sh_free(sh);
+        return -1;
+    }
+
     return 0;
 }
 int as_add_route_error(appster_t* a, const char* path, as_route_cb_t cb, void* user_data) {
@@ -251,14 +1048,83 @@ int as_add_route_error(appster_t* a, const char* path, as_route_cb_t cb, void* u
 
     return 0;
 }
+int as_add_static_route(appster_t* a, const char* prefix, const char* root, const appster_static_opts_t* opts) {
+    static appster_schema_entry_t schema[] = { { "path", 0, AVT_STRING, AS_OPTIONAL }, { NULL } };
+    static const char* const methods[] = { "GET", "HEAD" };
+    static_route_t* sr;
+    size_t len;
+    char* path;
+    int err = 0;
+
+    lassert(a);
+    lassert(prefix && prefix[0] == '/');
+    lassert(root && strlen(root));
+
+    sr = calloc(1, sizeof(static_route_t));
+    sr->root = strdup(root);
+    sr->index = strdup(opts && opts->index ? opts->index : STATIC_INDEX_DEFAULT);
+    sr->max_age = opts ? opts->max_age : 0;
+    sr->next = a->statics;
+    a->statics = sr;
+
+    /* paths are joined with a slash, a root of "/" becomes empty */
+    len = strlen(sr->root);
+    while (len && sr->root[len - 1] == '/') {
+        sr->root[--len] = 0;
+    }
+
+    /* the prefix alone redirects to the directory, the rest is captured */
+    len = strlen(prefix);
+    while (len && prefix[len - 1] == '/') {
+        len--;
+    }
+    path = malloc(len + 8);
+    for (int i = 0; i < 2 && !err; i++) {
+        memcpy(path, prefix, len);
+        memcpy(path + len, "/*path", 7);
+        err = as_add_route_method(a, methods[i], path, static_serve, schema, sr);
+
+        if (len) {
+            path[len] = 0;
+            err = err ? err : as_add_route_method(a, methods[i], path, static_serve, schema, sr);
+        }
+    }
+    free(path);
+
+    return err;
+}
+void as_set_max_body(appster_t* a, uint64_t max) {
+    lassert(a);
+    a->max_body = max;
+}
+int as_set_route_max_body(appster_t* a, const char* path, uint64_t max) {
+    uint64_t* limit;
+
+    lassert(a);
+    lassert(path);
+
+    limit = malloc(sizeof(uint64_t));
+    *limit = max;
+    free(hm_put(a->body_limits, strdup(path), limit));
+
+    return 0;
+}
 int as_listen_and_serve(appster_t* a, const char* addr, uint16_t port, int backlog) {
     addr_t ad;
-    int err = 0;
+    int err = 0, fd;
     vector_t threads;
     uv_thread_t id;
+    uint32_t inherited;
+    struct sigaction sa;
+    loop_t* loop;
 
     lassert(a);
 
+    /* the signal belongs to the application, it only has to be ignored */
+    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+        ELOG("SIGPIPE is not ignored, a peer closing mid reply ends the process");
+    }
+
     if (0 == uv_ip4_addr(addr, port, ad.sin)) {
         ad.af = AF_INET;
     } else if (0 == uv_ip6_addr(addr, port, ad.sin6)) {
@@ -269,42 +1135,188 @@ int as_listen_and_serve(appster_t* a, const char* addr, uint16_t port, int backl
     }
 
     if (!vector_size(a->loops)) {
-        uv_default_loop()->data = a;
-        bind_listener(uv_default_loop(), &ad, backlog);
-        run_loop(uv_default_loop());
-    } else  {
-        VECTOR_FOR_EACH(a->loops, loop) {
-            ITERATOR_GET_AS(uv_loop_t*, &loop)->data = a;
-            bind_listener(ITERATOR_GET_AS(uv_loop_t*, &loop), &ad, backlog);
-        }
-        vector_setup(threads, vector_size(a->loops), sizeof(uv_thread_t));
-
-        VECTOR_FOR_EACH(a->loops, loop) {
-            err = uv_thread_create(&id, run_loop, ITERATOR_GET_AS(uv_loop_t*, &loop));
-            if (err != 0) {
-                FLOG("Failed to create thread %s", uv_strerror(err));
-            }
-            vector_push_back(threads, &id);
+        ELOG("No loops to serve on");
+        return -1;
+    }
+
+    /* no more routes from here on, the loops share the tree */
+    a->nroutes = 0;
+    rt_foreach(a->router, prepare_route, a);
+    rt_freeze(a->router);
+
+    /* made ahead of the loop threads, as_serve_metrics reads them from any loop */
+    VECTOR_FOR_EACH(a->loops, it) {
+        loop = ITERATOR_GET_AS(loop_t*, &it);
+        if (!loop->metrics) {
+            loop->metrics = calloc(a->nroutes + 1, sizeof(route_metrics_t));
         }
+    }
 
-        VECTOR_FOR_EACH(threads, thread) {
-            id = ITERATOR_GET_AS(uv_thread_t, &thread);
-            err = uv_thread_join(&id);
-            if (err != 0) {
-                ELOG("Failed to join thread %s", uv_strerror(err));
-            }
+#ifdef HAS_CRYPTO
+    /* one context for all loops, resumption works whichever loop gets the client */
+    if (a->cert_chain_file && a->key_file && !a->ssl_ctx) {
+        a->ssl_ctx = crypto_alloc_ctx(CM_SERVER, a->cert_chain_file, a->key_file);
+        if (!a->ssl_ctx) {
+            FLOG("Failed to initialize SSL context");
+        }
+        if (crypto_share_sessions(a->ssl_ctx, a->tls_cache_size, a->tls_session_timeout,
+                                  a->tls_ticket_rotate) != 0) {
+            FLOG("Failed to set up TLS session resumption");
+        }
+        if (a->ktls && crypto_enable_ktls(a->ssl_ctx) != 0) {
+            ELOG("OpenSSL was built without kTLS, TLS is encrypted in user space");
+        }
+        if (a->h2_streams) {
+            crypto_enable_alpn_h2(a->ssl_ctx);
+        }
+    }
+#endif
+
+    /* listeners handed over by the previous process are taken in loop order */
+    inherited = inherit_listeners(a);
+
+    VECTOR_FOR_EACH(a->loops, it) {
+        loop = ITERATOR_GET_AS(loop_t*, &it);
+#ifdef HAS_IO_URING
+        if (a->io_uring) {
+            ring_start(loop);
+        }
+#endif
+        if (loop->idx < inherited) {
+            fd = LISTEN_FDS_START + loop->idx;
+        } else {
+            fd = open_listener(loop, &ad, backlog);
+        }
+        bind_listener(loop, fd);
+
+        uv_async_init(&loop->uv, &loop->stop, begin_shutdown);
+        loop->stop.data = loop;
+    }
+
+    /* as_shutdown may have been called already, one of the two wakes the loops */
+    __atomic_store_n(&a->serving, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&a->stop_requested, __ATOMIC_SEQ_CST)) {
+        as_shutdown(a, a->stop_deadline);
+    }
+
+    if (a->incoming_cpu) {
+        steer_incoming_cpu(a);
+    }
+
+    /*
+     The first loop runs on the calling thread, every other loop gets a thread
+     of its own.
+     */
+    vector_setup(threads, vector_size(a->loops), sizeof(uv_thread_t));
+
+    for (size_t i = 1; i < vector_size(a->loops); i++) {
+        err = uv_thread_create(&id, run_loop, VECTOR_GET_AS(loop_t*, a->loops, i));
+        if (err != 0) {
+            FLOG("Failed to create thread %s", uv_strerror(err));
         }
+        vector_push_back(threads, &id);
+    }
 
-        vector_destroy(threads);
+    run_loop(VECTOR_GET_AS(loop_t*, a->loops, 0));
+
+    VECTOR_FOR_EACH(threads, thread) {
+        id = ITERATOR_GET_AS(uv_thread_t, &thread);
+        err = uv_thread_join(&id);
+        if (err != 0) {
+            ELOG("Failed to join thread %s", uv_strerror(err));
+        }
     }
 
+    vector_destroy(threads);
+
     return err;
 }
-int as_arg_exists(uint32_t idx) {
-    lassert(__current_ctx && __current_ctx->sh);
-    return sh_arg_exists(__current_ctx->sh, __current_ctx->vars, idx);
+void as_shutdown(appster_t* a, uint32_t deadline) {
+    lassert(a);
+
+    a->stop_deadline = deadline;
+    __atomic_store_n(&a->stop_requested, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&a->serving, __ATOMIC_SEQ_CST)) {
+        return; /* as_listen_and_serve does it once the loops are ready */
+    }
+
+    VECTOR_FOR_EACH(a->loops, it) {
+        uv_async_send(&(ITERATOR_GET_AS(loop_t*, &it))->stop);
+    }
 }
-int as_arg_flag(uint32_t idx) {
+int as_handoff(appster_t* a, const char* path, char* const argv[]) {
+    char count[32], pid[32];
+    char** envp,** e;
+    unsigned n = 0, envc = 0;
+    loop_t* loop;
+    pid_t child;
+    int* fds;
+
+    lassert(a);
+    lassert(path);
+
+    fds = malloc(2 * vector_size(a->loops) * sizeof(int));
+    VECTOR_FOR_EACH(a->loops, it) {
+        loop = ITERATOR_GET_AS(loop_t*, &it);
+        if (loop->lsnr) {
+            fds[n++] = loop->lsnr->fd;
+        }
+    }
+
+    if (!n) {
+        ELOG("No listeners to hand off");
+        free(fds);
+        return -1;
+    }
+
+    /* everything the child needs is prepared here, it may only call async signal safe functions */
+    for (e = environ; *e; e++) {
+        envc++;
+    }
+    envp = malloc((envc + 3) * sizeof(char*));
+    envc = 0;
+    for (e = environ; *e; e++) {
+        if (strncmp(*e, "LISTEN_", 7)) {
+            envp[envc++] = *e;
+        }
+    }
+
+    memcpy(count, "LISTEN_FDS=", 11);
+    count[11 + u64toa(n, count + 11)] = '\0';
+    memcpy(pid, "LISTEN_PID=", 11);
+    envp[envc++] = count;
+    envp[envc++] = pid;
+    envp[envc] = NULL;
+
+    child = fork();
+    if (child == 0) {
+        /* move the listeners out of the way first, then down to where they are expected */
+        for (unsigned i = 0; i < n; i++) {
+            fds[n + i] = fcntl(fds[i], F_DUPFD_CLOEXEC, LISTEN_FDS_START + n);
+        }
+        for (unsigned i = 0; i < n; i++) {
+            dup2(fds[n + i], LISTEN_FDS_START + i);
+        }
+
+        pid[11 + u64toa(getpid(), pid + 11)] = '\0';
+        execve(path, argv, envp);
+        _exit(127);
+    }
+
+    if (child < 0) {
+        ELOG("Failed to fork %s", strerror(errno));
+    }
+
+    free(envp);
+    free(fds);
+    return child;
+}
+int as_arg_exists(uint32_t idx) {
+    lassert(__current_ctx && __current_ctx->sh);
+    return sh_arg_exists(__current_ctx->sh, __current_ctx->vars, idx);
+}
+int as_arg_flag(uint32_t idx) {
     lassert(__current_ctx && __current_ctx->sh);
     return sh_arg_flag(__current_ctx->sh, __current_ctx->vars, idx);
 }
@@ -344,50 +1356,184 @@ uint32_t as_arg_list_string_length(uint32_t idx, uint32_t list_idx) {
     lassert(__current_ctx && __current_ctx->sh);
     return sh_arg_list_string_length(__current_ctx->sh, __current_ctx->vars, idx, list_idx);
 }
+const char* as_header(const char* name, uint32_t* len) {
+    appster_header_id_t id;
+    uint32_t name_len;
+
+    lassert(__current_ctx && name);
+
+    name_len = strlen(name);
+    id = header_intern(name, name_len);
+    if (id != AH_UNKNOWN) {
+        return as_header_id(id, len);
+    }
+
+    for (header_t* h = __current_ctx->headers; h; h = h->next) {
+        if (h->key_len == name_len && !strncasecmp(h->key, name, name_len)) {
+            if (len)
+                *len = h->value_len;
+            return h->value;
+        }
+    }
+
+    return NULL;
+}
+const char* as_header_id(appster_header_id_t id, uint32_t* len) {
+    header_t* h;
+
+    lassert(__current_ctx && id < AH_UNKNOWN);
+
+    h = __current_ctx->known[id];
+    if (!h) {
+        return NULL;
+    }
+
+    if (len)
+        *len = h->value_len;
+    return h->value;
+}
 int as_write(const char* data, int64_t len) {
     lassert(__current_ctx);
-    if (!__current_ctx->send_body)
-        __current_ctx->send_body = evbuffer_new();
     if (len < 0)
         len = strlen(data);
-    return evbuffer_add(__current_ctx->send_body, data, len);
+    if (evbuffer_add(output_buffer(__current_ctx), data, len))
+        return -1;
+    return stream_pressure(__current_ctx);
+}
+int as_write_header(const char* name, const char* value) {
+    context_t* ctx = __current_ctx;
+    size_t name_len, value_len;
+    char* block,* key;
+
+    lassert(ctx && name && value);
+
+    name_len = strlen(name);
+    value_len = strlen(value);
+
+    /* the head of a stream is out already, framing is ours */
+    if (ctx->flag.streaming || strpbrk(name, "\r\n:") || strpbrk(value, "\r\n") ||
+        header_intern(name, name_len) == AH_CONTENT_LENGTH ||
+        header_intern(name, name_len) == AH_TRANSFER_ENCODING ||
+        header_intern(name, name_len) == AH_CONNECTION) {
+        return -1;
+    }
+
+    /* the lowercased name is kept behind the value, freeing the value frees both */
+    block = malloc(value_len + name_len + 2);
+    memcpy(block, value, value_len + 1);
+    key = block + value_len + 1;
+    for (size_t i = 0; i <= name_len; i++) {
+        key[i] = tolower((unsigned char) name[i]);
+    }
+
+    if (!ctx->send_headers) {
+        ctx->send_headers = hm_alloc(8, NULL, NULL);
+    }
+    free(hm_remove(ctx->send_headers, key));
+    hm_put(ctx->send_headers, key, block);
+
+    return 0;
 }
 int as_write_f(const char* format, ...) {
     lassert(__current_ctx);
     int rc;
     va_list ap;
 
-    lassert(__current_ctx);
-    if (!__current_ctx->send_body)
-        __current_ctx->send_body = evbuffer_new();
-
     va_start(ap, format);
-    rc = evbuffer_add_vprintf(__current_ctx->send_body, format, ap);
+    rc = evbuffer_add_vprintf(output_buffer(__current_ctx), format, ap);
     va_end(ap);
-    return rc;
+
+    if (rc < 0)
+        return rc;
+    return stream_pressure(__current_ctx);
 }
 int as_write_fd(int fd, int64_t offset, int64_t len) {
     lassert(__current_ctx);
-    if (!__current_ctx->send_body)
-        __current_ctx->send_body = evbuffer_new();
-
-    return evbuffer_add_file(__current_ctx->send_body, fd, offset, len);
+    __current_ctx->flag.has_file = 1;
+    if (evbuffer_add_file(file_buffer(__current_ctx), fd, offset, len))
+        return -1;
+    return stream_pressure(__current_ctx);
 }
 int as_write_file(const char* path, int64_t offset, int64_t len) {
+    struct stat st;
     int fd;
 
     fd = open(path, O_RDONLY);
-    if (fd != -1)
-        return as_write_fd(fd, offset, len);
+    if (fd == -1) {
+        ELOG("Failed to open file: %s", strerror(errno));
+        return -1;
+    }
 
-    ELOG("Failed to open file: %s", strerror(errno));
-    return -1;
+    /* a whole file replied on its own may go out compressed, it's mapped then */
+    if (offset == 0 && len < 0 && !fstat(fd, &st) && file_zippable(__current_ctx, &st)) {
+        __current_ctx->flag.has_file = 1;
+        if (evbuffer_add_file(output_buffer(__current_ctx), fd, 0, -1))
+            return -1;
+        compress_file(__current_ctx, path, &st);
+        return 0;
+    }
+
+    if (as_write_fd(fd, offset, len))
+        return -1;
+
+    return 0;
+}
+int as_write_flush() {
+    lassert(__current_ctx);
+    if (!__current_ctx->flag.streaming)
+        return as_stream_begin(200);
+    return stream_flush(__current_ctx, 0);
+}
+int as_stream_begin(int status) {
+    context_t* ctx = __current_ctx;
+    char head[REPLY_HEAD_SIZE];
+    uint32_t head_len;
+    int encoding;
+
+    lassert(ctx);
+    lassert(!ctx->flag.streaming);
+
+    /* a stream is not kept, whoever waits for it runs the route */
+    cache_abandon(ctx);
+
+    if (ctx->flag.connection_closed)
+        return -1;
+
+    record_latency(ctx, METRICS_REQUEST, status, ctx->ready);
+    ctx->flag.streaming = 1;
+    if (ctx->flag.http10) { /* the end of the body is the end of connection */
+        ctx->flag.should_keepalive = 0;
+    }
+
+    /* whatever was written so far is the first chunk */
+    ctx->chunk = ctx->send_body;
+    ctx->send_body = NULL;
+
+    /* a stream of unknown length is compressed whatever its size, unless it
+       starts with a file that is not mapped */
+    encoding = ctx->flag.sendfile ? ZIP_IDENTITY : reply_encoding(ctx, status);
+    if (encoding) {
+        ctx->zs = zp_get(ctx->con->loop->zip, encoding);
+        ctx->flag.encoding = ctx->zs ? encoding : ZIP_IDENTITY;
+    }
+
+    if (ctx->con->h2) {
+        http2_reply(ctx, status);
+    } else {
+        head_len = render_head(ctx, status, head);
+        buffer_reply(ctx, head, head_len);
+    }
+
+    return stream_flush(ctx, 0);
 }
 int64_t as_read(char* where, int64_t max) {
     context_t* ctx = __current_ctx;
     int rc = 0, tp;
 
     lassert(ctx);
+    if (ctx->flag.body_too_large) {
+        return -1;
+    }
     if (!ctx->body) { /* no body!!! */
         return 0;
     }
@@ -398,70 +1544,101 @@ int64_t as_read(char* where, int64_t max) {
         goto check_and_free;
     }
 
-    ctx->read_ch = as_channel_alloc();
-
-    uv_poll_start(&ctx->con->handle, UV_READABLE, read_poll);
-
     while (evbuffer_get_length(ctx->body) < max && !ctx->flag.body_done) {
-        as_channel_pass(ctx->read_ch); /* wait for a signal */
-
-        if (!ctx->flag.connection_closed) {
-            /* read the data right away to avoid the buffering */
-            tp = evbuffer_remove(ctx->body, where + rc, max);
-            max -= tp;
-            rc += tp;
-        } else {
-            break; /* break if the connection closed */
+        if (body_wait(ctx, read_poll)) {
+            break; /* break if the connection closed or the body is refused */
         }
 
+        /* read the data right away to avoid the buffering */
+        tp = evbuffer_remove(ctx->body, where + rc, max);
+        max -= tp;
+        rc += tp;
+
         /* if the entire body has been read, stop reading */
     }
 
-    as_channel_free(ctx->read_ch); /* close the signal handler */
-
-    __current_ctx = ctx;
-
 check_and_free:
-    if (ctx->flag.body_done) {
+    if (ctx->flag.body_done && ctx->body) {
         if (!evbuffer_get_length(ctx->body)) {
-            evbuffer_free(ctx->body);
+            buffer_put(ctx->con, ctx->body);
             ctx->body = NULL;
         }
     }
 
-    /* stop reading the connection if not closed */
+    /* stop reading the connection if not closed, HTTP/2 reads for the other streams */
     if (!ctx->flag.connection_closed) {
-        uv_poll_stop(&ctx->con->handle);
+        if (!ctx->con->writing && !ctx->con->h2) {
+            uv_poll_stop(&ctx->con->handle);
+        }
     } else {
         /* otherwise signal connection closure */
         return -1;
     }
 
-    return rc;
+    return ctx->flag.body_too_large ? -1 : rc;
 }
 int64_t as_read_to_fd(int fd, int64_t max) {
-    int rc = 0, seg = 0;
-    int64_t tot = 0;
+    context_t* ctx = __current_ctx;
+    int64_t tot = 0, rc = 0;
 
+    lassert(ctx);
     if (max <= 0)
         return max;
+    if (ctx->flag.body_too_large)
+        return -1;
+    if (!ctx->body) /* no body!!! */
+        return 0;
 
-    do {
-        max -= rc;
-        tot += rc;
-        seg = MIN(max, 1024);
+    ctx->flag.splicing = body_can_splice(ctx, fd);
 
-        char buf[seg];
-        rc = as_read(buf, seg);
+    while (tot < max) {
+        /* what is parsed already goes first, written right from the buffer */
+        if (evbuffer_get_length(ctx->body)) {
+            rc = evbuffer_write_atmost(ctx->body, fd, max - tot);
+            if (rc < 0) {
+                ELOG("Failed to write body %s", strerror(errno));
+                break;
+            }
+            tot += rc;
+            continue;
+        }
 
-        DLOG("Writing %d %d", rc, seg);
-        if (rc > 0)
-            rc = write(fd, buf, rc);
+        if (ctx->flag.body_done) {
+            break;
+        }
 
-    } while (rc > 0 && rc == seg);
+        /* the parser is done with the read data when not reading */
+        if (ctx->flag.splicing && !ctx->con->reading && !ctx->con->writing) {
+            rc = splice_body(ctx, fd, max - tot);
+            if (rc < 0) {
+                break;
+            }
+            if (rc > 0) {
+                tot += rc;
+                continue;
+            }
+        }
 
-    if (rc < 0)
-        return rc;
+        rc = body_wait(ctx, read_poll);
+        if (rc) {
+            break;
+        }
+    }
+
+    ctx->flag.splicing = 0;
+
+    if (ctx->flag.body_done && ctx->body && !evbuffer_get_length(ctx->body)) {
+        buffer_put(ctx->con, ctx->body);
+        ctx->body = NULL;
+    }
+
+    /* stop reading the connection if not closed */
+    if (!ctx->flag.connection_closed && !ctx->con->writing && !ctx->con->h2) {
+        uv_poll_stop(&ctx->con->handle);
+    }
+
+    if (rc < 0 || ctx->flag.connection_closed || ctx->flag.body_too_large)
+        return -1;
 
     return tot;
 }
@@ -493,7 +1670,14 @@ int as_module_init(appster_t* a, as_module_init_cb_t cb) {
 }
 appster_channel_t as_channel_alloc() {
     appster_channel_t ch;
-    int rc = chmake(ch.ch);
+    int rc;
+
+    /* a recycled channel is idle on both ends, hand it out again */
+    if (__channels_count) {
+        return __channels[--__channels_count];
+    }
+
+    rc = chmake(ch.ch);
     if(rc == -1) {
         perror("Cannot create channel");
         exit(1);
@@ -522,7 +1706,7 @@ void* as_channel_recv(appster_channel_t ch) {
 
     __current_ctx = ctx;
 
-    as_channel_free(ch);
+    channel_recycle(ch);
     return rc;
 }
 void* as_channel_pass(appster_channel_t ch) {
@@ -536,451 +1720,3589 @@ void* as_channel_pass(appster_channel_t ch) {
 int as_channel_good(appster_channel_t ch) {
     return (ch.ch[0] != -1 && ch.ch[1] != -1);
 }
-
-void to_lower(char* str) {
-    for(int i = 0; str[i]; i++){
-      str[i] = tolower(str[i]);
+void channel_recycle(appster_channel_t ch) {
+    /*
+     Only called once the single message a channel carries was received, the
+     sender is done with it and nobody else knows the handles. A channel freed
+     by its owner may still be in a late sender's hands and is closed instead.
+     */
+    if (__channels_count < CHANNEL_CACHE) {
+        __channels[__channels_count++] = ch;
+        return;
     }
+
+    as_channel_free(ch);
 }
+
 int hm_cb_free(const void* key, void* value, void* context) {
     if (context)
         free((void*)key);
     free(value);
     return 1;
 }
-int hm_cb_sh_free(const void* key, void* value, void* context) {
-    sh_free(value);
-    return 1;
+appster_header_id_t header_intern(const char* name, uint32_t len) {
+    for (int i = 0; i < AH_UNKNOWN; i++) {
+        if (header_names[i].len == len &&
+            !strncasecmp(header_names[i].name, name, len)) {
+            return i;
+        }
+    }
+
+    return AH_UNKNOWN;
+}
+int method_intern(const char* name, uint32_t len) {
+    for (int i = 0; i < (int) (sizeof(method_names) / sizeof(method_names[0])); i++) {
+        if (method_names[i].len == len && !memcmp(method_names[i].name, name, len)) {
+            return i;
+        }
+    }
+
+    return -1;
 }
 int basic_error(void* data) {
     return 500;
 }
 void send_reply(context_t* ctx, int status) {
-    evbuffer_t* buf;
-    int err;
-
-    buf = evbuffer_new();
-
-    evbuffer_add_printf(buf,
-                        "HTTP/1.1 %d %s\r\n"
-                        "Content-Length: %zu\r\n"
-                        "Connnection: keep-alive\r\n",
-                        status, http_status_str(status),
-                        ctx->send_body
-                            ? evbuffer_get_length(ctx->send_body)
-                            : (size_t) 0
-                        );
+    connection_t* con = ctx->con;
+    struct evbuffer_iovec iov[REPLY_IOV_MAX]; /* same layout as iovec */
+    char head[REPLY_HEAD_SIZE];
+    size_t head_len, body_len;
+    ssize_t n;
+    int cnt = 0, err;
+
+    /* a cached reply is compressed already */
+    if (!ctx->cached) {
+        compress_reply(ctx, status);
+    }
+    if (ctx->fill) {
+        cache_fill(ctx, status);
+    }
+    record_latency(ctx, METRICS_REQUEST, status, ctx->ready);
 
-    /* remove content length header if present */
-    free(hm_remove(ctx->send_headers, "content-length"));
+    if (con->h2) {
+        http2_reply(ctx, status);
+        return;
+    }
 
-    /* send headers if present */
-    hm_foreach(ctx->send_headers, add_header, ctx->send_body);
-    hm_foreach(ctx->send_headers, hm_cb_free, 0);
-    hm_free(ctx->send_headers);
-    ctx->send_headers = NULL;
+    head_len = render_head(ctx, status, head);
 
-    evbuffer_add(buf, "\r\n", 2);
-    if (ctx->send_body) {
-        evbuffer_add_buffer(buf, ctx->send_body);
-        evbuffer_free(ctx->send_body);
+    /* the head of a HEAD reply has the length of the body it goes without */
+    if (ctx->method == HTTP_HEAD && ctx->send_body) {
+        buffer_put(con, ctx->send_body);
+        ctx->send_body = NULL;
+        ctx->flag.has_file = 0;
     }
 
-    ctx->send_body = buf;
+    body_len = ctx->send_body ? evbuffer_get_length(ctx->send_body) : 0;
 
-    err = write_connection(ctx->con, buf);
-    if (err != 0) {
-    #ifdef HAS_CRYPTO
-        err = crypto_error_needs_data_only(ctx->con->ssl, err);
-        if (err) {
-            uv_poll_start(&ctx->con->handle, err, write_poll);
-        } else {
-            uv_close((uv_handle_t*) &ctx->con->handle, free_connection);
+    /* replies of pipelined requests go out in order, wait for our turn */
+    if (ctx != parser_get_context(con->parser)) {
+        buffer_reply(ctx, head, head_len);
+        ctx->flag.reply_ready = 1;
+
+        /* the front may be out already and only wait for the loop to retire it */
+        if (parser_get_context(con->parser)->flag.replied &&
+            !con->reading && !con->dispatching && !con->writing) {
+            uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
         }
-    #endif
-    } else {
-        uv_poll_start(&ctx->con->handle, UV_WRITABLE, write_poll);
+        return;
     }
-}
-int add_header(const void* key, void* value, void* context) {
-    evbuffer_add_printf(context, "%s: %s\r\n", (const char*)key, (char*)value);
-    return 1;
-}
-void execute_context() {
-    /*
-     This code is executed in coroutine. It's best to keep the stack as low
-     as possible.
-     */
 
-    int status;
-    context_t* ctx;
-    appster_t* a;
-
-    ctx = __current_ctx;
-    a = ctx->appster;
+#ifdef HAS_CRYPTO
+    if (con->ssl && !con->ktls) {
+        goto buffered;
+    }
+#endif
 
-    if (ctx->flag.parse_error) {
-        error_cb_t* cb = NULL;
+    /*
+     Small replies are written right away with the head and the body chains in
+     a single writev. Poll for writability only if the socket did not take it
+     all. File segments and user headers go through the buffered path.
+     */
+    if (ctx->flag.has_file || ctx->send_headers) {
+        goto buffered;
+    }
+#ifdef HAS_IO_URING
+    if (con->loop->ring) { /* the ring writes from the reply buffer */
+        goto buffered;
+    }
+#endif
 
-        if (ctx->sh) { /* it may be that no shema is set */
-            cb = hm_get(a->error_cbs, sh_get_path(ctx->sh));
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    if (body_len) {
+        cnt = evbuffer_peek(ctx->send_body, body_len, NULL, iov + 1, REPLY_IOV_MAX - 1);
+        if (cnt >= REPLY_IOV_MAX) {
+            goto buffered;
         }
+    }
 
-        if (!cb || !cb->cb) { /* assign default error cb */
-            cb = a->general_error_cb;
+    n = writev(con->fd, (struct iovec*) iov, cnt + 1);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            DLOG("Failed to write reply %s", strerror(errno));
+            close_connection(con);
+            return;
         }
+        n = 0;
+    }
 
-        cb->cb(cb->user_data);
+    if (n == head_len + body_len) {
+        buffer_put(con, ctx->send_body);
+        ctx->send_body = NULL;
+        reply_done(ctx);
+        return;
+    }
 
-        DLOG("Closing connection due error");
-        status = 0; /* close the connection */
+    /* partial write, the rest is left for write_poll */
+    if (!ctx->send_body) {
+        ctx->send_body = buffer_get(con);
+    }
+    if (n < head_len) {
+        evbuffer_prepend(ctx->send_body, head + n, head_len - n);
     } else {
-        status = sh_call_cb(ctx->sh);
+        evbuffer_drain(ctx->send_body, n - head_len);
     }
 
-    __current_ctx = NULL;
+    con->writing = 1;
+    uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
+    return;
 
-    if (status > 0 && !ctx->flag.connection_closed) {
-        send_reply(ctx, status);
+buffered:
+    buffer_reply(ctx, head, head_len);
+
+    con->writing = 1;
+#ifdef HAS_IO_URING
+    if (ring_send(ctx) == 0) {
+        return;
+    }
+#endif
+    err = write_connection(con, ctx->send_body);
+    if (err != 0) {
+    #ifdef HAS_CRYPTO
+        if (con->ssl && !con->ktls) {
+            err = crypto_error_needs_data_only(con->ssl, err);
+            if (err) {
+                uv_poll_start(&con->handle, err, write_poll);
+                return;
+            }
+        }
+    #endif
+        close_connection(con);
     } else {
-        uv_close((uv_handle_t*)&ctx->con->handle, free_connection);
+        uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
     }
 }
-void bind_listener(uv_loop_t* loop, const addr_t* ad, int backlog) {
-    int fd, one = 1;
-    listener_t* lsnr = calloc(1, sizeof(listener_t));
-    appster_t* a;
+void buffer_reply(context_t* ctx, const char* head, size_t head_len) {
+    connection_t* con = ctx->con;
+    evbuffer_t* buf;
 
-    a = loop->data;
+    buf = buffer_get(con);
+    evbuffer_add(buf, head, head_len);
 
-    fd = socket(ad->af, SOCK_STREAM, 0);
-    if (fd < 0) {
-        FLOG("Failed to create TCP socket %s", strerror(errno));
-    }
+    /* send headers if present */
+    if (ctx->send_headers) {
+        /* remove content length header if present */
+        free(hm_remove(ctx->send_headers, "content-length"));
 
-    uv_poll_init(loop, &lsnr->handle, fd);
+        hm_foreach(ctx->send_headers, add_header, buf);
+        hm_foreach(ctx->send_headers, hm_cb_free, 0);
+        hm_free(ctx->send_headers);
+        ctx->send_headers = NULL;
 
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
-        FLOG("Failed to set SO_REUSEPORT %s", strerror(errno));
+        evbuffer_add(buf, "\r\n", 2);
+    }
+    if (ctx->send_body) {
+        evbuffer_add_buffer(buf, ctx->send_body);
+        buffer_put(con, ctx->send_body);
     }
 
-    if (bind(fd, ad->sa, ad->af == AF_INET ? sizeof(ad->sin) : sizeof(ad->sin6)) != 0) {
-        FLOG("Failed to bind on specified listen port: %s", strerror(errno));
+    ctx->send_body = buf;
+}
+uint32_t render_head(context_t* ctx, int status, char* dst) {
+    loop_t* loop = ctx->con->loop;
+    char* it;
+
+    /* everything but the user headers is copied from pre-rendered pieces */
+    it = put_status_line(dst, status);
+
+    if (!ctx->flag.streaming) {
+        if (status >= 200 && status != 204 && status != 304) { /* these never have a body */
+            memcpy(it, "Content-Length: ", 16);
+            it += 16;
+            it += u64toa(ctx->send_body ? evbuffer_get_length(ctx->send_body) : 0, it);
+            memcpy(it, "\r\n", 2);
+            it += 2;
+        }
+    } else if (!ctx->flag.http10) {
+        memcpy(it, "Transfer-Encoding: chunked\r\n", 28);
+        it += 28;
     }
 
-    if (listen(fd, backlog) != 0) {
-        FLOG("Failed to init listen: %s", strerror(errno));
+    if (ctx->flag.encoding == ZIP_GZIP) {
+        memcpy(it, "Content-Encoding: gzip\r\n", 24);
+        it += 24;
+    } else if (ctx->flag.encoding == ZIP_DEFLATE) {
+        memcpy(it, "Content-Encoding: deflate\r\n", 27);
+        it += 27;
+    }
+    if (ctx->flag.vary) {
+        memcpy(it, "Vary: Accept-Encoding\r\n", 23);
+        it += 23;
+    }
+    if (ctx->file) {
+        it = render_file_head(ctx, status, it);
     }
 
-    lsnr->handle.data = lsnr;
-    lsnr->fd = fd;
-#ifdef HAS_CRYPTO
-    if (a->cert_chain_file && a->key_file) {
-        lsnr->ssl_ctx = crypto_alloc_ctx(CM_SERVER, a->cert_chain_file, a->key_file);
-        if (!lsnr->ssl_ctx) {
-            FLOG("Failed to initialize SSL context");
-        }
-    } else {
-        DLOG("Did not attach SSL context to the listener because of missing cert chain");
+    if (ctx->flag.shed && loop->a->retry_after) {
+        memcpy(it, "Retry-After: ", 13);
+        it += 13;
+        it += u64toa(loop->a->retry_after, it);
+        memcpy(it, "\r\n", 2);
+        it += 2;
+    }
+
+    if (ctx->flag.should_keepalive) {
+        memcpy(it, "Connection: keep-alive\r\n", 24);
+        it += 24;
+    } else {
+        memcpy(it, "Connection: close\r\n", 19);
+        it += 19;
+    }
+
+    memcpy(it, loop->date, loop->date_len);
+    it += loop->date_len;
+    memcpy(it, SERVER_HEADER, sizeof(SERVER_HEADER) - 1);
+    it += sizeof(SERVER_HEADER) - 1;
+
+    /* the user headers of a cached reply where the route put them */
+    if (ctx->cached) {
+        memcpy(it, ctx->cached->head, ctx->cached->head_len);
+        it += ctx->cached->head_len;
+    }
+
+    /* user headers are added on the buffered path */
+    if (!ctx->send_headers) {
+        memcpy(it, "\r\n", 2);
+        it += 2;
+    }
+
+    return it - dst;
+}
+void reply_done(context_t* ctx) {
+    ctx->flag.replied = 1;
+
+    /*
+     When the reply was sent while parsing or while retiring the previous
+     replies, the caller takes care of the context. Otherwise the coroutine was
+     resumed by some other event and the context can't be freed from within
+     the coroutine itself, so let the loop come back with write_poll.
+     */
+    if (!ctx->con->reading && !ctx->con->dispatching) {
+        uv_poll_start(&ctx->con->handle, UV_WRITABLE, write_poll);
+    }
+}
+void complete_replies(connection_t* con) {
+    context_t* ctx;
+
+    con->dispatching = 1;
+
+    while (!vector_is_empty(con->contexts)) {
+        ctx = parser_get_context(con->parser);
+
+        if (!ctx->flag.replied && !ctx->flag.reply_ready) {
+            /* the request may not have been started yet or finish right away */
+            start_contexts(con);
+            if (!ctx->flag.replied && !ctx->flag.reply_ready) {
+                /* a stream that started out of turn gets the wire now */
+                if (ctx->flag.streaming) {
+                    stream_send(ctx);
+                }
+                break;
+            }
+        }
+
+        if (!ctx->flag.replied && write_queued_reply(ctx)) {
+            break;
+        }
+
+        if (!ctx->flag.should_keepalive) {
+            con->dispatching = 0;
+            if (ctx->flag.body_too_large || !ctx->flag.body_done) {
+                linger_connection(con); /* the client may still be sending */
+            } else {
+                close_connection(con);
+            }
+            return;
+        }
+
+        if (!ctx->flag.body_done) {
+            /* answered without reading the whole body, drop the rest */
+            if (ctx->body) {
+                evbuffer_drain(ctx->body, evbuffer_get_length(ctx->body));
+            }
+            con->throttled = 0;
+            arm_timeout(con, &con->timer, con->loop->a->body_timeout);
+            uv_poll_start(&con->handle, UV_READABLE, read_poll);
+            break;
+        }
+
+        vector_pop_front(con->contexts);
+        free_context(ctx);
+
+        /* keep reading while the next requests run, their replies may re-arm */
+        uv_poll_start(&con->handle, UV_READABLE, read_poll);
+    }
+
+    start_contexts(con);
+
+    con->dispatching = 0;
+
+    /* Poll again only when all backlogged requests are complete. */
+    if (vector_is_empty(con->contexts)) {
+        if (con->spoken) { /* the start of a preface waits for the rest */
+            rbuf_release(con);
+        }
+        if (con->loop->stopping) {
+            close_connection(con);
+        } else {
+            arm_timeout(con, &con->timer, con->loop->a->idle_timeout);
+        }
+    }
+}
+int write_queued_reply(context_t* ctx) {
+    connection_t* con = ctx->con;
+
+    ctx->flag.reply_ready = 0;
+
+    if (ctx->flag.abort) {
+        close_connection(con);
+        return -1;
+    }
+
+    con->writing = 1;
+
+#ifdef HAS_CRYPTO
+    if (con->ssl && !con->ktls) { /* write_poll copes with the renegotiation */
+        uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
+        return -1;
     }
-#else
-    (void) a; /* Avoid unused-but-set-variable warning */
 #endif
-    uv_poll_start(&lsnr->handle, UV_READABLE, accept_poll);
+#ifdef HAS_IO_URING
+    if (ring_send(ctx) == 0) { /* send_complete retires it */
+        return -1;
+    }
+#endif
+
+    if (evbuffer_write(ctx->send_body, con->fd) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        DLOG("Failed to write reply %s", strerror(errno));
+        close_connection(con);
+        return -1;
+    }
+
+    if (evbuffer_get_length(ctx->send_body)) {
+        uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
+        return -1;
+    }
+
+    con->writing = 0;
+    ctx->flag.replied = 1;
+    return 0;
 }
-void run_loop(void* lv) {
-    appster_t* a;
-    uv_loop_t* loop;
-    int err;
+void start_contexts(connection_t* con) {
+    context_t* ctx;
+    uint32_t running = 0, depth;
 
-    loop = lv;
-    a = loop->data;
+    depth = con->loop->a->pipeline_depth;
 
-    VECTOR_FOR_EACH(a->modules, module) {
-        appster_module_t* m;
+    /*
+     Run the parsed requests in order, at most depth of them at once. Only the
+     front request writes to the wire, the others queue their replies.
+     */
+    for (uint32_t i = 0; i < vector_size(con->contexts); i++) {
+        ctx = VECTOR_GET_AS(context_t*, con->contexts, i);
 
-        m = ITERATOR_GET_AS(appster_module_t*, &module);
-        if (m->init_loop_cb) {
-            m->init_loop_cb(loop);
+        if (!ctx->flag.headers_done) {
+            break;
+        }
+
+        if (ctx->handle == -1 && !ctx->flag.done && !ctx->waiter.fill) {
+            if (running == depth) {
+                break;
+            }
+
+            /* answered from the cache or waiting for it, start over likewise */
+            if (cache_lookup(ctx)) {
+                i = -1;
+                running = 0;
+                continue;
+            }
+
+            if (!admit_context(ctx)) {
+                shed_context(ctx);
+                continue;
+            }
+
+            run_context(ctx);
+
+            /* the coroutine may have retired replies, start over */
+            i = -1;
+            running = 0;
+            continue;
+        }
+
+        if (!ctx->flag.reply_ready && !ctx->flag.replied) {
+            running++;
         }
     }
+}
+void run_context(context_t* ctx) {
+    loop_t* loop = ctx->con->loop;
+    size_t size;
 
-    DLOG("Running event loop");
+    loop->inflight.count++;
+    if (ctx->sh) {
+        loop->routes[sh_get_index(ctx->sh)].count++;
+    }
+    ctx->start = uv_hrtime();
 
-    err = uv_run(loop, UV_RUN_DEFAULT);
-    if (err != 0) {
-        ELOG("Failed to run uv loop %s", uv_strerror(err));
+    size = ctx->sh ? sh_get_stack_size(ctx->sh) : 0;
+    ctx->stack = sp_get(loop->stacks, size ? size : loop->a->stack_size);
+
+    __current_ctx = ctx;
+    if (ctx->stack) {
+        ctx->handle = go_mem(execute_context(), ctx->stack->mem, ctx->stack->size);
     } else {
-        ELOG("Run complete");
+        ctx->handle = go(execute_context());
     }
+}
+evbuffer_t* output_buffer(context_t* ctx) {
+    evbuffer_t** buf;
 
-    VECTOR_FOR_EACH(a->modules, module) {
-        appster_module_t* m;
+    buf = ctx->flag.streaming ? &ctx->chunk : &ctx->send_body;
+    if (!*buf) {
+        *buf = buffer_get(ctx->con);
+    }
+    return *buf;
+}
+evbuffer_t* file_buffer(context_t* ctx) {
+    connection_t* con = ctx->con;
+    evbuffer_t* buf = output_buffer(ctx);
 
-        m = ITERATOR_GET_AS(appster_module_t*, &module);
-        if (m->free_loop_cb) {
-            m->free_loop_cb(loop);
+    /*
+     A buffer written straight to the socket sends its files with sendfile.
+     TLS in user space, HTTP/2 framing and compression read the data, the
+     file is mapped for them instead.
+     */
+#ifdef HAS_CRYPTO
+    if (con->ssl && !con->ktls) {
+        return buf;
+    }
+#endif
+    if (!con->h2 && !ctx->zs) {
+        evbuffer_set_flags(buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+        ctx->flag.sendfile = 1;
+    }
+    return buf;
+}
+int stream_pressure(context_t* ctx) {
+    if (!ctx->flag.streaming) {
+        return 0;
+    }
+    if (ctx->flag.connection_closed) {
+        return -1;
+    }
+    if (evbuffer_get_length(ctx->chunk) < STREAM_CHUNK_SIZE) {
+        return 0;
+    }
+    return stream_flush(ctx, 0);
+}
+int stream_flush(context_t* ctx, int final) {
+    char size[20];
+    size_t len;
+    uint32_t n;
+    int chunked;
+
+    if (ctx->flag.connection_closed) {
+        return -1;
+    }
+
+    /* HTTP/2 frames the data itself, a HEAD reply has none */
+    chunked = !ctx->flag.http10 && !ctx->con->h2 && ctx->method != HTTP_HEAD;
+
+    if (ctx->zs && compress_chunk(ctx, final)) {
+        ctx->flag.connection_closed = 1;
+        close_connection(ctx->con);
+        return -1;
+    }
+    if (ctx->method == HTTP_HEAD && ctx->chunk) {
+        evbuffer_drain(ctx->chunk, evbuffer_get_length(ctx->chunk));
+    }
+
+    /* send_body holds the framed output, chunk the data staged since */
+    len = ctx->chunk ? evbuffer_get_length(ctx->chunk) : 0;
+    if (len) {
+        if (chunked) {
+            n = u64tox(len, size);
+            memcpy(size + n, "\r\n", 2);
+            evbuffer_add(ctx->send_body, size, n + 2);
+        }
+        evbuffer_add_buffer(ctx->send_body, ctx->chunk);
+        if (chunked) {
+            evbuffer_add(ctx->send_body, "\r\n", 2);
+        }
+    }
+
+    if (final) {
+        if (chunked) {
+            evbuffer_add(ctx->send_body, "0\r\n\r\n", 5);
+        }
+        ctx->flag.stream_done = 1;
+
+        if (!ctx->con->h2 && ctx != parser_get_context(ctx->con->parser)) {
+            ctx->flag.reply_ready = 1;
+            return 0;
         }
     }
+
+    stream_send(ctx);
+
+    return final ? 0 : stream_wait(ctx);
 }
-void accept_poll(uv_poll_t* handle, int status, int events) {
-    int fd, err;
-    listener_t* lsnr;
-    addr_t addr;
-    socklen_t len = sizeof(addr);
-    connection_t* con;
+void stream_send(context_t* ctx) {
+    connection_t* con = ctx->con;
+    int err;
 
-    lsnr = handle->data;
+    if (con->h2) { /* streams share the wire, http2_flush takes turns */
+        http2_kick(con);
+        return;
+    }
 
-    if (status < 0) {
-        ELOG("uv error %s", uv_strerror(status));
+    /* earlier replies or the write in progress come back for the rest */
+    if (ctx != parser_get_context(con->parser) || con->writing ||
+        uv_is_closing((uv_handle_t*) &con->handle)) {
+        return;
+    }
+    if (!evbuffer_get_length(ctx->send_body) && !ctx->flag.stream_done) {
         return;
     }
 
-    fd = accept(lsnr->fd, addr.sa, &len);
+    con->writing = 1;
 
-    if (fd == -1) {
-        ELOG("Error accepting new connection: %s", strerror(errno));
+#ifdef HAS_CRYPTO
+    if (con->ssl && !con->ktls) { /* write_poll copes with the renegotiation */
+        uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
         return;
     }
+#endif
 
-    con = calloc(1, sizeof(connection_t));
-
-    err = uv_poll_init(handle->loop, &con->handle, fd);
+    /* write_poll retires the reply or resumes reading once this is out */
+    err = write_connection(con, ctx->send_body);
     if (err != 0) {
-        ELOG("Failed to accept on tcp socket %s", uv_strerror(err));
-        free(con);
-        close(fd);
+        ctx->flag.connection_closed = 1;
+        close_connection(con);
     } else {
-        http_parser_init(con->parser, HTTP_REQUEST);
-        vector_setup(con->contexts, 5, sizeof(context_t*));
+        uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
+    }
+}
+int stream_wait(context_t* ctx) {
+    void* msg;
+    int rc;
 
-        con->handle.data = con;
-        con->parser->data = con;
-        con->fd = fd;
+    while (!ctx->flag.connection_closed &&
+           evbuffer_get_length(ctx->send_body) > STREAM_HIGH_WATERMARK) {
+        ctx->write_ch = as_channel_alloc();
 
-    #ifdef HAS_CRYPTO
-        if (lsnr->ssl_ctx) {
-            con->ssl = crypto_alloc_ssl(lsnr->ssl_ctx, con->fd, CM_SERVER);
-            if (!con->ssl) {
-                ELOG("SSL alloc error!");
-                uv_close((uv_handle_t*) &con->handle, free_connection);
-                return;
-            }
+        /* canceled when the connection goes away while we wait */
+        rc = chrecv(ctx->write_ch.ch[0], &msg, sizeof(void*), -1);
+
+        if (rc == 0) {
+            channel_recycle(ctx->write_ch);
+        } else {
+            as_channel_free(ctx->write_ch);
+        }
+        ctx->write_ch.ch[0] = -1;
+        ctx->write_ch.ch[1] = -1;
+        __current_ctx = ctx;
+
+        if (rc != 0) {
+            ctx->flag.connection_closed = 1;
         }
-    #endif
-        uv_poll_start(&con->handle, UV_READABLE, read_poll);
-        DLOG("Accepted new connection and reading data...");
     }
+
+    return ctx->flag.connection_closed ? -1 : 0;
 }
-void error_poll(uv_poll_t* handle) {
-    connection_t* con = handle->data;
-    context_t* ctx;
+void stream_wake(context_t* ctx) {
+    if (as_channel_good(ctx->write_ch)) {
+        as_channel_send(ctx->write_ch, NULL);
+    }
+}
+void prepare_route(schema_t* sh, void* user_data) {
+    appster_t* a = user_data;
+    route_cache_t* cache;
+    uint32_t* limit;
+    size_t* size;
 
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        /* Ignore EAGAIN */
-        return;
+    sh_set_index(sh, a->nroutes++);
+
+    size = hm_get(a->stack_sizes, sh_get_path(sh));
+    if (size) {
+        sh_set_stack_size(sh, *size);
     }
 
-    DLOG("Got ERROR on connection, closing; error: %s", strerror(errno));
+    limit = hm_get(a->inflight_limits, sh_get_path(sh));
+    if (limit) {
+        sh_set_max_inflight(sh, *limit);
+    }
 
-    if (vector_size(con->contexts)) {
-        ctx = parser_get_context(con->parser);
+    cache = hm_get(a->route_caches, sh_get_path(sh));
+    if (cache && cache->ttl && cache->size) {
+        sh_set_cache(sh, cache->ttl, cache->size);
+    }
+}
+void prepare_route_load(schema_t* sh, void* user_data) {
+    loop_t* loop = user_data;
+    inflight_t* in;
 
-        if (as_channel_good(ctx->read_ch)) { /* expecting a read */
-            ctx->flag.body_done = 1;
-            ctx->flag.connection_closed = 1;
-            as_channel_send(ctx->read_ch, NULL);
-            return; /* close the connection after callback is finished */
-        }
+    in = &loop->routes[sh_get_index(sh)];
+    in->max = sh_get_max_inflight(sh);
+    in->limit = in->max;
+
+    if (sh_get_cache_ttl(sh)) {
+        loop->caches[sh_get_index(sh)] = mc_alloc(sh_get_cache_ttl(sh), sh_get_cache_size(sh));
     }
+}
+int admit_context(context_t* ctx) {
+    loop_t* loop = ctx->con->loop;
+    inflight_t* route;
 
-    uv_close((uv_handle_t*) handle, free_connection);
+    /* errors are answered by their own callbacks, they are never shed */
+    if (ctx->flag.parse_error || ctx->flag.body_too_large || !ctx->sh) {
+        return 1;
+    }
+
+    if (loop->inflight.max && loop->inflight.count >= (uint32_t) loop->inflight.limit) {
+        return 0;
+    }
+
+    route = &loop->routes[sh_get_index(ctx->sh)];
+    return !route->max || route->count < (uint32_t) route->limit;
 }
-void read_poll(uv_poll_t* handle, int status, int events) {
-    connection_t* con = handle->data;
-    int nread;
-    char buf[16 * 1024];
+void shed_context(context_t* ctx) {
+    ctx->flag.done = 1; /* never started */
+    ctx->flag.shed = 1;
+    ctx->con->loop->stats.shed++;
 
-    if (status < 0) {
-        ELOG("uv error %s", uv_strerror(status));
+    send_reply(ctx, 503);
+}
+void finish_route(context_t* ctx) {
+    loop_t* loop = ctx->con->loop;
+    uint64_t now, target;
+
+    if (ctx->flag.done) {
         return;
     }
 
-#ifdef HAS_CRYPTO
-    if (con->ssl) {
-        while ((nread = crypto_read(con->ssl, buf, sizeof(buf))) > 0) {
-            if (nread != http_parser_execute(con->parser, &incoming, buf, nread)) {
-                DLOG("Closing connection due http error");
-                uv_close((uv_handle_t*) handle, free_connection);
-                return;
-            }
+    ctx->flag.done = 1;
+
+    loop->inflight.count--;
+    if (ctx->sh) {
+        loop->routes[sh_get_index(ctx->sh)].count--;
+    }
+
+    target = loop->a->target_latency * 1000000ULL;
+    if (target) {
+        now = uv_hrtime();
+        inflight_adapt(&loop->inflight, now - ctx->start, target, now);
+        if (ctx->sh) {
+            inflight_adapt(&loop->routes[sh_get_index(ctx->sh)], now - ctx->start, target, now);
         }
-    } else
-        /* read from fd directly */
-#endif
-        while ((nread = read(con->fd, buf, sizeof(buf))) > 0) {
-            if (nread != http_parser_execute(con->parser, &incoming, buf, nread)) {
-                DLOG("Closing connection due http error");
-                uv_close((uv_handle_t*) handle, free_connection);
-                return;
-            }
+    }
+}
+void inflight_adapt(inflight_t* in, uint64_t latency, uint64_t target, uint64_t now) {
+    if (!in->max) {
+        return;
+    }
+
+    /*
+     AIMD: a slow route cuts the limit once per target period, so a burst of
+     slow replies counts once. Fast routes add up to one slot per limit worth
+     of replies.
+     */
+    if (latency > target) {
+        if (now >= in->hold) {
+            in->limit = MAX(1.0, in->limit * INFLIGHT_DECREASE);
+            in->hold = now + target;
         }
+    } else if (in->limit < in->max) {
+        in->limit = MIN((double) in->max, in->limit + 1.0 / in->limit);
+    }
+}
+void close_connection(connection_t* con) {
+    if (!uv_is_closing((uv_handle_t*) &con->handle)) {
+        uv_close((uv_handle_t*) &con->handle, free_connection);
+    }
+}
+void linger_connection(connection_t* con) {
+    /*
+     Closing with unread data makes the kernel reset the connection, the
+     client may then lose the reply before it reads it. Only the write side
+     is shut down, whatever the client still sends is read and dropped for
+     a while before the socket is closed.
+     */
+    if (con->h2 || shutdown(con->fd, SHUT_WR)) {
+        close_connection(con);
+        return;
+    }
 
-    if (nread < 0) {
-    #ifdef HAS_CRYPTO
-        if (con->ssl) {
-            nread = crypto_error_needs_data_only(con->ssl, nread);
-            /*
-             Same as with crypto_write, crypto_read can trigger transparent
-             re-negotiation too. So, to handle it just re-register the events.
-             */
-            if (nread) {
-                uv_poll_start(handle, nread, read_poll);
-            }
-        } else
-    #endif
-            error_poll(handle);
-    } else if (nread == 0) {
-        uv_close((uv_handle_t*) handle, free_connection);
-    } else {
-    #ifdef HAS_CRYPTO
-        /*
-         Extra step to make sure we are not left in WRITABLE state after
-         re-negotiation. No SYSCALL is made because libuv short circuits when
-         events are unchanged.
-         */
-        uv_poll_start(handle, UV_READABLE, read_poll);
-    #endif
+    VECTOR_FOR_EACH(con->contexts, it) {
+        free_context(ITERATOR_GET_AS(context_t*, &it));
     }
+    vector_clear(con->contexts);
+    rbuf_release(con);
+
+    con->lingering = 1;
+    con->linger_left = LINGER_MAX;
+    tw_cancel(&con->request_timer);
+    arm_timeout(con, &con->timer, LINGER_TIMEOUT);
+    uv_poll_start(&con->handle, UV_READABLE, linger_poll);
 }
-void write_poll(uv_poll_t* handle, int status, int events) {
+void linger_poll(uv_poll_t* handle, int status, int events) {
     connection_t* con = handle->data;
-    context_t* ctx;
+    char buf[4096];
+    ssize_t n;
+
+    if (status < 0) {
+        close_connection(con);
+        return;
+    }
+
+    while ((n = read(con->fd, buf, MIN(sizeof(buf), con->linger_left))) > 0) {
+        con->linger_left -= n;
+    }
+
+    /* the client closed too, gave up or sent too much */
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close_connection(con);
+    }
+}
+void arm_timeout(connection_t* con, tw_timer_t* t, uint32_t timeout) {
+    if (timeout) {
+        tw_arm(con->loop->wheel, t, timeout);
+    } else {
+        tw_cancel(t);
+    }
+}
+void run_timeouts(uv_timer_t* timer) {
+    loop_t* loop = timer->data;
+
+    tw_advance(loop->wheel, uv_now(&loop->uv), timeout_expired);
+}
+void timeout_expired(tw_timer_t* t) {
+    connection_t* con = t->data;
+    context_t* ctx;
+    int running = 0;
+
+    if (con->lingering) {
+        close_connection(con);
+        return;
+    }
+
+    DLOG("Connection timed out");
+
+    con->loop->stats.timeouts++;
+    con->expired = 1;
+    tw_cancel(&con->timer);
+    tw_cancel(&con->request_timer);
+
+    /*
+     Canceling a route could leave a module waiting on it forever, so running
+     routes are let finish and the connection is closed after their replies.
+     A route waiting for the body fails the read.
+     */
+    VECTOR_FOR_EACH(con->contexts, it) {
+        ctx = ITERATOR_GET_AS(context_t*, &it);
+        if (ctx->handle != -1 && !ctx->flag.done) {
+            running = 1;
+        }
+        ctx->flag.should_keepalive = 0;
+    }
+
+    if (!running) {
+        close_connection(con);
+        return;
+    }
+
+    ctx = parser_get_active_context(con->parser);
+    if (as_channel_good(ctx->read_ch)) {
+        ctx->flag.body_done = 1;
+        ctx->flag.connection_closed = 1;
+        as_channel_send(ctx->read_ch, NULL);
+    }
+}
+char* put_status_line(char* dst, int status) {
+    if (status >= 100 && status < 600 && status_lines[status - 100].line) {
+        memcpy(dst, status_lines[status - 100].line, status_lines[status - 100].len);
+        return dst + status_lines[status - 100].len;
+    }
+
+    memcpy(dst, "HTTP/1.1 ", 9);
+    dst += 9;
+    dst += u64toa(status, dst);
+    memcpy(dst, " <unknown>\r\n", 12);
+    return dst + 12;
+}
+void update_date(uv_timer_t* timer) {
+    loop_t* loop = timer->data;
+    struct tm tm;
+    time_t now;
+
+    now = time(NULL);
+    gmtime_r(&now, &tm);
+
+    /* RFC 7231 IMF-fixdate */
+    loop->date_len = strftime(loop->date, sizeof(loop->date),
+                              "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+int add_header(const void* key, void* value, void* context) {
+    evbuffer_add_printf(context, "%s: %s\r\n", (const char*)key, (char*)value);
+    return 1;
+}
+void execute_context() {
+    /*
+     This code is executed in coroutine. It's best to keep the stack as low
+     as possible.
+     */
+
+    int status;
+    context_t* ctx;
+    appster_t* a;
+
+    ctx = __current_ctx;
+    a = ctx->appster;
+
+    if (ctx->flag.body_too_large) {
+        status = 413; /* reject_body already made it close the connection */
+    } else if (ctx->allow) {
+        status = method_not_allowed(ctx); /* the connection is closed after it */
+    } else if (ctx->flag.parse_error) {
+        error_cb_t* cb = NULL;
+
+        if (ctx->sh) { /* it may be that no shema is set */
+            cb = hm_get(a->error_cbs, sh_get_path(ctx->sh));
+        }
+
+        if (!cb || !cb->cb) { /* assign default error cb */
+            cb = a->general_error_cb;
+        }
+
+        cb->cb(cb->user_data);
+
+        DLOG("Closing connection due error");
+        status = 0; /* close the connection */
+    } else {
+        status = sh_call_cb(ctx->sh);
+    }
+
+    __current_ctx = NULL;
+    record_latency(ctx, METRICS_ROUTE, status, ctx->start);
+    finish_route(ctx);
+
+    if (status <= 0 || ctx->flag.connection_closed) {
+        cache_abandon(ctx);
+    }
+
+    if (ctx->flag.streaming && status > 0 && !ctx->flag.connection_closed) {
+        stream_flush(ctx, 1);
+    } else if (status > 0 && !ctx->flag.connection_closed) {
+        send_reply(ctx, status);
+    } else if (ctx->con->h2) {
+        /* only the stream is given up, it's reset once retired */
+        ctx->flag.abort = 1;
+        http2_kick(ctx->con);
+    } else if (!ctx->flag.connection_closed && ctx != parser_get_context(ctx->con->parser)) {
+        /* earlier replies are still due, close once they are out */
+        ctx->flag.abort = 1;
+        ctx->flag.reply_ready = 1;
+    } else {
+        close_connection(ctx->con);
+    }
+}
+int get_online_cpus(int* cpus, int max) {
+    int count = 0;
+#ifdef __linux__
+    cpu_set_t set;
+
+    /* honour the affinity mask the process was started with */
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, &set)) {
+                continue;
+            }
+            if (count < max) {
+                cpus[count] = i;
+            }
+            count++;
+        }
+    }
+#endif
+    if (count < 1) {
+        count = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+        for (int i = 0; i < count && i < max; i++) {
+            cpus[i] = i;
+        }
+    }
+
+    return max ? MIN(count, max) : count;
+}
+uint32_t inherit_listeners(appster_t* a) {
+    const char* fds,* pid;
+    uint32_t n;
+    socklen_t len;
+    int fd, listening;
+
+    /* the descriptors are passed like systemd does, LISTEN_PID guards against inheriting them twice */
+    fds = getenv("LISTEN_FDS");
+    pid = getenv("LISTEN_PID");
+    if (!fds || !pid || strtoul(pid, NULL, 10) != (unsigned long) getpid()) {
+        return 0;
+    }
+
+    n = strtoul(fds, NULL, 10);
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (uint32_t i = 0; i < n; i++) {
+        fd = LISTEN_FDS_START + i;
+
+        len = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening) {
+            FLOG("Inherited descriptor %d is not a listening socket", fd);
+        }
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        if (i >= vector_size(a->loops)) {
+            ELOG("No loop takes the inherited listener %d, its queue is lost", fd);
+            close(fd);
+        }
+    }
+
+    DLOG("Inherited %u listeners", n);
+    return MIN(n, vector_size(a->loops));
+}
+int open_listener(loop_t* loop, const addr_t* ad, int backlog) {
+    int fd, one = 1;
+
+    fd = socket(ad->af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        FLOG("Failed to create TCP socket %s", strerror(errno));
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        FLOG("Failed to set SO_REUSEPORT %s", strerror(errno));
+    }
+
+    if (bind(fd, ad->sa, ad->af == AF_INET ? sizeof(ad->sin) : sizeof(ad->sin6)) != 0) {
+        FLOG("Failed to bind on specified listen port: %s", strerror(errno));
+    }
+
+#ifdef SO_INCOMING_CPU
+    if (loop->a->incoming_cpu && loop->cpu >= 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &loop->cpu, sizeof(loop->cpu)) != 0) {
+        ELOG("Failed to set SO_INCOMING_CPU %s", strerror(errno));
+    }
+#endif
+
+    if (listen(fd, backlog) != 0) {
+        FLOG("Failed to init listen: %s", strerror(errno));
+    }
+
+    return fd;
+}
+void bind_listener(loop_t* loop, int fd) {
+    listener_t* lsnr = calloc(1, sizeof(listener_t));
+    appster_t* a;
+
+    a = loop->a;
+
+    uv_poll_init(&loop->uv, &lsnr->handle, fd);
+
+    lsnr->handle.data = lsnr;
+    lsnr->fd = fd;
+    lsnr->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    loop->lsnr = lsnr;
+#ifdef HAS_CRYPTO
+    if (a->ssl_ctx) {
+        lsnr->ssl_ctx = a->ssl_ctx;
+    } else {
+        DLOG("Did not attach SSL context to the listener because of missing cert chain");
+    }
+#else
+    (void) a; /* Avoid unused-but-set-variable warning */
+#endif
+#ifdef HAS_IO_URING
+    /* one multishot accept replaces the readiness poll and the accept calls */
+    lsnr->loop = loop;
+    lsnr->accept_op.cb = accept_complete;
+    lsnr->accept_op.data = lsnr;
+    if (loop->ring && ur_accept_multishot(loop->ring, &lsnr->accept_op, fd) == 0) {
+        lsnr->accepting = 1;
+        return;
+    }
+#endif
+    uv_poll_start(&lsnr->handle, UV_READABLE, accept_poll);
+}
+void free_listener(uv_handle_t* handle) {
+    listener_t* lsnr = handle->data;
+
+#ifdef HAS_IO_URING
+    if (lsnr->accepting) {
+        /*
+         The accept has to be gone before the socket is closed, a new process
+         may be serving it already. Submit right away, the loop may be about
+         to stop.
+         */
+        lsnr->closing = 1;
+        ur_cancel(lsnr->loop->ring, &lsnr->accept_op);
+        ur_submit(lsnr->loop->ring);
+        return;
+    }
+#endif
+
+    /* a process that inherited the socket keeps serving its queue */
+    close(lsnr->fd);
+    if (lsnr->spare_fd != -1) {
+        close(lsnr->spare_fd);
+    }
+    free(lsnr);
+}
+void steer_incoming_cpu(appster_t* a) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+    /*
+     Reuseport group picks a listener by the index returned from the program.
+     Listeners joined the group in loop order, so map the cpu that handled the
+     packet to the loop pinned to it. Unpinned cpus are spread with modulo.
+     */
+    struct sock_filter code[2 * vector_size(a->loops) + 3];
+    struct sock_fprog prog;
+    loop_t* loop;
+    unsigned n = 0;
+
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+    VECTOR_FOR_EACH(a->loops, it) {
+        loop = ITERATOR_GET_AS(loop_t*, &it);
+        if (loop->cpu >= 0) {
+            code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, loop->cpu, 0, 1);
+            code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, loop->idx);
+        }
+    }
+
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, vector_size(a->loops));
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = n;
+    prog.filter = code;
+
+    /* the program is attached to the whole group through any of its members */
+    loop = VECTOR_GET_AS(loop_t*, a->loops, 0);
+    if (setsockopt(loop->lsnr->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        ELOG("Failed to attach reuseport cpu program %s", strerror(errno));
+    }
+#else
+    (void) a;
+    ELOG("Incoming cpu steering is not supported on this platform");
+#endif
+}
+void run_loop(void* lv) {
+    appster_t* a;
+    loop_t* loop;
+    int err;
+
+    loop = lv;
+    a = loop->a;
+
+#ifdef __linux__
+    if (loop->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            ELOG("Failed to pin loop %u to cpu %d: %s", loop->idx, loop->cpu, strerror(err));
+        }
+    }
+#endif
+
+    VECTOR_FOR_EACH(a->modules, module) {
+        appster_module_t* m;
+
+        m = ITERATOR_GET_AS(appster_module_t*, &module);
+        if (m->init_loop_cb) {
+            m->init_loop_cb(&loop->uv);
+        }
+    }
+
+    loop->stacks = sp_alloc(a->stack_keep, a->stack_hugepages);
+    if (a->zip_level) {
+        loop->zip = zp_alloc(a->zip_level, a->zip_cache);
+    }
+    if (a->statics) {
+        loop->files = fc_alloc(a->file_cache, a->file_revalidate);
+        if (fc_fd(loop->files) != -1) {
+            uv_poll_init(&loop->uv, &loop->files_poll, fc_fd(loop->files));
+            loop->files_poll.data = loop;
+            uv_poll_start(&loop->files_poll, UV_READABLE, files_poll);
+            uv_unref((uv_handle_t*) &loop->files_poll);
+        }
+    }
+    loop->inflight.max = a->max_inflight;
+    loop->inflight.limit = a->max_inflight;
+    loop->routes = calloc(a->nroutes, sizeof(inflight_t));
+    loop->caches = calloc(a->nroutes, sizeof(microcache_t*));
+    rt_foreach(a->router, prepare_route_load, loop);
+    sp_reserve(loop->stacks, a->stack_size, a->stack_warm);
+
+    uv_idle_init(&loop->uv, &loop->wake_idle);
+    loop->wake_idle.data = loop;
+
+    /* the Date header is rendered once a second instead of per reply */
+    uv_timer_init(&loop->uv, &loop->date_timer);
+    loop->date_timer.data = loop;
+    update_date(&loop->date_timer);
+    uv_timer_start(&loop->date_timer, update_date, 1000, 1000);
+    uv_unref((uv_handle_t*) &loop->date_timer);
+
+    loop->wheel = tw_alloc(TIMEOUT_TICK_MS, uv_now(&loop->uv));
+    if (a->idle_timeout || a->header_timeout || a->body_timeout || a->request_timeout) {
+        uv_timer_init(&loop->uv, &loop->wheel_timer);
+        loop->wheel_timer.data = loop;
+        uv_timer_start(&loop->wheel_timer, run_timeouts, TIMEOUT_TICK_MS, TIMEOUT_TICK_MS);
+        uv_unref((uv_handle_t*) &loop->wheel_timer);
+    }
+
+    DLOG("Running event loop");
+
+    err = uv_run(&loop->uv, UV_RUN_DEFAULT);
+    if (err != 0) {
+        ELOG("Failed to run uv loop %s", uv_strerror(err));
+    } else {
+        ELOG("Run complete");
+    }
+
+#ifdef HAS_IO_URING
+    /* the listener closes once its canceled accept completes */
+    if (loop->ring) {
+        ur_complete(loop->ring);
+    }
+#endif
+
+    VECTOR_FOR_EACH(a->modules, module) {
+        appster_module_t* m;
+
+        m = ITERATOR_GET_AS(appster_module_t*, &module);
+        if (m->free_loop_cb) {
+            m->free_loop_cb(&loop->uv);
+        }
+    }
+
+    /*
+     The timers, the polls and whatever the modules left open are closed so
+     the loop can be, uv_stop returned before the last closes ran.
+     */
+    uv_walk(&loop->uv, close_handle, NULL);
+    while (uv_run(&loop->uv, UV_RUN_DEFAULT)) {
+        uv_walk(&loop->uv, close_handle, NULL);
+    }
+
+    while (__channels_count) {
+        __channels_count--;
+        hclose(__channels[__channels_count].ch[0]);
+        hclose(__channels[__channels_count].ch[1]);
+    }
+}
+void begin_shutdown(uv_async_t* handle) {
+    loop_t* loop = handle->data;
+    connection_t* con,* next;
+    context_t* ctx;
+
+    if (loop->stopping) {
+        return;
+    }
+
+    DLOG("Shutting down loop %u", loop->idx);
+
+    loop->stopping = 1;
+
+    if (loop->lsnr) {
+        uv_close((uv_handle_t*) &loop->lsnr->handle, free_listener);
+        loop->lsnr = NULL;
+    }
+
+    /*
+     Idle connections go right away. The others finish the requests they have
+     and are closed once the last one is answered, which tells the client with
+     Connection: close when the request did not reply yet. HTTP/2 clients are
+     told with GOAWAY, http2_flush closes once it's out and the streams are done.
+     */
+    for (con = loop->conns; con; con = next) {
+        next = con->next;
+
+        if (con->h2) {
+            h2_goaway(con->h2, H2_NO_ERROR);
+            http2_kick(con);
+        } else if (vector_is_empty(con->contexts)) {
+            close_connection(con);
+        } else {
+            ctx = VECTOR_GET_AS(context_t*, con->contexts, vector_size(con->contexts) - 1);
+            if (ctx->flag.headers_done) {
+                ctx->flag.should_keepalive = 0;
+            }
+        }
+    }
+
+    uv_timer_init(&loop->uv, &loop->stop_timer);
+    loop->stop_timer.data = loop;
+    uv_timer_start(&loop->stop_timer, stop_expired, loop->a->stop_deadline, 0);
+
+    if (!loop->conns) {
+        finish_shutdown(loop);
+    }
+}
+void stop_expired(uv_timer_t* timer) {
+    loop_t* loop = timer->data;
+
+    if (loop->conns) {
+        ELOG("Shutdown deadline of loop %u passed, closing the remaining connections", loop->idx);
+    }
+
+    for (connection_t* con = loop->conns; con; con = con->next) {
+        close_connection(con);
+    }
+}
+void finish_shutdown(loop_t* loop) {
+    if (uv_is_closing((uv_handle_t*) &loop->stop)) {
+        return;
+    }
+
+    uv_close((uv_handle_t*) &loop->stop, NULL);
+    uv_close((uv_handle_t*) &loop->stop_timer, NULL);
+
+    /* handles of the modules would keep the loop running */
+    uv_stop(&loop->uv);
+}
+void close_handle(uv_handle_t* handle, void* arg) {
+    if (!uv_is_closing(handle)) {
+        uv_close(handle, NULL);
+    }
+}
+void accept_poll(uv_poll_t* handle, int status, int events) {
+    int fd;
+    uint64_t start;
+    listener_t* lsnr;
+    loop_t* loop;
+
+    lsnr = handle->data;
+    loop = handle->loop->data;
+
+    if (status < 0) {
+        ELOG("uv error %s", uv_strerror(status));
+        return;
+    }
+
+    start = uv_hrtime();
+
+    /*
+     Drain the accept queue until it's empty or until the batch is exhausted.
+     Returning to the loop after each accepted connection would cost a poll
+     cycle per connection, which is exactly what hurts on connection storms.
+     */
+    for (uint32_t i = 0; i < loop->a->accept_batch; i++) {
+        fd = accept4(lsnr->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break; /* queue drained */
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == ECONNABORTED || errno == EPROTO) {
+                loop->stats.refused++; /* peer gave up while in the queue */
+                continue;
+            } else if ((errno == EMFILE || errno == ENFILE)
+                       && refuse_connection(lsnr) == 0) {
+                loop->stats.refused++;
+                continue;
+            }
+
+            ELOG("Error accepting new connection: %s", strerror(errno));
+            loop->stats.refused++;
+            break;
+        }
+
+        if (accept_connection(lsnr, loop, fd) == 0) {
+            loop->stats.accepted++;
+        } else {
+            loop->stats.refused++;
+        }
+    }
+
+    loop->stats.drains++;
+    loop->stats.drain_time_ns += uv_hrtime() - start;
+}
+int accept_connection(listener_t* lsnr, loop_t* loop, int fd) {
+    int err;
+    connection_t* con;
+
+    con = calloc(1, sizeof(connection_t));
+
+    err = uv_poll_init(&loop->uv, &con->handle, fd);
+    if (err != 0) {
+        ELOG("Failed to accept on tcp socket %s", uv_strerror(err));
+        free(con);
+        close(fd);
+        return -1;
+    }
+
+    http_parser_init(con->parser, HTTP_REQUEST);
+    vector_setup(con->contexts, 5, sizeof(context_t*));
+
+    con->handle.data = con;
+    con->parser->data = con;
+    con->loop = loop;
+    con->fd = fd;
+    con->timer.data = con;
+    con->request_timer.data = con;
+
+    con->next = loop->conns;
+    if (con->next) {
+        con->next->prev = con;
+    }
+    loop->conns = con;
+
+#ifdef HAS_CRYPTO
+    if (lsnr->ssl_ctx) {
+        con->ssl = crypto_alloc_ssl(lsnr->ssl_ctx, con->fd, CM_SERVER);
+        if (!con->ssl) {
+            ELOG("SSL alloc error!");
+            uv_close((uv_handle_t*) &con->handle, free_connection);
+            return -1;
+        }
+    }
+#endif
+    arm_timeout(con, &con->timer, loop->a->idle_timeout);
+    uv_poll_start(&con->handle, UV_READABLE, read_poll);
+    DLOG("Accepted new connection and reading data...");
+    return 0;
+}
+int refuse_connection(listener_t* lsnr) {
+    int fd;
+
+    /*
+     Out of descriptors. The listener stays readable while the queue is not
+     empty so, instead of spinning, release the reserved descriptor to accept
+     and immediately close a single pending connection.
+     */
+    if (lsnr->spare_fd == -1) {
+        return -1;
+    }
+
+    close(lsnr->spare_fd);
+    fd = accept(lsnr->fd, NULL, NULL);
+    if (fd != -1) {
+        close(fd);
+    }
+    lsnr->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    ELOG("Out of file descriptors, refused a connection");
+    return fd == -1 ? -1 : 0;
+}
+void error_poll(uv_poll_t* handle) {
+    connection_t* con = handle->data;
+    context_t* ctx;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* Ignore EAGAIN */
+        return;
+    }
+
+    DLOG("Got ERROR on connection, closing; error: %s", strerror(errno));
+
+    if (vector_size(con->contexts)) {
+        ctx = parser_get_context(con->parser);
+
+        if (as_channel_good(ctx->read_ch)) { /* expecting a read */
+            ctx->flag.body_done = 1;
+            ctx->flag.connection_closed = 1;
+            as_channel_send(ctx->read_ch, NULL);
+            return; /* close the connection after callback is finished */
+        }
+    }
+
+    uv_close((uv_handle_t*) handle, free_connection);
+}
+void read_poll(uv_poll_t* handle, int status, int events) {
+    connection_t* con = handle->data;
+    uint32_t avail, limit;
+    context_t* ctx;
+    char* buf;
+    int nread, h2;
+    size_t parsed;
+
+    if (status < 0) {
+        DLOG("uv error %s, closing", uv_strerror(status));
+        close_connection(con); /* libuv stopped polling the socket */
+        return;
+    }
+
+    /* reading resumes once the body is consumed, never after a 413 or a timeout */
+    if (con->throttled || con->expired || HTTP_PARSER_ERRNO(con->parser) == HPE_PAUSED) {
+        uv_poll_stop(handle);
+        return;
+    }
+
+    /* nothing references the old data once all requests are gone */
+    if (vector_is_empty(con->contexts) && con->spoken) {
+        rbuf_release(con);
+    }
+
+    con->reading = 1;
+    limit = 2 * con->loop->a->pipeline_depth;
+
+    while (1) {
+        buf = rbuf_reserve(con, &avail);
+
+    #ifdef HAS_CRYPTO
+        if (con->ssl)
+            nread = crypto_read(con->ssl, buf, avail);
+        else
+            /* read from fd directly */
+    #endif
+            nread = read(con->fd, buf, avail);
+
+        if (nread <= 0) {
+            break;
+        }
+
+    #ifdef HAS_CRYPTO
+        if (con->ssl && !con->handshaken) { /* data only flows once the handshake is done */
+            con->handshaken = 1;
+            con->loop->stats.tls_handshakes++;
+            if (crypto_session_reused(con->ssl)) {
+                con->loop->stats.tls_resumed++;
+            }
+            if (crypto_ktls_send(con->ssl)) {
+                con->ktls = 1;
+                con->loop->stats.tls_ktls++;
+            }
+        }
+    #endif
+
+        con->rbuf->len += nread;
+
+        /*
+         ALPN or a client that knows upfront starts right away with HTTP/2. The
+         preface may come in pieces, the protocol is settled once the first
+         three bytes are in or differ from it already.
+         */
+        if (!con->spoken) {
+            buf = con->rbuf->data;
+            nread = con->rbuf->len;
+            h2 = !memcmp(buf, "PRI", MIN(nread, 3));
+        #ifdef HAS_CRYPTO
+            if (con->ssl && crypto_alpn_h2(con->ssl)) {
+                h2 = 1;
+            } else
+        #endif
+            if (h2 && nread < 3) {
+                continue;
+            }
+            con->spoken = 1;
+            if (h2 && con->loop->a->h2_streams) {
+                con->reading = 0;
+                if (http2_start(con, buf, nread) == 0) {
+                    http2_flush(con);
+                }
+                return;
+            }
+        }
+
+        parsed = 0;
+        if (!vector_is_empty(con->contexts) && parser_get_active_context(con->parser)->bypass) {
+            parsed = bypass_body(parser_get_active_context(con->parser), buf, nread);
+        }
+        if (parsed < (size_t) nread) { /* nothing would read as the end of the stream */
+            parsed += http_parser_execute(con->parser, &incoming, buf + parsed, nread - parsed);
+        }
+
+        /* upgraded with h2c, what follows the request is HTTP/2 */
+        if (con->h2) {
+            con->reading = 0;
+            if (http2_execute(con, buf + parsed, nread - parsed) == 0) {
+                http2_flush(con);
+            }
+            return;
+        }
+
+        if (HTTP_PARSER_ERRNO(con->parser) == HPE_PAUSED) {
+            /* the body is over the limit, answer and stop reading */
+            con->reading = 0;
+            complete_replies(con);
+            if (!con->writing && !uv_is_closing((uv_handle_t*) handle)) {
+                uv_poll_stop(handle);
+            }
+            return;
+        }
+
+        if (nread != parsed) {
+            DLOG("Closing connection due http error");
+            con->reading = 0;
+            uv_close((uv_handle_t*) handle, free_connection);
+            return;
+        }
+
+        if (!con->tok) { /* the unreferenced tail can be read over */
+            con->rbuf->len = con->rkeep;
+        }
+
+        /* the route splices the rest of the body itself, outside the parser */
+        if (!vector_is_empty(con->contexts)) {
+            ctx = parser_get_active_context(con->parser);
+            if (ctx->flag.splicing && !ctx->flag.body_done &&
+                as_channel_good(ctx->read_ch)) {
+                con->reading = 0;
+                uv_poll_stop(handle);
+                as_channel_send(ctx->read_ch, NULL);
+                return;
+            }
+        }
+
+        /*
+         Enough complete requests are waiting or too much body is not read,
+         let them be answered first.
+         */
+        if (con->throttled || (vector_size(con->contexts) >= limit &&
+            parser_get_active_context(con->parser)->flag.body_done)) {
+            con->reading = 0;
+            complete_replies(con);
+            if ((con->throttled || vector_size(con->contexts) >= limit) &&
+                !con->writing && !uv_is_closing((uv_handle_t*) handle)) {
+                uv_poll_stop(handle);
+            }
+            return;
+        }
+    }
+
+    con->reading = 0;
+
+    if (vector_is_empty(con->contexts) && con->spoken) {
+        rbuf_release(con);
+    }
+
+    if (nread < 0) {
+    #ifdef HAS_CRYPTO
+        if (con->ssl) {
+            nread = crypto_error_needs_data_only(con->ssl, nread);
+            /*
+             Same as with crypto_write, crypto_read can trigger transparent
+             re-negotiation too. So, to handle it just re-register the events.
+             A reply being written keeps the handle with write_poll.
+             */
+            if (nread == UV_READABLE) {
+                if (!con->writing) {
+                    uv_poll_start(handle, UV_READABLE, read_poll);
+                }
+                complete_replies(con);
+            } else if (nread) {
+                uv_poll_start(handle, nread, read_poll);
+            }
+        } else
+    #endif
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* replies sent while parsing are retired outside of the parser */
+            complete_replies(con);
+        } else {
+            error_poll(handle);
+        }
+    } else if (nread == 0) {
+        uv_close((uv_handle_t*) handle, free_connection);
+    } else {
+    #ifdef HAS_CRYPTO
+        /*
+         Extra step to make sure we are not left in WRITABLE state after
+         re-negotiation. No SYSCALL is made because libuv short circuits when
+         events are unchanged.
+         */
+        uv_poll_start(handle, UV_READABLE, read_poll);
+    #endif
+    }
+}
+void write_poll(uv_poll_t* handle, int status, int events) {
+    connection_t* con = handle->data;
+    context_t* ctx;
+    int err;
+
+    if (status < 0) {
+        DLOG("uv error %s, closing", uv_strerror(status));
+        close_connection(con); /* libuv stopped polling the socket */
+        return;
+    }
+
+#ifdef HAS_IO_URING
+    if (con->sending) { /* send_complete takes over */
+        uv_poll_start(handle, UV_READABLE, read_poll);
+        return;
+    }
+#endif
+
+    if (vector_is_empty(con->contexts)) {
+        uv_poll_start(handle, UV_READABLE, read_poll);
+        return;
+    }
+
+    ctx = parser_get_context(con->parser);
+
+    if (ctx->flag.replied) { /* written directly by send_reply */
+        complete_replies(con);
+        return;
+    }
+
+    if (!con->writing) { /* nothing to write until the front request replies */
+        uv_poll_start(handle, UV_READABLE, read_poll);
+        return;
+    }
+
+    if (evbuffer_get_length(ctx->send_body)) {
+        err = write_connection(ctx->con, ctx->send_body);
+        if (err != 0) {
+        #ifdef HAS_CRYPTO
+            if (con->ssl && !con->ktls) {
+                /*
+                 crypto_write can trigger transparent re-negotiation if
+                 required. To cope with that, we need to wait for socket to
+                 become writable or readable, depending on what the
+                 negotiation step requires.
+                 */
+                err = crypto_error_needs_data_only(con->ssl, err);
+                if (err) {
+                    uv_poll_start(handle, err, write_poll);
+                } else {
+                    close_connection(con);
+                }
+                return;
+            }
+        #endif
+            close_connection(con);
+            return;
+        }
+    }
+
+    /* Check again to see if the buffer has been drained */
+    if (!evbuffer_get_length(ctx->send_body)) {
+        con->writing = 0;
+
+        if (ctx->flag.streaming && !ctx->flag.stream_done) {
+            /* the route is still producing, read meanwhile */
+            uv_poll_start(handle, UV_READABLE, read_poll);
+            stream_wake(ctx);
+            return;
+        }
+
+        ctx->flag.replied = 1;
+        complete_replies(con);
+    } else if (ctx->flag.streaming &&
+               evbuffer_get_length(ctx->send_body) <= STREAM_LOW_WATERMARK) {
+        stream_wake(ctx); /* resumes the route, ctx may be gone after */
+    }
+}
+void free_context(context_t* ctx) {
+    connection_t* con;
+
+    if (!ctx)
+        return;
+
+    con = ctx->con;
+
+    hm_foreach(ctx->send_headers, hm_cb_free, 0);
+    hm_free(ctx->send_headers);
+    buffer_put(con, ctx->body);
+    buffer_put(con, ctx->send_body);
+    buffer_put(con, ctx->chunk);
+    buffer_put(con, ctx->zipped);
+    zp_put(con->loop->zip, ctx->zs);
+    fc_release(ctx->file);
+    mc_unwait(&ctx->waiter);
+    cache_unwake(ctx);
+    cache_abandon(ctx);
+    free(ctx->write);
+    if (ctx->handle != -1) {
+        hclose(ctx->handle);
+        finish_route(ctx);
+    }
+    sp_put(ctx->con->loop->stacks, ctx->stack); /* the coroutine is done with it */
+    ctx->stack = NULL;
+    if (ctx->stream) {
+        h2_close(con->h2, ctx->stream, ctx->flag.replied ? H2_NO_ERROR : H2_INTERNAL_ERROR);
+        ctx->stream = NULL;
+    }
+
+    /*
+     Everything else the request allocated lives in its arena, which is
+     released at once with the context itself. Requests end in any order, each
+     has an arena of its own and the last one is kept for the next request.
+     */
+    ar_free(con->spare_arena);
+    con->spare_arena = ctx->arena;
+    ar_reset(con->spare_arena);
+}
+void free_connection(uv_handle_t* handle) {
+    connection_t* con;
+    loop_t* loop;
+
+    if (!handle || !handle->data) {
+        return;
+    }
+
+    con = handle->data;
+    loop = con->loop;
+
+#ifdef HAS_IO_URING
+    if (con->sending) {
+        /* the kernel still reads the reply, come back on its completion */
+        con->released = 1;
+        ur_cancel(loop->ring, &con->send_op);
+        return;
+    }
+    free(con->send_iov);
+#endif
+
+    tw_cancel(&con->timer);
+    tw_cancel(&con->request_timer);
+
+    if (con->prev) {
+        con->prev->next = con->next;
+    } else if (loop->conns == con) {
+        loop->conns = con->next;
+    }
+    if (con->next) {
+        con->next->prev = con->prev;
+    }
+
+    VECTOR_FOR_EACH(con->contexts, msg) {
+        free_context(ITERATOR_GET_AS(context_t*, &msg));
+    }
+
+#ifdef HAS_CRYPTO
+    crypto_free_ssl(con->ssl);
+#endif
+
+    if (con->h2) {
+        h2_free(con->h2);
+    }
+
+    evbuffer_free(con->spare[0]);
+    evbuffer_free(con->spare[1]);
+    vector_destroy(con->contexts);
+    con->reading = 0;
+    rbuf_release(con);
+    ar_free(con->spare_arena);
+    close(con->fd);
+    free(con);
+
+    DLOG("Connection closed");
+
+    if (loop->stopping && !loop->conns) {
+        finish_shutdown(loop);
+    }
+}
+arena_t* arena_get(connection_t* con) {
+    arena_t* rc = con->spare_arena;
+
+    if (!rc) {
+        return ar_alloc(CONNECTION_ARENA_SIZE);
+    }
+
+    con->spare_arena = NULL;
+    return rc;
+}
+evbuffer_t* buffer_get(connection_t* con) {
+    evbuffer_t* rc;
+
+    for (int i = 0; i < 2; i++) {
+        if (con->spare[i]) {
+            rc = con->spare[i];
+            con->spare[i] = NULL;
+            return rc;
+        }
+    }
+
+    return evbuffer_new();
+}
+void buffer_put(connection_t* con, evbuffer_t* buf) {
+    if (!buf) {
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (!con->spare[i]) {
+            evbuffer_drain(buf, evbuffer_get_length(buf));
+            evbuffer_clear_flags(buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+            con->spare[i] = buf;
+            return;
+        }
+    }
+
+    evbuffer_free(buf);
+}
+char* rbuf_reserve(connection_t* con, uint32_t* avail) {
+    rblock_t* b,* old;
+    uint32_t size;
+    loop_t* loop = con->loop;
+
+    old = con->rbuf;
+    if (old && old->size - old->len >= RBLOCK_MIN_READ) {
+        *avail = old->size - old->len;
+        return old->data + old->len;
+    }
+
+    /* the token in progress is moved over, make sure it fits */
+    size = RBLOCK_SIZE;
+    if (con->tok_len + RBLOCK_MIN_READ > size) {
+        size = con->tok_len + RBLOCK_SIZE;
+    }
+
+    if (size == RBLOCK_SIZE && loop->rblocks) {
+        b = loop->rblocks;
+        loop->rblocks = b->next;
+        loop->rblocks_count--;
+    } else {
+        b = malloc(sizeof(rblock_t) + size);
+        b->size = size;
+    }
+
+    b->len = 0;
+    if (con->tok) {
+        memcpy(b->data, con->tok, con->tok_len);
+        con->tok = b->data;
+        b->len = con->tok_len;
+    }
+
+    if (old && !con->rkeep) { /* nothing points into the old block */
+        b->next = old->next;
+        old->next = loop->rblocks;
+        loop->rblocks = old;
+        loop->rblocks_count++;
+    } else {
+        b->next = old;
+    }
+
+    con->rbuf = b;
+    con->rkeep = 0;
+
+    *avail = b->size - b->len;
+    return b->data + b->len;
+}
+void rbuf_release(connection_t* con) {
+    rblock_t* b;
+    loop_t* loop = con->loop;
+
+    /* the parser may still be walking the blocks */
+    if (con->reading) {
+        return;
+    }
+
+    while ((b = con->rbuf)) {
+        con->rbuf = b->next;
+        if (b->size == RBLOCK_SIZE && loop->rblocks_count < RBLOCK_CACHE) {
+            b->next = loop->rblocks;
+            loop->rblocks = b;
+            loop->rblocks_count++;
+        } else {
+            free(b);
+        }
+    }
+
+    con->tok = NULL;
+    con->tok_len = 0;
+    con->rkeep = 0;
+}
+void token_append(context_t* ctx, const char* at, size_t len) {
+    connection_t* con = ctx->con;
+    char* tok;
+
+    if (!con->tok) {
+        con->tok = at;
+        con->tok_len = len;
+        return;
+    }
+
+    if (con->tok + con->tok_len == at) {
+        con->tok_len += len;
+        return;
+    }
+
+    /* data did not come from the read buffer, keep a contiguous copy */
+    tok = ar_malloc(ctx->arena, con->tok_len + len);
+    memcpy(tok, con->tok, con->tok_len);
+    memcpy(tok + con->tok_len, at, len);
+    con->tok = tok;
+    con->tok_len += len;
+}
+const char* token_take(connection_t* con, uint32_t* len) {
+    const char* rc = con->tok;
+    rblock_t* b = con->rbuf;
+
+    *len = con->tok_len;
+
+    if (b && rc >= b->data && rc + con->tok_len <= b->data + b->len) {
+        con->rkeep = MAX(con->rkeep, (rc + con->tok_len) - b->data);
+    }
+
+    con->tok = NULL;
+    con->tok_len = 0;
+    return rc;
+}
+int write_connection(connection_t *con, evbuffer_t *buf) {
+#ifdef HAS_CRYPTO
+    if (con->ssl && !con->ktls) {
+        return write_tls(con, buf);
+    }
+#endif
+
+    /* Write to fd */
+    if (evbuffer_write(buf, con->fd) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        DLOG("Failed to write reply %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+#ifdef HAS_CRYPTO
+int write_tls(connection_t* con, evbuffer_t* buf) {
+    static __thread char record[TLS_RECORD_MAX];
+    struct evbuffer_iovec vec;
+    uint64_t now;
+    size_t len, want, n;
+    int rc;
+
+    /*
+     The first records of a burst are kept within a segment so the client can
+     decrypt them as they arrive, full records only pay off once the window
+     has opened up. An idle connection likely starts over with a small window.
+     */
+    now = uv_now(&con->loop->uv);
+    if (now - con->tls_active > TLS_IDLE_MS) {
+        con->tls_sent = 0;
+    }
+    con->tls_active = now;
+
+    while ((len = evbuffer_get_length(buf))) {
+        if (con->tls_retry) { /* OpenSSL wants the same length again */
+            want = con->tls_retry;
+        } else if (con->tls_sent < TLS_WARMUP_BYTES) {
+            want = TLS_RECORD_SMALL;
+        } else {
+            want = TLS_RECORD_MAX;
+        }
+        want = MIN(want, len);
+
+        /*
+         There is no gather write, every write is a record of its own. Chains
+         holding a whole record are encrypted in place, smaller ones are
+         coalesced so the records stay full.
+         */
+        evbuffer_peek(buf, want, NULL, &vec, 1);
+        if (vec.iov_len >= want) {
+            rc = crypto_write(con->ssl, vec.iov_base, want, &n);
+        } else {
+            evbuffer_copyout(buf, record, want);
+            rc = crypto_write(con->ssl, record, want, &n);
+        }
+
+        if (rc != 1) {
+            con->tls_retry = want;
+            return -1;
+        }
+
+        con->tls_retry = 0;
+        con->tls_sent += n;
+        evbuffer_drain(buf, n);
+    }
+
+    return 0;
+}
+#endif
+#ifdef HAS_IO_URING
+void ring_start(loop_t* loop) {
+    loop->ring = ur_alloc(URING_ENTRIES);
+    if (!loop->ring) {
+        ELOG("Loop %u falls back to polling", loop->idx);
+        return;
+    }
+
+    uv_poll_init(&loop->uv, &loop->ring_poll, ur_fd(loop->ring));
+    loop->ring_poll.data = loop;
+    uv_poll_start(&loop->ring_poll, UV_READABLE, ring_poll);
+
+    /*
+     Operations are only queued while the loop handles events, all of them go
+     to the kernel with a single call right before the loop blocks again.
+     */
+    uv_prepare_init(&loop->uv, &loop->ring_prepare);
+    loop->ring_prepare.data = loop;
+    uv_prepare_start(&loop->ring_prepare, ring_submit);
+    uv_unref((uv_handle_t*) &loop->ring_prepare);
+}
+void ring_submit(uv_prepare_t* handle) {
+    loop_t* loop = handle->data;
+
+    ur_submit(loop->ring);
+}
+void ring_poll(uv_poll_t* handle, int status, int events) {
+    loop_t* loop = handle->data;
+
+    if (status < 0) {
+        ELOG("uv error %s", uv_strerror(status));
+        return;
+    }
+
+    ur_complete(loop->ring);
+}
+void accept_complete(ur_op_t* op, int res, uint32_t flags) {
+    listener_t* lsnr = op->data;
+    loop_t* loop = lsnr->loop;
+
+    if (!ur_more(flags)) {
+        lsnr->accepting = 0;
+    }
+
+    if (lsnr->closing) {
+        if (res >= 0) {
+            close(res);
+        }
+        if (!lsnr->accepting) {
+            free_listener((uv_handle_t*) &lsnr->handle);
+        }
+        return;
+    }
+
+    if (res >= 0) {
+        if (accept_connection(lsnr, loop, res) == 0) {
+            loop->stats.accepted++;
+        } else {
+            loop->stats.refused++;
+        }
+    } else if (res == -ECONNABORTED || res == -EPROTO) {
+        loop->stats.refused++; /* peer gave up while in the queue */
+    } else if ((res == -EMFILE || res == -ENFILE) && refuse_connection(lsnr) == 0) {
+        loop->stats.refused++;
+    } else if (res != -EINTR && res != -EAGAIN) {
+        ELOG("Error accepting new connection: %s", strerror(-res));
+        loop->stats.refused++;
+    }
+
+    /* the kernel ends a multishot accept on errors, start it again */
+    if (!lsnr->accepting) {
+        if (ur_accept_multishot(loop->ring, &lsnr->accept_op, lsnr->fd) == 0) {
+            lsnr->accepting = 1;
+        } else {
+            uv_poll_start(&lsnr->handle, UV_READABLE, accept_poll);
+        }
+    }
+}
+int ring_send(context_t* ctx) {
+    connection_t* con = ctx->con;
+    int cnt;
+
+    if (!con->loop->ring || ctx->flag.has_file) {
+        return -1;
+    }
+#ifdef HAS_CRYPTO
+    if (con->ssl && !con->ktls) {
+        return -1;
+    }
+#endif
+
+    if (!con->send_iov) {
+        con->send_iov = malloc(REPLY_IOV_MAX * sizeof(struct iovec));
+    }
+
+    /* chains past the limit are left for write_poll, like a partial write */
+    cnt = evbuffer_peek(ctx->send_body, evbuffer_get_length(ctx->send_body), NULL,
+                        (struct evbuffer_iovec*) con->send_iov, REPLY_IOV_MAX);
+    if (cnt > REPLY_IOV_MAX) {
+        cnt = REPLY_IOV_MAX;
+    }
+
+    con->send_op.cb = send_complete;
+    con->send_op.data = con;
+    if (ur_writev(con->loop->ring, &con->send_op, con->fd, con->send_iov, cnt) != 0) {
+        return -1;
+    }
+
+    con->sending = 1;
+    return 0;
+}
+void send_complete(ur_op_t* op, int res, uint32_t flags) {
+    connection_t* con = op->data;
+    context_t* ctx;
+
+    con->sending = 0;
+
+    if (con->released) { /* closed while the kernel was writing */
+        free_connection((uv_handle_t*) &con->handle);
+        return;
+    }
+
+    if (res == -EAGAIN || res == -EINTR) {
+        res = 0;
+    } else if (res < 0) {
+        DLOG("Failed to write reply %s", strerror(-res));
+        close_connection(con);
+        return;
+    }
+
+    ctx = parser_get_context(con->parser);
+    evbuffer_drain(ctx->send_body, res);
+
+    if (evbuffer_get_length(ctx->send_body)) {
+        /* the socket is full, the rest waits for it like any other write */
+        uv_poll_start(&con->handle, UV_WRITABLE, write_poll);
+        return;
+    }
+
+    con->writing = 0;
+    ctx->flag.replied = 1;
+    complete_replies(con);
+}
+#endif
+int http2_start(connection_t* con, const char* data, size_t len) {
+    http2_session(con);
+    con->loop->stats.h2_connections++;
+
+    return http2_execute(con, data, len);
+}
+void http2_session(connection_t* con) {
+    int one = 1;
+
+    /*
+     Small frames like window updates and the tail of a window full of DATA
+     are waited on by the peer, Nagle would hold them back for its ACK.
+     */
+    setsockopt(con->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    con->h2 = h2_alloc(&http2_callbacks, con, con->loop->a->h2_streams);
+}
+int http2_upgrade(context_t* ctx) {
+    connection_t* con = ctx->con;
+    http_parser_t* p = con->parser;
+    header_t* upgrade,* h;
+
+    /* a body would have to be read as HTTP/1 first, such requests stay with it */
+    upgrade = ctx->known[AH_UPGRADE];
+    if (!con->loop->a->h2_streams || vector_size(con->contexts) != 1 ||
+        (p->flags & F_CHUNKED) || (p->content_length && p->content_length != ULLONG_MAX) ||
+        !upgrade || upgrade->value_len != 3 || strncasecmp(upgrade->value, "h2c", 3)) {
+        return -1;
+    }
+#ifdef HAS_CRYPTO
+    if (con->ssl) { /* asked for with ALPN */
+        return -1;
+    }
+#endif
+
+    for (h = ctx->headers; h; h = h->next) {
+        if (h->key_len == 14 && !strncasecmp(h->key, "http2-settings", 14)) {
+            break;
+        }
+    }
+    if (!h) {
+        return -1;
+    }
+
+    http2_session(con);
+    ctx->stream = h2_upgrade(con->h2, h->value, h->value_len, ctx);
+    if (!ctx->stream) {
+        h2_free(con->h2);
+        con->h2 = NULL;
+        return -1;
+    }
+
+    /* the 101 goes ahead of the server preface */
+    evbuffer_prepend(h2_output(con->h2), H2_UPGRADE, sizeof(H2_UPGRADE) - 1);
+    con->loop->stats.h2_connections++;
+    con->loop->stats.h2_streams++;
+
+    tw_cancel(&con->timer);
+    tw_cancel(&con->request_timer);
+
+    buffer_put(con, ctx->body);
+    ctx->body = NULL;
+    ctx->flag.body_done = 1;
+    ctx->flag.should_keepalive = 1;
+    ctx->flag.http10 = 0;
+    ctx->flag.headers_done = 1;
+    ctx->ready = uv_hrtime();
+
+    if (cache_lookup(ctx)) {
+        return 0;
+    }
+    if (admit_context(ctx)) {
+        run_context(ctx);
+    } else {
+        shed_context(ctx);
+    }
+
+    return 0;
+}
+void http2_poll(uv_poll_t* handle, int status, int events) {
+    connection_t* con = handle->data;
+    char buf[RBLOCK_SIZE];
+    int nread = -1;
+
+    if (status < 0) {
+        DLOG("uv error %s, closing", uv_strerror(status));
+        close_connection(con); /* libuv stopped polling the socket */
+        return;
+    }
+
+    /* frames are copied out by h2_execute, the buffer is reused right away */
+    while (events & UV_READABLE) {
+        /* a peer not reading what it's answered is not read any further */
+        if (evbuffer_get_length(h2_output(con->h2)) > H2_OUTPUT_HIGH) {
+            events &= ~UV_READABLE;
+            break;
+        }
+
+    #ifdef HAS_CRYPTO
+        if (con->ssl)
+            nread = crypto_read(con->ssl, buf, sizeof(buf));
+        else
+    #endif
+            nread = read(con->fd, buf, sizeof(buf));
+
+        if (nread <= 0) {
+            break;
+        }
+
+        if (http2_execute(con, buf, nread)) {
+            return;
+        }
+    }
+
+    if (nread == 0) {
+        close_connection(con);
+        return;
+    }
+
+    if (events & UV_READABLE) {
+    #ifdef HAS_CRYPTO
+        if (con->ssl) {
+            /* renegotiation waits for whichever it needs, both are polled */
+            nread = crypto_error_needs_data_only(con->ssl, nread);
+            if (!nread) {
+                close_connection(con);
+                return;
+            }
+            if (nread == UV_WRITABLE) {
+                con->h2_pending = 1;
+            }
+        } else
+    #endif
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            DLOG("Failed to read %s, closing", strerror(errno));
+            close_connection(con);
+            return;
+        }
+    }
+
+    http2_flush(con);
+}
+int http2_execute(connection_t* con, const char* data, size_t len) {
+    if (h2_execute(con->h2, data, len) == 0) {
+        return 0;
+    }
+
+    /* GOAWAY says why, as much of it as the socket takes */
+    DLOG("HTTP/2 protocol error, closing connection");
+    write_connection(con, h2_output(con->h2));
+    close_connection(con);
+    return -1;
+}
+void http2_flush(connection_t* con) {
+    evbuffer_t* out;
+    context_t* ctx;
+    uint32_t size, idle;
+    int events, err, full, retry = 0;
+
+    if (uv_is_closing((uv_handle_t*) &con->handle)) {
+        return;
+    }
+
+    out = h2_output(con->h2);
+    con->dispatching = 1;
+
+    /*
+     Streams take turns a frame at a time until the output is full or none of
+     them has anything the flow control lets out. The turn carries over to the
+     next flush so the streams at the back are not starved.
+     */
+    size = vector_size(con->contexts);
+    idle = 0;
+    while (idle < size && evbuffer_get_length(out) < H2_OUTPUT_HIGH) {
+        ctx = VECTOR_GET_AS(context_t*, con->contexts, con->h2_turn++ % size);
+        idle = http2_send(ctx, H2_QUANTUM) ? 0 : idle + 1;
+    }
+    full = idle < size; /* some stream has more, go on once it's written */
+
+    err = evbuffer_get_length(out) ? write_connection(con, out) : 0;
+#ifdef HAS_CRYPTO
+    if (err && con->ssl && !con->ktls && crypto_error_needs_data_only(con->ssl, err)) {
+        err = 0; /* renegotiation, both events are polled below */
+        retry = 1;
+    }
+#endif
+    if (err) {
+        con->dispatching = 0;
+        close_connection(con);
+        return;
+    }
+
+    for (uint32_t i = 0; i < vector_size(con->contexts);) {
+        ctx = VECTOR_GET_AS(context_t*, con->contexts, i);
+
+        if (ctx->flag.done && (ctx->flag.replied || ctx->flag.abort || !ctx->stream)) {
+            vector_erase(con->contexts, i);
+            free_context(ctx);
+            continue;
+        }
+
+        /* a route streaming its reply resumes once most of it is out */
+        if (ctx->flag.streaming && !ctx->flag.stream_done && as_channel_good(ctx->write_ch) &&
+            evbuffer_get_length(ctx->send_body) <= STREAM_LOW_WATERMARK) {
+            con->h2_pending = 1;
+            stream_wake(ctx);
+        }
+
+        i++;
+    }
+
+    con->dispatching = 0;
+
+    if (vector_is_empty(con->contexts)) {
+        rbuf_release(con); /* the request of an h2c upgrade was read in place */
+        if (con->loop->stopping && !evbuffer_get_length(out)) {
+            close_connection(con);
+            return;
+        }
+        arm_timeout(con, &con->timer, con->loop->a->idle_timeout);
+    }
+
+    /* reading resumes once the output is drained below the mark */
+    events = evbuffer_get_length(out) <= H2_OUTPUT_HIGH || retry ? UV_READABLE : 0;
+    if (evbuffer_get_length(out) || con->h2_pending || full) {
+        events |= UV_WRITABLE;
+    }
+    con->h2_pending = 0;
+
+    uv_poll_start(&con->handle, events, http2_poll);
+}
+void http2_kick(connection_t* con) {
+    con->h2_pending = 1;
+
+    /* a flush in progress polls for it once done */
+    if (!con->dispatching && !uv_is_closing((uv_handle_t*) &con->handle)) {
+        uv_poll_start(&con->handle, UV_READABLE | UV_WRITABLE, http2_poll);
+    }
+}
+size_t http2_send(context_t* ctx, size_t max) {
+    size_t n;
+    int end;
+
+    if (!ctx->stream || !ctx->flag.framed || ctx->flag.replied) {
+        return 0;
+    }
+
+    end = !ctx->flag.streaming || ctx->flag.stream_done;
+    n = h2_send_data(ctx->con->h2, ctx->stream, ctx->send_body, max, end);
+
+    if (h2_local_closed(ctx->stream)) {
+        ctx->flag.replied = 1;
+    }
+
+    return n;
+}
+void http2_reply(context_t* ctx, int status) {
+    connection_t* con = ctx->con;
+    loop_t* loop = con->loop;
+    evbuffer_t* block;
+    char num[24];
+    uint32_t n;
+    int end;
+
+    if (!ctx->stream) { /* reset meanwhile */
+        return;
+    }
+
+    block = buffer_get(con);
+    hp_encode_status(block, status);
+
+    end = !ctx->flag.streaming && (ctx->method == HTTP_HEAD || !ctx->send_body ||
+                                   !evbuffer_get_length(ctx->send_body));
+    if (!ctx->flag.streaming && status >= 200 && status != 204 && status != 304) {
+        n = u64toa(ctx->send_body ? evbuffer_get_length(ctx->send_body) : 0, num);
+        hp_encode(block, "content-length", 14, num, n);
+    }
+    if (ctx->method == HTTP_HEAD && !ctx->flag.streaming) {
+        buffer_put(con, ctx->send_body);
+        ctx->send_body = NULL;
+    }
+
+    if (ctx->flag.shed && loop->a->retry_after) {
+        n = u64toa(loop->a->retry_after, num);
+        hp_encode(block, "retry-after", 11, num, n);
+    }
+
+    if (ctx->flag.encoding == ZIP_GZIP) {
+        hp_encode(block, "content-encoding", 16, "gzip", 4);
+    } else if (ctx->flag.encoding == ZIP_DEFLATE) {
+        hp_encode(block, "content-encoding", 16, "deflate", 7);
+    }
+    if (ctx->flag.vary) {
+        hp_encode(block, "vary", 4, "accept-encoding", 15);
+    }
+    if (ctx->file) {
+        http2_file_headers(ctx, status, block);
+    }
+
+    /* the value of the rendered Date header line */
+    hp_encode(block, "date", 4, loop->date + 6, loop->date_len - 8);
+    hp_encode(block, "server", 6, "Appster", 7);
+    if (ctx->cached) {
+        http2_cached_headers(ctx->cached, block);
+    }
+
+    if (ctx->send_headers) {
+        free(hm_remove(ctx->send_headers, "content-length"));
+
+        hm_foreach(ctx->send_headers, http2_add_header, block);
+        hm_foreach(ctx->send_headers, hm_cb_free, 0);
+        hm_free(ctx->send_headers);
+        ctx->send_headers = NULL;
+    }
+
+    h2_send_headers(con->h2, ctx->stream, block, end);
+    buffer_put(con, block);
+
+    ctx->flag.framed = 1;
+    if (end) {
+        ctx->flag.replied = 1;
+    } else if (!ctx->send_body) {
+        ctx->send_body = buffer_get(con); /* what is streamed is moved here */
+    }
+
+    http2_kick(con);
+}
+int http2_add_header(const void* key, void* value, void* context) {
+    /* connection specific headers have no meaning in HTTP/2 */
+    if (!strcasecmp(key, "connection") || !strcasecmp(key, "keep-alive") ||
+        !strcasecmp(key, "transfer-encoding") || !strcasecmp(key, "upgrade")) {
+        return 1;
+    }
+
+    hp_encode(context, key, strlen(key), value, strlen(value));
+    return 1;
+}
+void http2_consume(context_t* ctx) {
+    uint64_t n;
+
+    if (!ctx->stream) {
+        return;
+    }
+
+    /* what was read or dropped, the rest is still buffered */
+    n = ctx->body_len - ctx->body_acked - (ctx->body ? evbuffer_get_length(ctx->body) : 0);
+    if (n) {
+        h2_consume(ctx->con->h2, ctx->stream, n);
+        ctx->body_acked += n;
+        http2_kick(ctx->con);
+    }
+}
+void* http2_begin(void* data, h2_stream_t* st) {
+    connection_t* con = data;
+    context_t* ctx;
+    arena_t* arena;
+
+    /*
+     A reset stream is gone from the session at once but its route runs until
+     it notices, those count against the limit until they are retired.
+     */
+    if (con->loop->stopping || vector_size(con->contexts) >= con->loop->a->h2_streams) {
+        return NULL;
+    }
+
+    arena = arena_get(con);
+    ctx = ar_calloc(arena, 1, sizeof(context_t));
+    ctx->con = con;
+    ctx->arena = arena;
+    ctx->stream = st;
+    ctx->method = -1;
+    ctx->handle = -1;
+    ctx->read_ch.ch[0] = -1;
+    ctx->read_ch.ch[1] = -1;
+    ctx->write_ch.ch[0] = -1;
+    ctx->write_ch.ch[1] = -1;
+    ctx->flag.should_keepalive = 1;
+
+    /* streams don't wait on the connection timeouts, only idle ones do */
+    tw_cancel(&con->timer);
+    con->loop->stats.h2_streams++;
+
+    vector_push_back(con->contexts, &ctx);
+    return ctx;
+}
+void http2_header(void* data, const char* name, uint32_t name_len, const char* value, uint32_t value_len) {
+    context_t* ctx = data;
+    appster_header_id_t id;
+    header_t* h;
+
+    if (ctx->flag.parse_error) {
+        return;
+    }
+
+    /* the request line is made of pseudo headers, they come first */
+    if (name_len && name[0] == ':') {
+        if (ctx->flag.parsed_field) {
+            ctx->flag.parse_error = 1;
+            return;
+        }
+        if (name_len == 7 && !memcmp(name, ":method", 7)) {
+            ctx->method = method_intern(value, value_len);
+            return;
+        }
+        if (name_len == 5 && !memcmp(name, ":path", 5)) {
+            ctx->url = ar_strndup(ctx->arena, value, value_len);
+            ctx->url_len = value_len;
+            return;
+        }
+        if (name_len != 10 || memcmp(name, ":authority", 10)) {
+            /* the scheme tells nothing new, the rest is malformed */
+            if (name_len != 7 || memcmp(name, ":scheme", 7)) {
+                ctx->flag.parse_error = 1;
+            }
+            return;
+        }
+
+        name = "host"; /* stands for the Host header */
+        name_len = 4;
+    } else {
+        ctx->flag.parsed_field = 1;
+    }
+
+    h = ar_malloc(ctx->arena, sizeof(header_t));
+    h->key = ar_strndup(ctx->arena, name, name_len);
+    h->key_len = name_len;
+    h->value = ar_strndup(ctx->arena, value, value_len);
+    h->value_len = value_len;
+
+    h->next = ctx->headers; /* the latest duplicate is found first */
+    ctx->headers = h;
+
+    id = header_intern(h->key, h->key_len);
+    if (id != AH_UNKNOWN) {
+        ctx->known[id] = h;
+    }
+}
+void http2_headers(void* data, int end_stream) {
+    context_t* ctx = data;
+    header_t* h;
+
+    if (!ctx->flag.parse_error && (ctx->method == -1 || !ctx->url)) {
+        ctx->flag.parse_error = 1;
+    }
+    if (!ctx->flag.parse_error) {
+        parse_arguments(ctx); /* the error callback answers a failure */
+    }
+
+    if (end_stream) {
+        ctx->flag.body_done = 1;
+    } else {
+        ctx->body = buffer_get(ctx->con);
+    }
+
+    /* refuse what is announced too large before it's sent */
+    ctx->body_max = body_limit(ctx);
+    h = ctx->known[AH_CONTENT_LENGTH];
+    if (ctx->body_max && !ctx->flag.body_done && h &&
+        strtoull(h->value, NULL, 10) > ctx->body_max) {
+        reject_body(ctx);
+    }
+
+    ctx->flag.headers_done = 1;
+    ctx->ready = uv_hrtime();
+
+    if (cache_lookup(ctx)) {
+        return;
+    }
+    if (admit_context(ctx)) {
+        run_context(ctx);
+    } else {
+        shed_context(ctx);
+    }
+}
+void http2_data(void* data, const char* at, size_t len, int end_stream) {
+    context_t* ctx = data;
+
+    ctx->body_len += len;
+    if (end_stream) {
+        ctx->flag.body_done = 1;
+    }
+
+    if (ctx->body_max && ctx->body_len > ctx->body_max && !ctx->flag.body_too_large) {
+        reject_body(ctx);
+    }
+
+    /* the body of an answered or refused request is dropped */
+    if (len && ctx->body && !ctx->flag.replied) {
+        evbuffer_add(ctx->body, at, len);
+    } else {
+        http2_consume(ctx);
+    }
+
+    if (as_channel_good(ctx->read_ch)) {
+        as_channel_send(ctx->read_ch, NULL);
+    }
+}
+void http2_reset(void* data, uint32_t error) {
+    context_t* ctx = data;
+
+    DLOG("Stream reset with error %u", error);
+
+    /* the route fails what it does next, it's retired once it returns */
+    ctx->stream = NULL;
+    ctx->flag.connection_closed = 1;
+    ctx->flag.body_done = 1;
+
+    /* one waiting on the cache never runs, it's retired right away */
+    if (ctx->handle == -1 && !ctx->flag.done) {
+        mc_unwait(&ctx->waiter);
+        cache_unwake(ctx);
+        ctx->flag.done = 1;
+    }
+
+    if (as_channel_good(ctx->read_ch)) {
+        as_channel_send(ctx->read_ch, NULL);
+    }
+    stream_wake(ctx);
+    http2_kick(ctx->con);
+}
+int reply_encoding(context_t* ctx, int status) {
+    const char* type;
+    header_t* h;
+
+    /* a range is of the file as it is */
+    if (!ctx->con->loop->zip || status < 200 || status == 204 || status == 206 || status == 304 ||
+        ctx->flag.shed || ctx->flag.range) {
+        return ZIP_IDENTITY;
+    }
+
+    type = ctx->file ? ctx->file->type : NULL;
+
+    /* a route that encodes the body itself is left alone */
+    if (ctx->send_headers) {
+        if (hm_get(ctx->send_headers, "content-encoding")) {
+            return ZIP_IDENTITY;
+        }
+        if (hm_get(ctx->send_headers, "content-type")) {
+            type = hm_get(ctx->send_headers, "content-type");
+        }
+    }
+    if (type && !type_compressible(ctx->appster, type)) {
+        return ZIP_IDENTITY;
+    }
+
+    ctx->flag.vary = 1;
+
+    h = ctx->known[AH_ACCEPT_ENCODING];
+    return h ? accept_encoding(h->value, h->value_len) : ZIP_IDENTITY;
+}
+int accept_encoding(const char* value, uint32_t len) {
+    const char* end = value + len,* it = value,* tok;
+    int gzip = -1, deflate = -1, any = -1, q;
+    uint32_t tok_len;
+
+    /* codings listed with q=0 are refused, the others are taken in our order */
+    while (it < end) {
+        while (it < end && (*it == ',' || *it == ' ' || *it == '\t')) {
+            it++;
+        }
+        tok = it;
+        while (it < end && *it != ',' && *it != ';' && *it != ' ' && *it != '\t') {
+            it++;
+        }
+        tok_len = it - tok;
+
+        q = 1;
+        while (it < end && *it != ',') {
+            if ((*it == 'q' || *it == 'Q') && it + 1 < end && it[1] == '=') {
+                q = 0;
+                for (it += 2; it < end && ((*it >= '0' && *it <= '9') || *it == '.'); it++) {
+                    q |= *it >= '1' && *it <= '9';
+                }
+                continue;
+            }
+            it++;
+        }
+
+        if ((tok_len == 4 && !strncasecmp(tok, "gzip", 4)) ||
+            (tok_len == 6 && !strncasecmp(tok, "x-gzip", 6))) {
+            gzip = q;
+        } else if (tok_len == 7 && !strncasecmp(tok, "deflate", 7)) {
+            deflate = q;
+        } else if (tok_len == 1 && *tok == '*') {
+            any = q;
+        }
+    }
+
+    if (gzip > 0 || (gzip == -1 && any > 0)) {
+        return ZIP_GZIP;
+    }
+    if (deflate > 0 || (deflate == -1 && any > 0)) {
+        return ZIP_DEFLATE;
+    }
+    return ZIP_IDENTITY;
+}
+int type_compressible(appster_t* a, const char* type) {
+    size_t len, n;
+
+    /* the media type without its parameters */
+    len = strcspn(type, "; \t");
+
+    for (char** it = a->zip_types; *it; it++) {
+        n = strlen(*it);
+
+        /* "text/" stands for the whole class */
+        if ((*it)[n - 1] == '/' ? len > n && !strncasecmp(type, *it, n)
+                                : len == n && !strncasecmp(type, *it, n)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+void compress_reply(context_t* ctx, int status) {
+    connection_t* con = ctx->con;
+    evbuffer_t* out;
+    zstream_t* zs;
+    size_t len;
+    int encoding, err;
+
+    len = ctx->send_body ? evbuffer_get_length(ctx->send_body) : 0;
+    encoding = reply_encoding(ctx, status);
+
+    /* the file compressed ahead stands in as long as nothing was written after it */
+    if (ctx->zipped && encoding && len == ctx->zipped_len) {
+        buffer_put(con, ctx->send_body);
+        ctx->send_body = ctx->zipped;
+        ctx->zipped = NULL;
+        ctx->flag.encoding = encoding;
+        ctx->flag.has_file = 0;
+        con->loop->stats.compressed++;
+        return;
+    }
+
+    buffer_put(con, ctx->zipped);
+    ctx->zipped = NULL;
+
+    /* other file segments are not compressed on the loop, they can be large */
+    if (!encoding || len < ctx->appster->zip_min || ctx->flag.has_file) {
+        return;
+    }
+
+    zs = zp_get(con->loop->zip, encoding);
+    if (!zs) {
+        return;
+    }
+
+    out = buffer_get(con);
+    err = zp_deflate(zs, ctx->send_body, len, out, ZIP_FINISH);
+    zp_put(con->loop->zip, zs);
+
+    /* what does not get smaller goes out as it is */
+    if (err || evbuffer_get_length(out) >= len) {
+        buffer_put(con, out);
+        return;
+    }
+
+    buffer_put(con, ctx->send_body);
+    ctx->send_body = out;
+    ctx->flag.encoding = encoding;
+    con->loop->stats.compressed++;
+}
+void compress_file(context_t* ctx, const char* path, const struct stat* st) {
+    loop_t* loop = ctx->con->loop;
+    zstream_t* zs;
+    evbuffer_t* out;
+    int encoding, err;
+
+    if (!file_zippable(ctx, st) || ctx->flag.sendfile ||
+        evbuffer_get_length(ctx->send_body) != (size_t) st->st_size) {
+        return;
+    }
+
+    encoding = reply_encoding(ctx, 200);
+    out = buffer_get(ctx->con);
+    if (zp_cache_get(loop->zip, path, encoding, st, out) == 0) {
+        loop->stats.compress_cache_hits++;
+        goto done;
+    }
+
+    zs = zp_get(loop->zip, encoding);
+    if (!zs) {
+        buffer_put(ctx->con, out);
+        return;
+    }
+
+    err = zp_deflate(zs, ctx->send_body, st->st_size, out, ZIP_FINISH);
+    zp_put(loop->zip, zs);
+    if (err || evbuffer_get_length(out) >= (size_t) st->st_size) {
+        buffer_put(ctx->con, out);
+        return;
+    }
+    zp_cache_put(loop->zip, path, encoding, st, out);
+
+done:
+    ctx->zipped = out;
+    ctx->zipped_len = st->st_size;
+}
+int file_zippable(context_t* ctx, const struct stat* st) {
+    loop_t* loop = ctx->con->loop;
+
+    if (!loop->zip || ctx->flag.streaming || ctx->zipped) {
+        return 0;
+    }
+
+    /*
+     The type may still be set, compress_reply checks again. Files are
+     compressed once, only as many as the cache keeps.
+     */
+    return reply_encoding(ctx, 200) && S_ISREG(st->st_mode) &&
+           st->st_size >= ctx->appster->zip_min && (size_t) st->st_size <= zp_cache_limit(loop->zip);
+}
+int compress_chunk(context_t* ctx, int final) {
+    connection_t* con = ctx->con;
+    evbuffer_t* out;
+    size_t len;
     int err;
 
+    len = ctx->chunk ? evbuffer_get_length(ctx->chunk) : 0;
+    if (!len && !final) {
+        return 0;
+    }
+
+    /* every flush is a sync flush, the client gets the data as it's sent */
+    out = buffer_get(con);
+    err = zp_deflate(ctx->zs, ctx->chunk, len, out, final ? ZIP_FINISH : ZIP_FLUSH);
+
+    buffer_put(con, ctx->chunk);
+    ctx->chunk = out;
+
+    if (final) {
+        zp_put(con->loop->zip, ctx->zs);
+        ctx->zs = NULL;
+        con->loop->stats.compressed++;
+    }
+
+    return err;
+}
+int static_serve(void* data) {
+    static_route_t* sr = data;
+    context_t* ctx = __current_ctx;
+    loop_t* loop = ctx->con->loop;
+    char path[PATH_MAX];
+    const char* rel,* h,* q;
+    evbuffer_t* buf;
+    fc_file_t* f;
+    time_t since;
+    uint32_t len;
+    int dir, status;
+
+    rel = as_arg_exists(0) ? as_arg_string(0) : "";
+    dir = !*rel || rel[strlen(rel) - 1] == '/';
+
+    /* the prefix alone is the directory, relative links need the slash */
+    q = memchr(ctx->url, '?', ctx->url_len);
+    len = q ? (uint32_t) (q - ctx->url) : ctx->url_len;
+    if (!*rel && len && ctx->url[len - 1] != '/') {
+        return static_redirect(ctx);
+    }
+
+    if (static_path(sr, rel, path, sizeof(path))) {
+        return 404;
+    }
+
+    f = fc_open(loop->files, path, uv_now(&loop->uv));
+    if (!f) {
+        if (errno == EISDIR && !dir) {
+            return static_redirect(ctx);
+        }
+        return errno == EACCES ? 403 : errno == EMFILE || errno == ENFILE || errno == ENOMEM ? 500 : 404;
+    }
+
+    ctx->file = f;
+    ctx->max_age = sr->max_age;
+
+    /*
+     If-Modified-Since only counts without If-None-Match. A date that does not
+     parse or lies ahead of our clock is ignored.
+     */
+    h = as_header_id(AH_IF_NONE_MATCH, &len);
+    if (h) {
+        if (etag_match(h, len, f)) {
+            return 304;
+        }
+    } else {
+        h = as_header_id(AH_IF_MODIFIED_SINCE, &len);
+        if (h && !parse_date(h, len, &since) && since <= time(NULL) && f->st.st_mtime <= since) {
+            return 304;
+        }
+    }
+
+    if (ctx->known[AH_RANGE]) {
+        status = static_range(ctx, f);
+        if (status) {
+            return status;
+        }
+    }
+
+    /* a file that may go out compressed is mapped, the others are sent with sendfile */
+    buf = file_zippable(ctx, &f->st) ? output_buffer(ctx) : file_buffer(ctx);
+    if (f->st.st_size && evbuffer_add_file_segment(buf, f->seg, 0, f->st.st_size)) {
+        return 500;
+    }
+    ctx->flag.has_file = 1;
+
+    compress_file(ctx, path, &f->st);
+    return 200;
+}
+int static_path(static_route_t* sr, const char* rel, char* dst, size_t size) {
+    char* it,* seg,* end;
+    size_t len;
+    int c;
+
+    len = strlen(sr->root);
+    if (len + 1 >= size) {
+        return -1;
+    }
+
+    memcpy(dst, sr->root, len);
+    it = dst + len;
+    end = dst + size - 1;
+    *it++ = '/';
+    seg = it;
+
+    /* the capture is decoded already, a %2F is checked as the slash it is */
+    for (;; rel++) {
+        c = *rel;
+        if (c == '/' || !c) {
+            len = it - seg;
+            if ((c && !len) || (len == 1 && seg[0] == '.') || (len == 2 && seg[0] == '.' && seg[1] == '.')) {
+                return -1;
+            }
+            if (!c) {
+                break;
+            }
+        }
+
+        if (it == end) {
+            return -1;
+        }
+        *it++ = c;
+        if (c == '/') {
+            seg = it;
+        }
+    }
+
+    /* a directory is its index */
+    if (it == seg) {
+        len = strlen(sr->index);
+        if (len > (size_t) (end - it)) {
+            return -1;
+        }
+        memcpy(it, sr->index, len);
+        it += len;
+    }
+
+    *it = 0;
+    return 0;
+}
+int static_redirect(context_t* ctx) {
+    const char* q;
+    char* location;
+    uint32_t len;
+
+    q = memchr(ctx->url, '?', ctx->url_len);
+    len = q ? (uint32_t) (q - ctx->url) : ctx->url_len;
+
+    location = ar_malloc(ctx->arena, ctx->url_len + 2);
+    memcpy(location, ctx->url, len);
+    location[len] = '/';
+    memcpy(location + len + 1, ctx->url + len, ctx->url_len - len);
+    location[ctx->url_len + 1] = 0;
+
+    as_write_header("Location", location);
+    return 301;
+}
+int static_range(context_t* ctx, fc_file_t* f) {
+    uint64_t first, count;
+    const char* h;
+    uint32_t len;
+    int rc;
+
+    /* If-Range wants the part only of the file it names, the whole one otherwise */
+    h = as_header_id(AH_IF_RANGE, &len);
+    if (h && !(len == f->etag_len && !memcmp(h, f->etag, len)) &&
+        !(len == f->modified_len && !memcmp(h, f->modified, len))) {
+        return 0;
+    }
+
+    h = as_header_id(AH_RANGE, &len);
+    rc = parse_range(h, len, f->st.st_size, &first, &count);
+    if (rc == 0) {
+        return 0;
+    }
+
+    ctx->flag.range = 1;
+    if (rc < 0) {
+        return 416;
+    }
+
+    ctx->range_first = first;
+    ctx->range_len = count;
+    if (evbuffer_add_file_segment(file_buffer(ctx), f->seg, first, count)) {
+        return 500;
+    }
+    ctx->flag.has_file = 1;
+
+    return 206;
+}
+int etag_match(const char* value, uint32_t len, const fc_file_t* f) {
+    const char* end = value + len,* tok;
+    uint32_t tok_len;
+
+    /* weak comparison, a compressed variant is W/ of the same tag */
+    while (value < end) {
+        while (value < end && (*value == ',' || *value == ' ' || *value == '\t')) {
+            value++;
+        }
+        tok = value;
+        while (value < end && *value != ',' && *value != ' ' && *value != '\t') {
+            value++;
+        }
+        tok_len = value - tok;
+
+        if (tok_len == 1 && *tok == '*') {
+            return 1;
+        }
+        if (tok_len > 2 && !memcmp(tok, "W/", 2)) {
+            tok += 2;
+            tok_len -= 2;
+        }
+        if (tok_len == f->etag_len && !memcmp(tok, f->etag, tok_len)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+int parse_range(const char* value, uint32_t len, uint64_t size, uint64_t* first, uint64_t* count) {
+    const char* it = value + 6,* end = value + len;
+    uint64_t num[2] = { 0, 0 };
+    int has[2] = { 0, 0 };
+
+    /* a single range of bytes, anything else is answered with the whole file */
+    if (len < 6 || strncasecmp(value, "bytes=", 6) || memchr(it, ',', end - it)) {
+        return 0;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        while (it < end && *it == ' ') {
+            it++;
+        }
+        while (it < end && isdigit((unsigned char) *it)) {
+            if (num[i] > (UINT64_MAX - 9) / 10) {
+                return 0;
+            }
+            num[i] = num[i] * 10 + (*it++ - '0');
+            has[i] = 1;
+        }
+        while (it < end && *it == ' ') {
+            it++;
+        }
+        if (i == 0 && (it == end || *it++ != '-')) {
+            return 0;
+        }
+    }
+    if (it != end || (!has[0] && !has[1]) || (has[0] && has[1] && num[1] < num[0])) {
+        return 0;
+    }
+
+    /* the last n bytes */
+    if (!has[0]) {
+        if (!num[1] || !size) {
+            return -1;
+        }
+        *first = num[1] < size ? size - num[1] : 0;
+        *count = size - *first;
+        return 1;
+    }
+
+    if (num[0] >= size) {
+        return -1;
+    }
+    *first = num[0];
+    *count = (has[1] && num[1] < size - 1 ? num[1] : size - 1) - num[0] + 1;
+    return 1;
+}
+int parse_date(const char* value, uint32_t len, time_t* t) {
+    char date[32];
+    struct tm tm;
+    char* end;
+
+    /* IMF-fixdate only, the format every sender has to use */
+    if (len >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value, len);
+    date[len] = 0;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) {
+        return -1;
+    }
+
+    *t = timegm(&tm);
+    return 0;
+}
+char* render_file_head(context_t* ctx, int status, char* dst) {
+    fc_file_t* f = ctx->file;
+    char* it = dst;
+    size_t len;
+
+    /* errors of a static route are not about the file */
+    if (status >= 300 && status != 304 && status != 416) {
+        return it;
+    }
+
+    if (status != 304 && status != 416) {
+        len = strlen(f->type);
+        memcpy(it, "Content-Type: ", 14);
+        memcpy(it + 14, f->type, len);
+        memcpy(it + 14 + len, "\r\n", 2);
+        it += 16 + len;
+    }
+
+    memcpy(it, "ETag: ", 6);
+    it += 6;
+    if (ctx->flag.encoding) { /* the compressed body is not the same bytes */
+        memcpy(it, "W/", 2);
+        it += 2;
+    }
+    memcpy(it, f->etag, f->etag_len);
+    it += f->etag_len;
+    memcpy(it, "\r\nLast-Modified: ", 17);
+    it += 17;
+    memcpy(it, f->modified, f->modified_len);
+    it += f->modified_len;
+    memcpy(it, "\r\n", 2);
+    it += 2;
+
+    if (status != 304) {
+        memcpy(it, "Accept-Ranges: bytes\r\n", 22);
+        it += 22;
+    }
+    if (ctx->flag.range) {
+        memcpy(it, "Content-Range: ", 15);
+        it += 15;
+        it += content_range(ctx, it);
+        memcpy(it, "\r\n", 2);
+        it += 2;
+    }
+    if (ctx->max_age) {
+        memcpy(it, "Cache-Control: max-age=", 23);
+        it += 23;
+        it += u64toa(ctx->max_age, it);
+        memcpy(it, "\r\n", 2);
+        it += 2;
+    }
+
+    return it;
+}
+void http2_file_headers(context_t* ctx, int status, evbuffer_t* block) {
+    fc_file_t* f = ctx->file;
+    char value[64];
+    uint32_t n = 0;
+
+    if (status >= 300 && status != 304 && status != 416) {
+        return;
+    }
+
+    if (status != 304 && status != 416) {
+        hp_encode(block, "content-type", 12, f->type, strlen(f->type));
+    }
+
+    if (ctx->flag.encoding) {
+        memcpy(value, "W/", 2);
+        n = 2;
+    }
+    memcpy(value + n, f->etag, f->etag_len);
+    hp_encode(block, "etag", 4, value, n + f->etag_len);
+    hp_encode(block, "last-modified", 13, f->modified, f->modified_len);
+
+    if (status != 304) {
+        hp_encode(block, "accept-ranges", 13, "bytes", 5);
+    }
+    if (ctx->flag.range) {
+        n = content_range(ctx, value);
+        hp_encode(block, "content-range", 13, value, n);
+    }
+    if (ctx->max_age) {
+        memcpy(value, "max-age=", 8);
+        n = 8 + u64toa(ctx->max_age, value + 8);
+        hp_encode(block, "cache-control", 13, value, n);
+    }
+}
+uint32_t content_range(context_t* ctx, char* dst) {
+    char* it = dst;
+
+    memcpy(it, "bytes ", 6);
+    it += 6;
+
+    /* an unsatisfiable range has no part to name */
+    if (ctx->range_len) {
+        it += u64toa(ctx->range_first, it);
+        *it++ = '-';
+        it += u64toa(ctx->range_first + ctx->range_len - 1, it);
+    } else {
+        *it++ = '*';
+    }
+    *it++ = '/';
+    it += u64toa(ctx->file->st.st_size, it);
+
+    return it - dst;
+}
+void files_poll(uv_poll_t* handle, int status, int events) {
+    loop_t* loop = handle->data;
+
     if (status < 0) {
         ELOG("uv error %s", uv_strerror(status));
         return;
     }
 
-    ctx = parser_get_context(con->parser);
+    fc_notify(loop->files);
+}
+int hex_digit(int c) {
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+int cache_lookup(context_t* ctx) {
+    loop_t* loop = ctx->con->loop;
+    char key[CACHE_KEY_MAX];
+    microcache_t* mc;
+    mc_entry_t* e;
+    mc_fill_t* fill;
+    header_t* h;
+
+    if (!ctx->sh || !ctx->vars || ctx->flag.parse_error || ctx->flag.body_too_large) {
+        return 0;
+    }
 
-    if (evbuffer_get_length(ctx->send_body)) {
-        err = write_connection(ctx->con, ctx->send_body);
-        if (err != 0) {
-        #ifdef HAS_CRYPTO
-            /*
-             crypto_write can trigger transparent re-negotiation if required. To
-             cope with that, we need to wait for socket to become writable or
-             readable, depending on what the negotiation step requires.
-             */
-            err = crypto_error_needs_data_only(con->ssl, err);
-            if (err) {
-                uv_poll_start(handle, err, write_poll);
-            } else {
-                uv_close((uv_handle_t*) handle, free_connection);
-            }
-        #endif
-        }
+    /* a request with a body or credentials gets a reply of its own */
+    mc = loop->caches[sh_get_index(ctx->sh)];
+    if (!mc || (ctx->method != HTTP_GET && ctx->method != HTTP_HEAD) ||
+        ctx->known[AH_AUTHORIZATION] || ctx->known[AH_CONTENT_LENGTH] ||
+        ctx->known[AH_TRANSFER_ENCODING]) {
+        return 0;
     }
 
-    /* Check again to see if the buffer has been drained */
-    if (!evbuffer_get_length(ctx->send_body)) {
-        if (!ctx->flag.should_keepalive) {
-            uv_close((uv_handle_t*) handle, free_connection);
-        } else {
-            vector_pop_front(ctx->con->contexts);
-            free_context(ctx);
-            if (0 < vector_size(con->contexts)) {
-              run_front_context(con->parser);
-              return;
-            }
-            /* Poll again only when all backlogged requests are complete. */
-            uv_poll_start(handle, UV_READABLE, read_poll);
+    /* the coding the client takes goes first, each one is kept apart */
+    h = ctx->known[AH_ACCEPT_ENCODING];
+    key[0] = '0' + (loop->zip && h ? accept_encoding(h->value, h->value_len) : ZIP_IDENTITY);
+    if (sh_key(ctx->sh, ctx->vars, key + 1, sizeof(key) - 1) < 0) {
+        return 0;
+    }
+
+    switch (mc_lookup(mc, key, uv_now(&loop->uv), &e, &fill)) {
+    case MC_HIT:
+        loop->stats.cache_hits++;
+        cache_serve(ctx, e);
+        return 1;
+    case MC_WAIT:
+        loop->stats.cache_collapsed++;
+        mc_wait(fill, &ctx->waiter, ctx);
+        return 1;
+    default:
+        loop->stats.cache_misses++;
+        ctx->fill = fill;
+        return 0;
+    }
+}
+void cache_serve(context_t* ctx, mc_entry_t* e) {
+    ctx->flag.done = 1; /* never started */
+    ctx->flag.encoding = e->encoding;
+    ctx->flag.vary = e->vary;
+
+    ctx->send_body = buffer_get(ctx->con);
+    if (mc_add_body(e, ctx->send_body)) {
+        ctx->flag.encoding = ZIP_IDENTITY;
+        ctx->flag.vary = 0;
+        send_reply(ctx, 500);
+        return;
+    }
+
+    ctx->cached = e;
+    send_reply(ctx, e->status);
+    ctx->cached = NULL;
+}
+void cache_fill(context_t* ctx, int status) {
+    loop_t* loop = ctx->con->loop;
+    microcache_t* mc;
+    mc_entry_t reply,* e = NULL;
+    evbuffer_t* head;
+
+    mc = loop->caches[sh_get_index(ctx->sh)];
+
+    /* a reply for a single client or of a part of a file is not shared */
+    if (cache_status(status) && !ctx->flag.parse_error && !ctx->flag.shed &&
+        !ctx->flag.has_file && !ctx->flag.range &&
+        !(ctx->send_headers && hm_get(ctx->send_headers, "set-cookie"))) {
+        head = buffer_get(ctx->con);
+        if (ctx->send_headers) {
+            hm_foreach(ctx->send_headers, add_header, head);
+        }
+
+        if (evbuffer_get_length(head) <= CACHE_HEAD_MAX) {
+            reply.status = status;
+            reply.encoding = ctx->flag.encoding;
+            reply.vary = ctx->flag.vary;
+            reply.head_len = evbuffer_get_length(head);
+            reply.head = reply.head_len ? (char*) evbuffer_pullup(head, -1) : "";
+            e = mc_put(mc, ctx->fill, &reply, ctx->send_body, uv_now(&loop->uv));
         }
+
+        buffer_put(ctx->con, head);
     }
+
+    mc_finish(mc, ctx->fill, e, cache_wake);
+    ctx->fill = NULL;
 }
-void free_context(context_t* ctx) {
-    if (!ctx)
+void cache_abandon(context_t* ctx) {
+    if (!ctx->fill) {
         return;
+    }
 
-    hm_foreach(ctx->headers, hm_cb_free, (void*) 1);
-    hm_foreach(ctx->send_headers, hm_cb_free, 0);
-    hm_free(ctx->headers);
-    hm_free(ctx->send_headers);
-    sh_free_values(ctx->sh, ctx->vars);
-    evbuffer_free(ctx->body);
-    evbuffer_free(ctx->send_body);
-    free(ctx->str);
-    free(ctx->write);
-    if (ctx->handle != -1) {
-        hclose(ctx->handle);
+    mc_finish(ctx->con->loop->caches[sh_get_index(ctx->sh)], ctx->fill, NULL, cache_wake);
+    ctx->fill = NULL;
+}
+void cache_wake(void* data, mc_entry_t* e) {
+    context_t* ctx = data;
+    loop_t* loop = ctx->con->loop;
+
+    (void) e;
+
+    /*
+     A fill finishes inside the route that filled it, often in its coroutine.
+     The waiters are dispatched again from the loop, where they look the key
+     up once more: the reply is found if it was kept, one of them fills it
+     otherwise, and HTTP/1 ones start within the pipeline depth.
+     */
+    if (!loop->woken) {
+        uv_idle_start(&loop->wake_idle, wake_contexts);
+    }
+    ctx->woken_next = loop->woken;
+    loop->woken = ctx;
+    ctx->flag.woken = 1;
+}
+void cache_unwake(context_t* ctx) {
+    context_t** it;
+
+    if (!ctx->flag.woken) {
+        return;
     }
 
-    free(ctx);
+    for (it = &ctx->con->loop->woken; *it != ctx; it = &(*it)->woken_next);
+    *it = ctx->woken_next;
+    ctx->flag.woken = 0;
 }
-void free_connection(uv_handle_t* handle) {
+void wake_contexts(uv_idle_t* handle) {
+    loop_t* loop = handle->data;
     connection_t* con;
+    context_t* ctx;
 
-    if (!handle || !handle->data) {
-        return;
+    while ((ctx = loop->woken)) {
+        loop->woken = ctx->woken_next;
+        ctx->flag.woken = 0;
+        con = ctx->con;
+
+        /* the request goes with its connection */
+        if (uv_is_closing((uv_handle_t*) &con->handle)) {
+            continue;
+        }
+
+        if (!con->h2) {
+            start_contexts(con);
+        } else if (!cache_lookup(ctx)) {
+            if (admit_context(ctx)) {
+                run_context(ctx);
+            } else {
+                shed_context(ctx);
+            }
+        }
     }
 
-    con = handle->data;
+    uv_idle_stop(handle);
+}
+int cache_status(int status) {
+    /* cacheable by default per RFC 7231, but for partial content */
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+void http2_cached_headers(mc_entry_t* e, evbuffer_t* block) {
+    const char* it = e->head,* end = e->head + e->head_len,* eol;
+    char line[CACHE_HEAD_MAX];
+    char* colon;
+
+    /* the lines are rendered as "name: value\r\n", with lowercase names */
+    while (it < end) {
+        eol = memchr(it, '\r', end - it);
+        memcpy(line, it, eol - it);
+        line[eol - it] = 0;
+        it = eol + 2;
+
+        colon = strchr(line, ':');
+        if (colon) {
+            *colon = 0;
+            http2_add_header(line, colon + 2, block);
+        }
+    }
+}
+void record_latency(context_t* ctx, int kind, int status, uint64_t since) {
+    loop_t* loop = ctx->con->loop;
+    histogram_t** h;
+    uint32_t idx;
 
-    VECTOR_FOR_EACH(con->contexts, msg) {
-        free_context(ITERATOR_GET_AS(context_t*, &msg));
+    idx = ctx->sh ? sh_get_index(ctx->sh) : loop->a->nroutes;
+    h = &loop->metrics[idx].latency[kind][status >= 100 && status < 600 ? status / 100 : 0];
+
+    /* only the first reply of a kind publishes, the counts are plain */
+    if (!*h) {
+        __atomic_store_n(h, hg_alloc(), __ATOMIC_RELEASE);
     }
 
-#ifdef HAS_CRYPTO
-    crypto_free_ssl(con->ssl);
-#endif
+    hg_record(*h, (uv_hrtime() - since) / 1000);
+}
+void write_route_metrics(schema_t* sh, void* user_data) {
+    char* route;
+    int method;
+
+    method = sh_get_method(sh);
+    route = metrics_label(sh_get_path(sh));
+    write_metrics(user_data, sh_get_index(sh), route,
+                  method == RT_ANY_METHOD ? "" : http_method_str(method));
+    free(route);
+}
+void write_metrics(metrics_writer_t* w, uint32_t idx, const char* route, const char* method) {
+    histogram_t* merged = w->merged;
+    route_metrics_t* metrics;
+    int kind = w->kind;
+    histogram_t* h;
+    loop_t* loop;
+
+    for (int c = 0; c < METRICS_CLASSES; c++) {
+        hg_reset(merged);
+
+        VECTOR_FOR_EACH(w->a->loops, it) {
+            loop = ITERATOR_GET_AS(loop_t*, &it);
+            metrics = loop->metrics;
+            h = metrics ? __atomic_load_n(&metrics[idx].latency[kind][c], __ATOMIC_ACQUIRE) : NULL;
+            if (h) {
+                hg_merge(merged, h);
+            }
+        }
 
-    vector_destroy(con->contexts);
-    close(con->fd);
-    free(con);
+        if (!hg_count(merged)) {
+            continue;
+        }
 
-    DLOG("Connection closed");
+        for (size_t i = 0; i < sizeof(metrics_bounds) / sizeof(metrics_bounds[0]); i++) {
+            as_write_f("%s_bucket{route=\"%s\",method=\"%s\",code=\"%s\",le=\"%s\"} %llu\n",
+                       metrics_names[kind].name, route, method, metrics_classes[c], metrics_bounds[i].le,
+                       (unsigned long long) hg_count_below(merged, metrics_bounds[i].max));
+        }
+        as_write_f("%s_bucket{route=\"%s\",method=\"%s\",code=\"%s\",le=\"+Inf\"} %llu\n",
+                   metrics_names[kind].name, route, method, metrics_classes[c],
+                   (unsigned long long) hg_count(merged));
+        as_write_f("%s_sum{route=\"%s\",method=\"%s\",code=\"%s\"} %.6f\n",
+                   metrics_names[kind].name, route, method, metrics_classes[c], hg_sum(merged) / 1e6);
+        as_write_f("%s_count{route=\"%s\",method=\"%s\",code=\"%s\"} %llu\n",
+                   metrics_names[kind].name, route, method, metrics_classes[c],
+                   (unsigned long long) hg_count(merged));
+    }
 }
-int write_connection(connection_t *con, evbuffer_t *buf) {
-#ifdef HAS_CRYPTO
-    if (con->ssl) {
-        char cbuf[16 * 1024];
-        int len = evbuffer_copyout(buf, cbuf, sizeof(cbuf));
+char* metrics_label(const char* value) {
+    size_t len = 0;
+    char* rc,* p;
 
-        len = crypto_write(con->ssl, cbuf, len);
-        if (len < 0) {
-            ELOG("Error preforming SSL write");
-            return -1;
+    /* label values escape the backslash, the double quote and line feeds */
+    for (const char* s = value; *s; s++) {
+        len += (*s == '\\' || *s == '"' || *s == '\n') ? 2 : 1;
+    }
+
+    rc = p = malloc(len + 1);
+    for (const char* s = value; *s; s++) {
+        if (*s == '\\' || *s == '"') {
+            *p++ = '\\';
+            *p++ = *s;
+        } else if (*s == '\n') {
+            *p++ = '\\';
+            *p++ = 'n';
         } else {
-            evbuffer_drain(buf, len);
+            *p++ = *s;
         }
-        /* XXX FIX THIS IS BAD */
-        write_poll(&con->handle, 0, 0);
-    } else
-#endif
-    {
-        /* Write to fd */
-        evbuffer_write(buf, con->fd);
     }
-    return 0;
+    *p = '\0';
+
+    return rc;
 }
 int on_parse_error(context_t* ctx) {
-    hm_foreach(ctx->headers, hm_cb_free, (void*) 1);
-    hm_free(ctx->headers);
-    sh_free_values(ctx->sh, ctx->vars);
-    evbuffer_free(ctx->body);
-    free(ctx->str);
+    buffer_put(ctx->con, ctx->body);
     free(ctx->write);
     if (ctx->handle != -1) {
         hclose(ctx->handle);
+        finish_route(ctx);
+        ctx->flag.done = 0; /* the error callback runs next */
     }
+    sp_put(ctx->con->loop->stacks, ctx->stack); /* the coroutine is done with it */
+    ctx->stack = NULL;
 
-    ctx->headers = NULL;
+    ctx->headers = NULL; /* the arena still holds these */
+    memset(ctx->known, 0, sizeof(ctx->known));
     ctx->body = NULL;
     ctx->vars = NULL;
-    ctx->str = NULL;
+    ctx->url = NULL;
+    ctx->key = NULL;
+    ctx->con->tok = NULL;
+    ctx->con->tok_len = 0;
     ctx->flag.parse_error = 1;
     ctx->handle = -1;
     return 0;
@@ -988,15 +5310,21 @@ int on_parse_error(context_t* ctx) {
 int on_message_begin(__AP_EVENT_CB) {
     connection_t* con;
     context_t* ctx;
+    arena_t* arena;
 
     con = p->data;
-    ctx = calloc(1, sizeof(context_t));
-    ctx->headers = hm_alloc(10, NULL, NULL);
-    ctx->body = evbuffer_new();
+    arena = arena_get(con);
+    ctx = ar_calloc(arena, 1, sizeof(context_t));
     ctx->con = con;
+    ctx->arena = arena;
     ctx->handle = -1;
     ctx->read_ch.ch[0] = -1;
     ctx->read_ch.ch[1] = -1;
+    ctx->write_ch.ch[0] = -1;
+    ctx->write_ch.ch[1] = -1;
+
+    arm_timeout(con, &con->timer, con->loop->a->header_timeout);
+    arm_timeout(con, &con->request_timer, con->loop->a->request_timeout);
 
     vector_push_back(con->contexts, &ctx);
     return 0;
@@ -1004,7 +5332,8 @@ int on_message_begin(__AP_EVENT_CB) {
 int on_inc_url(__AP_DATA_CB) {
     __AP_PREAMPLE;
 
-    evbuffer_add(ctx->body, at, len);
+    ctx->method = p->method;
+    token_append(ctx, at, len);
     return 0;
 }
 int on_inc_header_field(__AP_DATA_CB) {
@@ -1024,30 +5353,23 @@ int on_inc_header_field(__AP_DATA_CB) {
         ctx->flag.parsed_field = 0; /* start parsing new field */
     }
 
-    evbuffer_add(ctx->body, at, len);
+    token_append(ctx, at, len);
     return 0;
 }
 int on_inc_header_value(__AP_DATA_CB) {
     __AP_PREAMPLE;
 
     if (!ctx->flag.parsed_field) { /* parse this value's field */
-        int len;
-
-        if (!evbuffer_get_length(ctx->body)) {
+        if (!ctx->con->tok_len) {
             /* this is a protocol error so close the connection*/
             return -1;
         }
 
         ctx->flag.parsed_field = 1; /* signal that the field has been parsed */
-
-        len = evbuffer_get_length(ctx->body) + 1;
-
-        ctx->str = malloc(len);
-        evbuffer_remove(ctx->body, ctx->str, len);
-        ctx->str[len - 1] = 0;
+        ctx->key = token_take(ctx->con, &ctx->key_len);
     }
 
-    evbuffer_add(ctx->body, at, len);
+    token_append(ctx, at, len);
     return 0;
 }
 int on_inc_headers_complete(__AP_EVENT_CB) {
@@ -1073,14 +5395,24 @@ int on_inc_headers_complete(__AP_EVENT_CB) {
             }
 
             if (http_body_is_final(p)) {
-                evbuffer_free(ctx->body);
-                ctx->body = NULL;
                 ctx->flag.body_done = 1;
+            } else {
+                ctx->body = buffer_get(ctx->con);
             }
 
-            if (http_should_keep_alive(p)) {
+            if (http_should_keep_alive(p) && !ctx->con->loop->stopping) {
                 ctx->flag.should_keepalive = 1;
             }
+            if (p->http_major == 1 && p->http_minor == 0) {
+                ctx->flag.http10 = 1;
+            }
+
+            /* refuse what is announced too large before it's sent */
+            ctx->body_max = body_limit(ctx);
+            if (ctx->body_max && !ctx->flag.body_done &&
+                p->content_length != ULLONG_MAX && p->content_length > ctx->body_max) {
+                reject_body(ctx);
+            }
         }
     }
 
@@ -1094,11 +5426,18 @@ int on_inc_headers_complete(__AP_EVENT_CB) {
     uv_poll_start(&ctx->con->handle, UV_WRITABLE, write_poll);
 #endif
 
-    /* execute the concurr callback */
-    if (ctx->handle == -1 && vector_size(ctx->con->contexts)) {
-        run_front_context(p);
+    /* h2c, the request is run as the first stream of the connection */
+    if (p->upgrade && !ctx->flag.parse_error && http2_upgrade(ctx) == 0) {
+        return 0;
     }
 
+    /* canceled once the message is complete, right away without a body */
+    arm_timeout(ctx->con, &ctx->con->timer, ctx->appster->body_timeout);
+
+    ctx->flag.headers_done = 1;
+    ctx->ready = uv_hrtime();
+    start_contexts(ctx->con);
+
     return 0;
 }
 int on_inc_body(__AP_DATA_CB) {
@@ -1106,7 +5445,15 @@ int on_inc_body(__AP_DATA_CB) {
 
     ctx = parser_get_active_context(p);
 
-    if (ctx->flag.parse_error) {
+    arm_timeout(ctx->con, &ctx->con->timer, ctx->appster->body_timeout);
+
+    if (ctx->flag.parse_error || ctx->flag.body_too_large) {
+        return 0;
+    }
+
+    ctx->body_len += len;
+    if (ctx->body_max && ctx->body_len > ctx->body_max) {
+        reject_body(ctx);
         return 0;
     }
 
@@ -1114,10 +5461,35 @@ int on_inc_body(__AP_DATA_CB) {
         ctx->flag.body_done = 1;
     }
 
-    if (ctx->body) {
+    /* the body of an answered request is dropped */
+    if (ctx->body && !ctx->flag.replied) {
         evbuffer_add(ctx->body, at, len);
+        if (evbuffer_get_length(ctx->body) > BODY_HIGH_WATERMARK) {
+            ctx->con->throttled = 1;
+            tw_cancel(&ctx->con->timer); /* the wait is on us, not the client */
+        }
+    }
+
+    if (as_channel_good(ctx->read_ch)) {
+        as_channel_send(ctx->read_ch, NULL);
+    }
+
+    return 0;
+}
+int on_message_complete(__AP_EVENT_CB) {
+    context_t* ctx;
+
+    ctx = parser_get_active_context(p);
+
+    tw_cancel(&ctx->con->timer);
+    tw_cancel(&ctx->con->request_timer);
+
+    if (ctx->flag.parse_error || ctx->flag.body_done) {
+        return 0;
     }
 
+    ctx->flag.body_done = 1;
+
     if (as_channel_good(ctx->read_ch)) {
         as_channel_send(ctx->read_ch, NULL);
     }
@@ -1125,67 +5497,276 @@ int on_inc_body(__AP_DATA_CB) {
     return 0;
 }
 int complete_header(__AP_EVENT_CB) {
-    char* value;
-    int len;
-    void* prev;
+    header_t* h;
+    appster_header_id_t id;
 
     __AP_PREAMPLE;
 
-    if (!evbuffer_get_length(ctx->body)) {
-        /* this is a protocol error so close the connection */
-        return -1;
+    if (!ctx->key) { /* Check if client sent no headers at all */
+        return 0;
+    }
+
+    h = ar_malloc(ctx->arena, sizeof(header_t));
+    h->key = ctx->key;
+    h->key_len = ctx->key_len;
+    h->value = token_take(ctx->con, &h->value_len);
+    if (!h->value) { /* empty value */
+        h->value = "";
+    }
+
+    h->next = ctx->headers; /* the latest duplicate is found first */
+    ctx->headers = h;
+    ctx->key = NULL;
+
+    id = header_intern(h->key, h->key_len);
+    if (id != AH_UNKNOWN) {
+        ctx->known[id] = h;
+    }
+
+    return 0;
+}
+uint64_t body_limit(context_t* ctx) {
+    appster_t* a = ctx->appster;
+    uint64_t* limit = NULL;
+
+    if (ctx->sh) {
+        limit = hm_get(a->body_limits, sh_get_path(ctx->sh));
+    }
+
+    return limit ? *limit : a->max_body;
+}
+void reject_body(context_t* ctx) {
+    ctx->flag.body_too_large = 1;
+    ctx->flag.body_done = 1;
+    ctx->flag.should_keepalive = 0; /* the rest of the body is never read */
+
+    buffer_put(ctx->con, ctx->body);
+    ctx->body = NULL;
+
+    /* read_poll stops reading once the parser returns, HTTP/2 drops the rest */
+    if (!ctx->con->h2) {
+        http_parser_pause(ctx->con->parser, 1);
     }
 
-    len = evbuffer_get_length(ctx->body) + 1;
+    if (as_channel_good(ctx->read_ch)) {
+        as_channel_send(ctx->read_ch, NULL);
+    }
+}
+int body_wait(context_t* ctx, uv_poll_cb cb) {
+    connection_t* con = ctx->con;
+    void* msg;
+    int rc;
 
-    value = malloc(len);
-    evbuffer_remove(ctx->body, value, len);
-    value[len - 1] = 0;
+    /*
+     Reading stops when too much body is buffered, it's drained by now.
+     A pending reply of an earlier request resumes reading once written.
+     */
+    if (con->expired) {
+        ctx->flag.connection_closed = 1;
+        return -1;
+    }
 
-    if (ctx->str) { /* Check if client sent no headers at all */
-        to_lower(ctx->str);
-        prev = hm_put(ctx->headers, ctx->str, value);
-        if (prev) {
-            free(prev);
-            free(ctx->str);
+    if (con->h2) { /* the client sends more once the window is given back */
+        http2_consume(ctx);
+    } else {
+        con->throttled = 0;
+        arm_timeout(con, &con->timer, con->loop->a->body_timeout);
+        if (!con->writing) {
+            uv_poll_start(&con->handle, UV_READABLE, cb);
         }
-        ctx->str = NULL;
+    }
+
+    /* wait for a signal, canceled when the connection goes away */
+    ctx->read_ch = as_channel_alloc();
+    rc = chrecv(ctx->read_ch.ch[0], &msg, sizeof(void*), -1);
+    if (rc == 0) {
+        channel_recycle(ctx->read_ch);
     } else {
-        free(value);
+        as_channel_free(ctx->read_ch);
     }
+    ctx->read_ch.ch[0] = -1;
+    ctx->read_ch.ch[1] = -1;
 
-    return 0;
+    __current_ctx = ctx;
+
+    if (rc != 0) {
+        ctx->flag.connection_closed = 1;
+    }
+
+    return ctx->flag.connection_closed || ctx->flag.body_too_large ? -1 : 0;
+}
+int body_can_splice(context_t* ctx, int fd) {
+    http_parser_t* p = ctx->con->parser;
+    int flags;
+
+#ifdef HAS_CRYPTO
+    if (ctx->con->ssl) {
+        return 0;
+    }
+#endif
+    if (ctx->con->h2) { /* the body comes in DATA frames */
+        return 0;
+    }
+
+    /* only a body of known length can be moved without the parser */
+    if (ctx != parser_get_active_context(p) || ctx->flag.body_done ||
+        (p->flags & F_CHUNKED) || p->content_length == ULLONG_MAX) {
+        return 0;
+    }
+
+    /* splice does not append */
+    flags = fcntl(fd, F_GETFL);
+    return flags != -1 && !(flags & O_APPEND);
+}
+int64_t splice_body(context_t* ctx, int fd, int64_t max) {
+    connection_t* con = ctx->con;
+    loop_t* loop = con->loop;
+    http_parser_t* p = con->parser;
+    ssize_t in, out;
+    int64_t tot = 0;
+
+    if (loop->pipe[0] == -1) {
+        if (pipe2(loop->pipe, O_NONBLOCK | O_CLOEXEC)) {
+            ELOG("Failed to create splice pipe %s", strerror(errno));
+            ctx->flag.splicing = 0;
+            return 0;
+        }
+        fcntl(loop->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+
+    /*
+     From the first splice on the rest of the body bypasses the parser, which
+     starts over with the next request once it's all in.
+     */
+    if (!ctx->bypass) {
+        ctx->bypass = p->content_length;
+    }
+    max = MIN((uint64_t) max, ctx->bypass);
+
+    while (tot < max) {
+        in = splice(con->fd, NULL, loop->pipe[1], NULL, max - tot, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (body_wait(ctx, splice_poll)) {
+                return -1;
+            }
+            continue;
+        }
+        if (in <= 0) {
+            DLOG("Failed to splice body %s", in ? strerror(errno) : "connection closed");
+            ctx->flag.connection_closed = 1;
+            close_connection(con);
+            return -1;
+        }
+
+        ctx->bypass -= in;
+        ctx->body_len += in;
+        tot += in;
+
+        while (in) {
+            out = splice(loop->pipe[0], NULL, fd, NULL, in, SPLICE_F_MOVE);
+            if (out <= 0) {
+                /* whatever is stuck in the pipe is lost with it */
+                ELOG("Failed to splice body %s", strerror(errno));
+                close(loop->pipe[0]);
+                close(loop->pipe[1]);
+                loop->pipe[0] = -1;
+                loop->pipe[1] = -1;
+                return -1;
+            }
+            in -= out;
+        }
+    }
+
+    if (!ctx->bypass) { /* the route is here, nothing to wake */
+        http_parser_init(p, HTTP_REQUEST);
+        tw_cancel(&con->timer);
+        tw_cancel(&con->request_timer);
+        ctx->flag.body_done = 1;
+    }
+
+    return tot;
+}
+size_t bypass_body(context_t* ctx, const char* at, size_t len) {
+    http_parser_t* p = ctx->con->parser;
+
+    /* what is left of a body the route stopped splicing goes in as if parsed */
+    len = MIN(len, ctx->bypass);
+    ctx->bypass -= len;
+    on_inc_body(p, at, len);
+
+    if (!ctx->bypass && !ctx->flag.body_too_large) {
+        http_parser_init(p, HTTP_REQUEST);
+        on_message_complete(p);
+    }
+
+    return len;
+}
+void splice_poll(uv_poll_t* handle, int status, int events) {
+    connection_t* con = handle->data;
+    context_t* ctx;
+
+    /* the route polls again if it needs more */
+    uv_poll_stop(handle);
+
+    if (vector_is_empty(con->contexts)) {
+        return;
+    }
+
+    ctx = parser_get_active_context(con->parser);
+    if (as_channel_good(ctx->read_ch)) {
+        as_channel_send(ctx->read_ch, NULL);
+    }
 }
 int parse_arguments(context_t* ctx) {
-    char buf[8192], * it,* s;
-    int nread;
+    char buf[8192],* args,* captures[RT_MAX_CAPTURES];
+    rt_capture_t caps[RT_MAX_CAPTURES];
+    uint32_t path_len, ncaps;
     appster_t* a;
 
     a = ctx->appster;
 
-    if (evbuffer_get_length(ctx->body) >= 8192) {
+    if (!ctx->con->h2) { /* HTTP/2 has it from :path */
+        ctx->url = token_take(ctx->con, &ctx->url_len);
+    }
+
+    if (ctx->url_len >= 8192) {
         /* this is a protocol error so close the connection */
         ctx->flag.parse_error = 1;
         return -1;
     }
 
-    nread = evbuffer_remove(ctx->body, buf, 8192);
-    lassert(nread >= 0);
+    /* captures and arguments are terminated in place, the read buffer is left intact */
+    memcpy(buf, ctx->url, ctx->url_len);
+    buf[ctx->url_len] = 0;
 
-    buf[nread] = 0;
+    args = memchr(buf, '?', ctx->url_len);
+    path_len = args ? args - buf : ctx->url_len;
 
-    it = strtok_r(buf, "?", &s); /* path */
-    ctx->sh = hm_get(a->routes, it);
+    ctx->sh = rt_find(a->router, ctx->method, buf, path_len, caps, &ncaps, &ctx->allow);
 
     if (!ctx->sh) {
-        ELOG("Missing schema for %s", it);
+        if (!ctx->allow) {
+            ELOG("Missing schema for %s %.*s", http_method_str(ctx->method), (int) path_len, buf);
+        }
         on_parse_error(ctx);
         return -1;
     }
 
-    it = strtok_r(NULL, "", &s); /* args */
+    if (args) {
+        *args++ = 0;
+    }
+
+    for (uint32_t i = 0; i < ncaps; i++) {
+        captures[i] = buf + caps[i].offset;
+        captures[i][caps[i].len] = 0;
+        if (decode_capture(captures[i])) {
+            DLOG("Invalid escape in path capture %u", i);
+            on_parse_error(ctx);
+            return -1;
+        }
+    }
 
-    ctx->vars = sh_parse(ctx->sh, it);
+    ctx->vars = sh_parse(ctx->sh, args, captures, ctx->arena);
     if (!ctx->vars) {
         ELOG("Failed to parse args");
         on_parse_error(ctx);
@@ -1195,6 +5776,41 @@ int parse_arguments(context_t* ctx) {
     ctx->flag.parsed_arguments = 1;
     return 0;
 }
+int decode_capture(char* s) {
+    char* out = s;
+
+    /* in place, a NUL could cut the value short so it's refused */
+    for (; *s; s++) {
+        if (*s != '%') {
+            *out++ = *s;
+            continue;
+        }
+
+        if (!isxdigit((unsigned char) s[1]) || !isxdigit((unsigned char) s[2])) {
+            return -1;
+        }
+        *out = (hex_digit(s[1]) << 4) | hex_digit(s[2]);
+        if (!*out++) {
+            return -1;
+        }
+        s += 2;
+    }
+
+    *out = 0;
+    return 0;
+}
+int method_not_allowed(context_t* ctx) {
+    char allow[512],* it = allow;
+
+    for (int m = 0; m < 64; m++) {
+        if (ctx->allow & (1ULL << m)) {
+            it += snprintf(it, allow + sizeof(allow) - it, "%s%s", it == allow ? "" : ", ", http_method_str(m));
+        }
+    }
+
+    as_write_header("Allow", allow);
+    return 405;
+}
 context_t* parser_get_context(http_parser_t* p) {
     connection_t* con;
 
@@ -1207,13 +5823,3 @@ context_t* parser_get_active_context(http_parser_t* p) {
     con = p->data;
     return *((context_t **) vector_back(con->contexts));
 }
-void
-run_front_context (
-  http_parser_t *p
-) {
-  context_t *ctx = parser_get_context(p);
-  if (ctx->handle == -1) {
-    __current_ctx = ctx;
-    ctx->handle = go(execute_context());
-  }
-}
@@ -8,6 +8,8 @@
 #define AS_REQUIRED 1
 #define AS_OPTIONAL 0
 
+#define AS_THREADS_AUTO 0
+
 typedef struct appster_s appster_t;
 typedef int (*as_route_cb_t) ();
 
@@ -30,11 +32,75 @@ typedef struct appster_schema_entry_s {
     int is_required;
 } appster_schema_entry_t;
 
+typedef struct appster_static_opts_s {
+    const char* index; /* file served for a directory, NULL is index.html */
+    uint32_t max_age; /* seconds of Cache-Control: max-age, 0 sends none */
+} appster_static_opts_t;
+
 typedef union appster_channel_u
 {
     int ch[2];
 } appster_channel_t;
 
+typedef enum appster_header_id_e {
+    AH_ACCEPT,
+    AH_ACCEPT_ENCODING,
+    AH_ACCEPT_LANGUAGE,
+    AH_AUTHORIZATION,
+    AH_CACHE_CONTROL,
+    AH_CONNECTION,
+    AH_CONTENT_ENCODING,
+    AH_CONTENT_LENGTH,
+    AH_CONTENT_TYPE,
+    AH_COOKIE,
+    AH_EXPECT,
+    AH_HOST,
+    AH_IF_MATCH,
+    AH_IF_MODIFIED_SINCE,
+    AH_IF_NONE_MATCH,
+    AH_IF_RANGE,
+    AH_IF_UNMODIFIED_SINCE,
+    AH_ORIGIN,
+    AH_RANGE,
+    AH_REFERER,
+    AH_TRANSFER_ENCODING,
+    AH_UPGRADE,
+    AH_USER_AGENT,
+    AH_X_FORWARDED_FOR,
+    AH_X_REQUEST_ID,
+    AH_UNKNOWN, /* not a header, number of known headers */
+} appster_header_id_t;
+
+typedef struct appster_loop_stats_s {
+    uint64_t accepted; /* connections accepted and attached to the loop */
+    uint64_t refused; /* connections dropped by the loop or failed accepts */
+    uint64_t drains; /* readiness events that drained the accept queue */
+    uint64_t drain_time_ns; /* total time spent draining the accept queue */
+    uint64_t stack_hits; /* request coroutines started on a pooled stack */
+    uint64_t stack_misses; /* request coroutines that needed a new stack */
+    uint64_t timeouts; /* connections expired by a timeout */
+    uint64_t shed; /* requests answered with 503 over an inflight limit */
+    uint64_t inflight; /* routes running right now */
+    uint64_t tls_handshakes; /* completed TLS handshakes */
+    uint64_t tls_resumed; /* handshakes that resumed a session or a ticket */
+    uint64_t tls_ktls; /* TLS connections the kernel encrypts */
+    uint64_t h2_connections; /* connections that switched to HTTP/2 */
+    uint64_t h2_streams; /* HTTP/2 requests */
+    uint64_t compressed; /* replies sent gzip or deflate encoded */
+    uint64_t compress_cache_hits; /* files sent compressed without compressing them */
+    uint64_t file_hits; /* static files found open in the cache */
+    uint64_t file_misses; /* static files that had to be opened */
+    uint64_t cache_hits; /* replies served from a route cache */
+    uint64_t cache_misses; /* routes run to fill a route cache */
+    uint64_t cache_collapsed; /* requests that waited for another one to fill it */
+} appster_loop_stats_t;
+
+/*
+ Allocate appster instance running the given amount of event loops. Each loop
+ is served by its own thread; the first loop runs on the thread that calls
+ as_listen_and_serve. Passing AS_THREADS_AUTO creates one loop per cpu the
+ process is allowed to run on.
+ */
 appster_t* as_alloc(unsigned threads);
 void as_free(appster_t* a);
 /*
@@ -53,14 +119,247 @@ void as_global_cleanup();
  of these values to NULL disables crypto for this instace.
  */
 void as_load_ssl_cert_and_key(appster_t* a, const char* certificate_chain_path, const char* private_key_file_path);
+/*
+ All loops share one TLS context, so a session can be resumed on any loop no
+ matter which one made it. Server side sessions are kept in a cache of at most
+ size sessions, split in stripes so the loops rarely wait for each other, for
+ timeout seconds. Passing 0 as size disables the cache. Defaults are 20480
+ sessions and 3600 seconds.
+ */
+void as_set_tls_session_cache(appster_t* a, uint32_t size, uint32_t timeout);
+/*
+ Session tickets are encrypted with a key that is replaced every interval
+ seconds. Tickets of the previous key are still accepted and renewed, so a
+ ticket lives at most two intervals. Passing 0 keeps the key OpenSSL made for
+ the process. Default is 3600.
+ */
+void as_set_tls_ticket_rotation(appster_t* a, uint32_t interval);
+/*
+ Hand the encryption of replies to the kernel (kTLS) once the handshake is
+ done. Replies are then written to the socket like plain ones, so files go out
+ with sendfile and small replies with a single writev instead of being copied
+ through OpenSSL. Connections stay in user space when the kernel, its tls
+ module or the negotiated cipher do not support it. Requests are still read
+ through OpenSSL. Needs OpenSSL 3 built with kTLS. Disabled by default.
+ */
+void as_set_ktls(appster_t* a, int enable);
+#endif
+/*
+ Set the maximum amount of connections accepted on a single listener readiness
+ event. The accept queue is drained until it's empty or until the batch is
+ exhausted, after which the loop returns to serving other connections. Must be
+ called before as_listen_and_serve. Default is 64.
+ */
+void as_set_accept_batch(appster_t* a, unsigned batch);
+/*
+ Pin the loop threads to cpus. Loop i is pinned to cpus[i % count]. Passing
+ NULL pins each loop to its own cpu from the set the process is allowed to run
+ on. Note that the first loop runs on the calling thread so that thread is
+ pinned too. Must be called before as_listen_and_serve. Returns -1 on error.
+ */
+int as_set_affinity(appster_t* a, const int* cpus, unsigned count);
+/*
+ Ask the kernel to hand each new connection to the listener of the loop that
+ is pinned to the cpu which received the connection (SO_INCOMING_CPU and a
+ reuseport cpu program on linux). Only useful together with as_set_affinity.
+ */
+void as_set_incoming_cpu(appster_t* a, int enable);
+#ifdef HAS_IO_URING
+/*
+ Accept connections and write replies through an io_uring per loop. A single
+ multishot accept replaces the readiness poll of the listener, and the replies
+ of a loop iteration go to the kernel with one system call. Requests are still
+ read on readiness, and TLS connections and file replies are written as before.
+ Loops fall back to polling when the kernel does not support it. Must be called
+ before as_listen_and_serve. Disabled by default.
+ */
+void as_set_io_uring(appster_t* a, int enable);
 #endif
+/*
+ Number of pipelined requests of a single connection that run at the same
+ time. Replies are still written in request order; a request that finishes
+ early keeps its reply queued until the ones before it are written. Once as
+ many requests again are parsed and waiting, reading from the connection
+ pauses until the front request is answered. Default is 1, which runs the
+ requests of a connection one after another.
+ */
+void as_set_pipeline_depth(appster_t* a, unsigned depth);
+/*
+ Serve HTTP/2 next to HTTP/1.1, with at most max_streams requests of a single
+ connection running at once. TLS clients get it when they ask for h2 with
+ ALPN, cleartext ones when they know it upfront or upgrade with h2c. Every
+ stream runs its route like a request of its own, replies are multiplexed as
+ the flow control of the client allows. Passing 0 disables it, which is the
+ default.
+ */
+void as_set_http2(appster_t* a, unsigned max_streams);
+/*
+ Compress replies with gzip or deflate, whichever the client accepts, at the
+ zlib level (1 to 9, 0 disables it, which is the default). Replies shorter
+ than min_length are sent as they are, streamed ones are compressed whatever
+ their size. Only the content types listed in types are compressed, an entry
+ ending with a slash like "text/" stands for the whole class. NULL selects
+ text, JSON, JavaScript, XML and SVG. Replies without a Content-Type are
+ compressed too, so binary ones should set it. A route can opt out by setting
+ Content-Encoding itself.
+ Whole files sent with as_write_file are compressed once and kept per loop,
+ as_set_compression_cache sets how many bytes of them, 8MB by default.
+ Files larger than a quarter of that and other file segments are sent as
+ they are.
+ */
+void as_set_compression(appster_t* a, int level, uint32_t min_length, const char* const* types);
+void as_set_compression_cache(appster_t* a, size_t size);
+/*
+ Static routes keep up to files files open per loop, 1024 by default, and
+ check a file against its path again once revalidate milliseconds passed,
+ 60000 by default. Changes are seen right away where inotify watches the
+ directories. Passing 0 files opens the file for every request. Must be
+ called before as_listen_and_serve.
+ */
+void as_set_file_cache(appster_t* a, uint32_t files, uint32_t revalidate);
+/*
+ Coroutine stacks. Every request runs on a stack taken from a pool of the loop
+ and returned to it once the request is gone. as_set_stack_size sets the size
+ for all routes, 256K by default; as_set_route_stack_size overrides it for
+ every method of a path. Each loop keeps up to keep stacks of every size and
+ maps warm stacks of the default size when it starts, default is 256 and 0.
+ With hugepages the stacks are cut from huge pages when the system has them
+ reserved, a huge page is given back once none of its stacks is in use or
+ kept. Otherwise transparent huge pages are requested and an error is logged. Must be called before
+ as_listen_and_serve.
+ */
+void as_set_stack_size(appster_t* a, size_t size);
+int as_set_route_stack_size(appster_t* a, const char* path, size_t size);
+void as_set_stack_pool(appster_t* a, unsigned keep, unsigned warm);
+void as_set_stack_hugepages(appster_t* a, int enable);
+/*
+ Connection timeouts in milliseconds, 0 disables a timeout. A connection with
+ no request in progress is closed after the idle timeout, 60s by default. The
+ headers of a request must arrive within the header timeout, 30s by default,
+ and its body must make progress at least once every body timeout, 60s by
+ default; the body is not timed while reading waits for the route to consume
+ it. The request timeout limits the time the whole request takes to arrive,
+ headers and body, and is disabled by default. Routes already running when a
+ connection times out are let finish, a read of the body fails, and the
+ connection is closed after their replies. Timeouts are checked every 100ms.
+ Must be called before as_listen_and_serve.
+ */
+void as_set_idle_timeout(appster_t* a, uint32_t timeout);
+void as_set_header_timeout(appster_t* a, uint32_t timeout);
+void as_set_body_timeout(appster_t* a, uint32_t timeout);
+void as_set_request_timeout(appster_t* a, uint32_t timeout);
+/*
+ Admission control. At most max routes run at the same time on a loop, a
+ route limit counts the routes of a path per loop and applies to every method
+ of it. A request over a limit is answered with 503 and a Retry-After header
+ of the given seconds, 1 by default, without running its route. With a target
+ latency, in milliseconds, the limits adapt to the routes: a reply slower than
+ the target cuts the limits it counted against by 10%, at most once per target
+ period, and faster replies raise them back towards max. 0 disables a limit or
+ the adaptation, which is the default. Must be called before
+ as_listen_and_serve.
+ */
+void as_set_max_inflight(appster_t* a, unsigned max);
+int as_set_route_max_inflight(appster_t* a, const char* path, unsigned max);
+void as_set_inflight_target(appster_t* a, uint32_t latency);
+void as_set_retry_after(appster_t* a, uint32_t seconds);
+/*
+ Cache the replies of the routes of a path on every loop for ttl milliseconds,
+ in at most size bytes per route and loop, least recently used replies go
+ first. Replies are kept by the parsed values of the schema arguments, so
+ arguments that are not in the schema and the order of the query do not
+ matter, and by the content coding the client accepts. Only GET and HEAD
+ requests without a body or Authorization are answered from the cache, without
+ running the route. Requests that come while the route runs for the same
+ values wait for its reply instead of running it too. Streamed replies, file
+ segments, replies with Set-Cookie and statuses other than the cacheable ones
+ like 200, 301 and 404 are not kept, whoever waited runs the route then. A
+ route that reads headers or cookies should not be cached. 0 disables it,
+ which is the default. Must be called before as_listen_and_serve.
+ */
+int as_set_route_cache(appster_t* a, const char* path, uint32_t ttl, size_t size);
+/*
+ Loop statistics. Loops are indexed from 0 to as_loop_count() - 1. The counters
+ are updated by each loop without locking, so the values read from other
+ threads are only approximate. Returns -1 if the loop index is invalid.
+ */
+unsigned as_loop_count(appster_t* a);
+int as_loop_stats(appster_t* a, unsigned loop, appster_loop_stats_t* stats);
+/*
+ Route callback answering with the latency histograms of all loops in the
+ Prometheus text format, e.g. as_add_route(a, "/metrics", as_serve_metrics,
+ NULL, NULL). Every loop records the time each route callback ran and the
+ time from the request headers until the reply went to the connection, by
+ route and status class, without locking; the loops are merged when it's
+ called. Requests without a route count with an empty route label.
+ */
+int as_serve_metrics(void* data);
 
 
-/* NOTE: once added, route cannot be romoved! */
+/*
+ NOTE: once added, route cannot be romoved! Routes must be added before
+ as_listen_and_serve. A path segment starting with ':' captures that segment,
+ e.g. /users/:id, and a last segment starting with '*' captures the rest of
+ the path, which is absent when empty. Captures are percent-decoded and each
+ is parsed as the schema argument with the same name, so /users/:id requires
+ an "id" entry in the schema; a capture that does not parse as the argument
+ type fails the request. Static segments are preferred over captures.
+ as_add_route() serves every method, the method route ("GET", "POST", ...) is
+ preferred when both exist. A path routed for other methods only is answered
+ with 405 and an Allow header.
+ */
 int as_add_route(appster_t* a, const char* path, as_route_cb_t cb, appster_schema_entry_t* schema, void* user_data);
+int as_add_route_method(appster_t* a, const char* method, const char* path, as_route_cb_t cb, appster_schema_entry_t* schema, void* user_data);
 int as_add_route_error(appster_t* a, const char* path, as_route_cb_t cb, void* user_data);
+/*
+ Serve the files below root for GET and HEAD requests under prefix, e.g.
+ as_add_static_route(a, "/assets", "/var/www", NULL) answers /assets/app.js
+ with /var/www/app.js. A directory is answered with its index file, paths
+ with "." or ".." segments are not found. Replies carry a Content-Type by the
+ file extension, an ETag and Last-Modified, are answered with 304 when
+ If-None-Match matches or the file is not newer than If-Modified-Since and
+ with 206 for a single Range.
+ The files are sent from the open file cache without copying them, see
+ as_set_file_cache. opts may be NULL. Returns -1 if a route fails to add.
+ */
+int as_add_static_route(appster_t* a, const char* prefix, const char* root, const appster_static_opts_t* opts);
+/*
+ Limit the size of request bodies. A request announcing a larger
+ Content-Length is answered with 413 before its body is read. A chunked body
+ growing over the limit fails the as_read in progress, or is answered with 413
+ when the route did not run yet. The connection is closed in both cases. The
+ limit of a path applies to every method of that route and overrides the
+ default one. 0 means no limit, which is the default.
+ */
+void as_set_max_body(appster_t* a, uint64_t max);
+int as_set_route_max_body(appster_t* a, const char* path, uint64_t max);
 
+/*
+ Serve until as_shutdown. When the process was started with LISTEN_FDS and
+ LISTEN_PID set, by as_handoff or by systemd socket activation, the inherited
+ listeners starting at descriptor 3 are taken by the loops in order instead of
+ binding new ones; loops without one bind addr and port as usual. The
+ application has to ignore SIGPIPE, signal(SIGPIPE, SIG_IGN), so that a peer
+ going away mid reply is a write error rather than the end of the process.
+ */
 int as_listen_and_serve(appster_t* a, const char* addr, uint16_t port, int backlog);
+/*
+ Stop serving. Can be called from any thread, also before serving starts.
+ Every loop closes its listener and its idle connections right away. The
+ other connections finish the requests they have, the last reply says
+ Connection: close, and are closed after it. Whatever is left once deadline
+ milliseconds passed is closed. as_listen_and_serve returns once all loops
+ are done.
+ */
+void as_shutdown(appster_t* a, uint32_t deadline);
+/*
+ Start path with argv as a new process that inherits the listeners, for a
+ deploy without closing the listening sockets. The kernel keeps queueing
+ connections on them, so nothing is refused while the new process starts.
+ Call as_shutdown once the new process is up. Must be called while serving
+ and before as_shutdown. Returns the pid of the new process or -1.
+ */
+int as_handoff(appster_t* a, const char* path, char* const argv[]);
 
 /*
  Check to see if argument exists. Returns 1 if argument is present or 0
@@ -79,25 +378,65 @@ double as_arg_list_number(uint32_t idx, uint32_t list_idx);
 const char* as_arg_list_string(uint32_t idx, uint32_t list_idx);
 uint32_t as_arg_list_string_length(uint32_t idx, uint32_t list_idx);
 
+/*
+ Request headers. Names are matched case insensitive and, if the client sent
+ the header more than once, the last value is returned. The returned value is
+ NOT zero terminated, its length is stored in len which may be NULL. Values
+ point into the connection read buffer, they are valid until the route
+ callback returns. Returns NULL if the header is missing. Looking up well known
+ headers by id is a single array access.
+ */
+const char* as_header(const char* name, uint32_t* len);
+const char* as_header_id(appster_header_id_t id, uint32_t* len);
+/*
+ Reply headers, set before the reply is sent or streamed. Setting a header
+ again replaces it. Content-Length, Transfer-Encoding and Connection are
+ Appster's to set. Returns -1 for those, for names or values with line breaks
+ and once the stream has begun.
+ */
+int as_write_header(const char* name, const char* value);
+
 /*
  Sending body in reply. These functions queue the reply body. Once added data
- is not removed until it's written to the wire. The file sending may use mmap
- or sendfile() api's. Content-Length header is added automatically.
+ is not removed until it's written to the wire. Files go out with sendfile()
+ on plain HTTP/1 and kTLS connections, they are mapped with mmap when the reply
+ goes through OpenSSL, HTTP/2 or compression. Content-Length header is added
+ automatically. Routes answer HEAD requests like GET ones, the reply keeps the
+ Content-Length of its body and goes without it. 204 and 304 replies have no
+ Content-Length, their routes must not write a body.
  */
 int as_write(const char* data, int64_t len);
 int as_write_f(const char* format, ...);
 int as_write_fd(int fd, int64_t offset, int64_t len);
 int as_write_file(const char* path, int64_t offset, int64_t len);
+/*
+ Streaming the reply. as_stream_begin sends the status and the headers right
+ away and switches the reply to chunked transfer encoding, whatever was
+ written so far becomes the first chunk. From then on the as_write functions
+ send the data in chunks as it accumulates and as_write_flush sends what is
+ pending at once; as_write_flush begins a 200 stream if none was begun yet.
+ When too much output is waiting for the wire these functions suspend the
+ route until the client catches up. They return -1 once the connection is
+ gone. The status returned by a streaming route only decides whether the
+ stream is terminated properly (> 0) or the connection is closed. HTTP/1.0
+ clients get the body unframed and the connection closed after it.
+ */
+int as_stream_begin(int status);
+int as_write_flush();
 
 /*
  Read the request body if present. Returns the amount of bytes read or -1
  if error occured. Reads up to max amount of bytes. The functions do not
  return until either the whole body is read, the max bytes is read or the
- error occurs.
+ error occurs. Body that is not read yet is buffered up to a watermark, past
+ it the connection is not read until the route consumes the body. A body the
+ route never reads is dropped once the reply is sent.
  */
 int64_t as_read(char* where, int64_t max);
 /*
- Read from the wire directly to the fd,
+ Read from the wire directly to the fd. Buffered body is written straight from
+ the read buffers; on plaintext connections the rest of a body of known length
+ is spliced from the socket to the fd without passing through user space.
  */
 int64_t as_read_to_fd(int fd, int64_t max);
 /*
@@ -135,7 +474,10 @@ int as_module_init(appster_t* a, as_module_init_cb_t cb);
  as_channel_pass() does not. They are both used to receive data from the
  channel. as_channel_send() is used to send data via channel.
  as_channel_good() can be used to check if the channel WAS allocated at some
- point; it does not check if the channel was freed!
+ point; it does not check if the channel was freed! A channel whose message
+ was taken by as_channel_recv() is kept per thread and returned by the next
+ as_channel_alloc() call, so it must not be touched once received from. A
+ channel freed with as_channel_free() is closed.
  */
 appster_channel_t as_channel_alloc();
 void as_channel_free(appster_channel_t ch);
@@ -5,16 +5,57 @@
 #include "hashmap.h"
 
 struct error_cb_s;
+struct router_s;
+struct static_route_s;
 
 struct appster_s {
-    hashmap_t* routes;
+    struct router_s* router;
     hashmap_t* error_cbs;
+    hashmap_t* body_limits; /* path to uint64_t, overrides max_body */
+    hashmap_t* stack_sizes; /* path to size_t, applied to the routes on serve */
+    hashmap_t* inflight_limits; /* path to uint32_t, applied to the routes on serve */
+    hashmap_t* route_caches; /* path to route_cache_t, applied to the routes on serve */
     vector_t loops;
+    uint32_t accept_batch;
+    uint32_t pipeline_depth;
+    uint32_t h2_streams; /* 0 is HTTP/1 only */
+    uint64_t max_body;
+    size_t stack_size;
+    uint32_t stack_keep;
+    uint32_t stack_warm;
+    uint32_t idle_timeout;
+    uint32_t header_timeout;
+    uint32_t body_timeout;
+    uint32_t request_timeout;
+    uint32_t max_inflight;
+    uint32_t target_latency;
+    uint32_t retry_after;
+    uint32_t nroutes;
+    uint32_t stop_deadline;
+    int zip_level; /* 0 is no compression */
+    uint32_t zip_min; /* smaller replies are sent as they are */
+    char** zip_types; /* compressed content types, NULL terminated */
+    size_t zip_cache; /* compressed files kept per loop, in bytes */
+    struct static_route_s* statics; /* served from the file cache of the loops */
+    uint32_t file_cache; /* open files kept per loop */
+    uint32_t file_revalidate; /* ms until a cached file is checked again */
+    int stop_requested; /* atomic, as_shutdown may be called from any thread */
+    int serving; /* atomic, the loops can be woken */
+    unsigned stack_hugepages:1;
+    unsigned incoming_cpu:1;
+#ifdef HAS_IO_URING
+    unsigned io_uring:1;
+#endif
     struct error_cb_s* general_error_cb;
     vector_t modules;
 #ifdef HAS_CRYPTO
     const char* cert_chain_file;
     const char* key_file;
+    struct ssl_ctx_st* ssl_ctx; /* shared by the listeners of all loops */
+    uint32_t tls_cache_size;
+    uint32_t tls_session_timeout;
+    uint32_t tls_ticket_rotate;
+    unsigned ktls:1;
 #endif
 };
 
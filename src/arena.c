@@ -0,0 +1,140 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define ARENA_MAX_RETAINED (256 * 1024) /* never keep more than this idle */
+
+typedef struct chunk_s {
+    struct chunk_s* next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} chunk_t;
+
+struct arena_s {
+    chunk_t* head; /* chunk currently bumped from */
+    chunk_t* base; /* first chunk, survives resets */
+    size_t chunk_size;
+    size_t total; /* bytes requested since the last reset */
+};
+
+static chunk_t* chunk_alloc(size_t size);
+static void* chunk_get(chunk_t* c, size_t size);
+
+arena_t* ar_alloc(size_t chunk_size) {
+    arena_t* rc;
+
+    rc = calloc(1, sizeof(arena_t));
+    rc->chunk_size = ARENA_ALIGN_UP(chunk_size ? chunk_size : 4096);
+    rc->base = rc->head = chunk_alloc(rc->chunk_size);
+    return rc;
+}
+void ar_free(arena_t* ar) {
+    chunk_t* c,* next;
+
+    if (!ar) {
+        return;
+    }
+
+    for (c = ar->head; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+
+    free(ar);
+}
+void ar_reset(arena_t* ar) {
+    chunk_t* c,* next;
+    size_t want;
+
+    if (!ar) {
+        return;
+    }
+
+    for (c = ar->head; c; c = next) {
+        next = c->next;
+        if (c != ar->base) {
+            free(c);
+        }
+    }
+
+    /*
+     If the last round didn't fit in the base chunk, grow it so that the next
+     similar round is served without chaining.
+     */
+    want = ARENA_ALIGN_UP(ar->total);
+    if (want > ar->base->size && want <= ARENA_MAX_RETAINED) {
+        free(ar->base);
+        ar->base = chunk_alloc(want);
+    }
+
+    ar->base->used = 0;
+    ar->base->next = NULL;
+    ar->head = ar->base;
+    ar->total = 0;
+}
+void* ar_malloc(arena_t* ar, size_t size) {
+    chunk_t* c;
+    void* rc;
+
+    size = ARENA_ALIGN_UP(size ? size : 1);
+    ar->total += size;
+
+    rc = chunk_get(ar->head, size);
+    if (rc) {
+        return rc;
+    }
+
+    if (size > ar->chunk_size / 2) {
+        /* big allocations get a chunk of their own, keep bumping the head */
+        c = chunk_alloc(size);
+        c->next = ar->head->next;
+        ar->head->next = c;
+    } else {
+        c = chunk_alloc(ar->chunk_size);
+        c->next = ar->head;
+        ar->head = c;
+    }
+
+    return chunk_get(c, size);
+}
+void* ar_calloc(arena_t* ar, size_t count, size_t size) {
+    void* rc;
+
+    rc = ar_malloc(ar, count * size);
+    memset(rc, 0, count * size);
+    return rc;
+}
+char* ar_strndup(arena_t* ar, const char* str, size_t len) {
+    char* rc;
+
+    rc = ar_malloc(ar, len + 1);
+    memcpy(rc, str, len);
+    rc[len] = 0;
+    return rc;
+}
+
+chunk_t* chunk_alloc(size_t size) {
+    chunk_t* rc;
+
+    rc = malloc(sizeof(chunk_t) + size);
+    rc->next = NULL;
+    rc->size = size;
+    rc->used = 0;
+    return rc;
+}
+void* chunk_get(chunk_t* c, size_t size) {
+    void* rc;
+
+    if (c->size - c->used < size) {
+        return NULL;
+    }
+
+    rc = c->data + c->used;
+    c->used += size;
+    return rc;
+}
@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ Bump allocator for request scoped memory. Allocations are never freed one by
+ one; the whole arena is released at once with ar_reset(). The first chunk is
+ kept across resets and grows to the high-water mark of previous rounds, so a
+ steady stream of similar requests is served from a single chunk.
+ */
+typedef struct arena_s arena_t;
+
+arena_t* ar_alloc(size_t chunk_size);
+void ar_free(arena_t* ar);
+void ar_reset(arena_t* ar);
+
+void* ar_malloc(arena_t* ar, size_t size);
+void* ar_calloc(arena_t* ar, size_t count, size_t size);
+char* ar_strndup(arena_t* ar, const char* str, size_t len);
+
+#endif /* ARENA_H */
@@ -1,16 +1,90 @@
 #include "crypto.h"
 #include "log.h"
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#define SESSION_STRIPES 16 /* power of two */
+#define SESSION_BUCKETS 256 /* per stripe, power of two */
+#define SESSION_ID_CONTEXT "appster"
+#define TICKET_KEYS 2 /* the key new tickets use and the one it replaced */
+
+typedef struct session_s {
+    struct session_s* next; /* bucket chain */
+    struct session_s* newer,* older; /* eviction order of the stripe */
+    time_t expires;
+    uint32_t id_len;
+    uint32_t der_len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char der[]; /* the session in DER, sessions are not shared between threads */
+} session_t;
+
+typedef struct stripe_s {
+    pthread_mutex_t lock;
+    session_t* buckets[SESSION_BUCKETS];
+    session_t* newest,* oldest;
+    uint32_t count;
+} stripe_t;
+
+typedef struct ticket_key_s {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+} ticket_key_t;
+
+/*
+ Resumption state of a server context, shared by every thread using it. The
+ session cache is split in stripes by session id so handshakes on different
+ loops rarely wait for each other.
+ */
+typedef struct sessions_s {
+    stripe_t stripes[SESSION_STRIPES];
+    uint32_t max; /* sessions per stripe, 0 disables the cache */
+    uint32_t timeout;
+    pthread_rwlock_t keys_lock;
+    ticket_key_t keys[TICKET_KEYS];
+    unsigned nkeys; /* keys generated so far, the slots past them are unset */
+    time_t rotated; /* read without the lock, written atomically under it */
+    uint32_t rotate; /* seconds between key rotations, 0 keeps the built-in keys */
+} sessions_t;
+
+static int __sessions_idx = -1;
+
+static sessions_t* sessions_get(SSL_CTX* ctx);
+static stripe_t* sessions_stripe(sessions_t* ss, const unsigned char* id, uint32_t len, session_t*** bucket);
+static void sessions_unlink(stripe_t* st, session_t** bucket, session_t* s);
+static int session_new(SSL* ssl, SSL_SESSION* sess);
+static SSL_SESSION* session_get(SSL* ssl, const unsigned char* id, int len, int* copy);
+static void session_remove(SSL_CTX* ctx, SSL_SESSION* sess);
+static int ticket_keys_rotate(sessions_t* ss, time_t now);
+static int alpn_select(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                       const unsigned char* in, unsigned int in_len, void* arg);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc);
+#else
+static int ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc);
+#endif
 
 void crypto_alloc() {
     RAND_poll();
     SSL_library_init();
     SSL_load_error_strings();
     OpenSSL_add_ssl_algorithms();
+
+    if (__sessions_idx == -1) {
+        __sessions_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    }
 }
 void crypto_free() {
     EVP_cleanup();
@@ -41,6 +115,8 @@ ssl_ctx_t* crypto_alloc_ctx(crypto_mode_t mode, const char* cert_chain_file, con
     SSL_CTX_set_mode(ctx,
                      SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ENABLE_PARTIAL_WRITE
                      | SSL_MODE_ASYNC
+                     /* retries may come from a chain or the record buffer */
+                     | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
     );
 
     SSL_CTX_set_options(ctx,
@@ -67,6 +143,92 @@ failure:
     SSL_CTX_free(ctx);
     return NULL;
 }
+void crypto_free_ctx(ssl_ctx_t* ctx) {
+    sessions_t* ss;
+    session_t* s;
+
+    if (!ctx) {
+        return;
+    }
+
+    ss = sessions_get(ctx);
+    if (ss) {
+        for (int i = 0; i < SESSION_STRIPES; i++) {
+            while ((s = ss->stripes[i].oldest)) {
+                ss->stripes[i].oldest = s->newer;
+                free(s);
+            }
+            pthread_mutex_destroy(&ss->stripes[i].lock);
+        }
+        pthread_rwlock_destroy(&ss->keys_lock);
+        OPENSSL_cleanse(ss->keys, sizeof(ss->keys));
+        free(ss);
+    }
+
+    SSL_CTX_free(ctx);
+}
+int crypto_enable_ktls(ssl_ctx_t* ctx) {
+#ifdef SSL_OP_ENABLE_KTLS
+    /* OpenSSL falls back to user space per connection when the kernel can't */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    return 0;
+#else
+    (void) ctx;
+    return -1;
+#endif
+}
+void crypto_enable_alpn_h2(ssl_ctx_t* ctx) {
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+}
+int crypto_share_sessions(ssl_ctx_t* ctx, uint32_t cache_size, uint32_t timeout, uint32_t rotate) {
+    sessions_t* ss;
+
+    lassert(__sessions_idx != -1);
+
+    ss = calloc(1, sizeof(sessions_t));
+    for (int i = 0; i < SESSION_STRIPES; i++) {
+        pthread_mutex_init(&ss->stripes[i].lock, NULL);
+    }
+    pthread_rwlock_init(&ss->keys_lock, NULL);
+    ss->max = (cache_size + SESSION_STRIPES - 1) / SESSION_STRIPES;
+    ss->timeout = timeout;
+    ss->rotate = rotate;
+
+    if (rotate && ticket_keys_rotate(ss, time(NULL)) != 0) {
+        free(ss);
+        return -1;
+    }
+
+    SSL_CTX_set_ex_data(ctx, __sessions_idx, ss);
+    SSL_CTX_set_timeout(ctx, timeout);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*) SESSION_ID_CONTEXT,
+                                   sizeof(SESSION_ID_CONTEXT) - 1);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* most clients just close, that must not throw the session away */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    /* the built-in cache is one locked table per context, ours is striped */
+    if (ss->max) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, session_new);
+        SSL_CTX_sess_set_get_cb(ctx, session_get);
+        SSL_CTX_sess_set_remove_cb(ctx, session_remove);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (rotate) {
+    #if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key);
+    #else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key);
+    #endif
+    }
+
+    return 0;
+}
 ssl_t* crypto_alloc_ssl(ssl_ctx_t* ctx, int fd, crypto_mode_t mode) {
     ssl_t* rc = NULL;
 
@@ -85,6 +247,11 @@ ssl_t* crypto_alloc_ssl(ssl_ctx_t* ctx, int fd, crypto_mode_t mode) {
 }
 void crypto_free_ssl(ssl_t* ssl) {
     if (ssl) {
+        /* OpenSSL drops the session of a connection that did not send close_notify */
+        if (SSL_is_init_finished(ssl)) {
+            SSL_shutdown(ssl);
+            ERR_clear_error();
+        }
         SSL_free(ssl);
     }
 }
@@ -99,8 +266,26 @@ int crypto_accept(ssl_t* ssl) {
 int crypto_read(ssl_t* ssl, void* to, int max) {
     return SSL_read(ssl, to, max);
 }
-int crypto_write(ssl_t* ssl, const void* data, int size) {
-    return SSL_write(ssl, data, size);
+int crypto_write(ssl_t* ssl, const void* data, size_t size, size_t* written) {
+    return SSL_write_ex(ssl, data, size, written);
+}
+int crypto_session_reused(ssl_t* ssl) {
+    return SSL_session_reused(ssl);
+}
+int crypto_alpn_h2(ssl_t* ssl) {
+    const unsigned char* proto;
+    unsigned int len;
+
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && !memcmp(proto, "h2", 2);
+}
+int crypto_ktls_send(ssl_t* ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+    (void) ssl;
+    return 0;
+#endif
 }
 int crypto_error_needs_data_only(ssl_t* ssl, int err) {
     if (!ssl) {
@@ -118,3 +303,275 @@ int crypto_error_needs_data_only(ssl_t* ssl, int err) {
     errno = EINVAL;
     return 0;
 }
+
+int alpn_select(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                const unsigned char* in, unsigned int in_len, void* arg) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    unsigned char* selected;
+
+    /* our order wins, clients without either still get HTTP/1.1 */
+    if (SSL_select_next_proto(&selected, out_len, protos, sizeof(protos) - 1,
+                              in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+sessions_t* sessions_get(SSL_CTX* ctx) {
+    return __sessions_idx == -1 ? NULL : SSL_CTX_get_ex_data(ctx, __sessions_idx);
+}
+stripe_t* sessions_stripe(sessions_t* ss, const unsigned char* id, uint32_t len, session_t*** bucket) {
+    uint32_t hash = 2166136261u;
+
+    /* clients pick the ids they look up, so hash all of it */
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ id[i]) * 16777619u;
+    }
+
+    *bucket = &ss->stripes[hash & (SESSION_STRIPES - 1)].buckets[(hash >> 8) & (SESSION_BUCKETS - 1)];
+    return &ss->stripes[hash & (SESSION_STRIPES - 1)];
+}
+void sessions_unlink(stripe_t* st, session_t** bucket, session_t* s) {
+    session_t** it;
+
+    for (it = bucket; *it != s; it = &(*it)->next);
+    *it = s->next;
+
+    if (s->newer) {
+        s->newer->older = s->older;
+    } else {
+        st->newest = s->older;
+    }
+    if (s->older) {
+        s->older->newer = s->newer;
+    } else {
+        st->oldest = s->newer;
+    }
+
+    st->count--;
+}
+int session_new(SSL* ssl, SSL_SESSION* sess) {
+    sessions_t* ss;
+    stripe_t* st;
+    session_t** bucket,** old_bucket;
+    session_t* s,* it;
+    const unsigned char* id;
+    unsigned char* der;
+    unsigned int id_len;
+    int len;
+
+    ss = sessions_get(SSL_get_SSL_CTX(ssl));
+    id = SSL_SESSION_get_id(sess, &id_len);
+    len = i2d_SSL_SESSION(sess, NULL);
+    if (!ss || !id_len || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH || len <= 0) {
+        return 0;
+    }
+
+    s = malloc(sizeof(session_t) + len);
+    s->id_len = id_len;
+    s->der_len = len;
+    s->expires = time(NULL) + ss->timeout;
+    memcpy(s->id, id, id_len);
+    der = s->der;
+    i2d_SSL_SESSION(sess, &der);
+
+    st = sessions_stripe(ss, id, id_len, &bucket);
+
+    pthread_mutex_lock(&st->lock);
+
+    for (it = *bucket; it; it = it->next) {
+        if (it->id_len == id_len && !memcmp(it->id, id, id_len)) {
+            sessions_unlink(st, bucket, it);
+            free(it);
+            break;
+        }
+    }
+
+    s->next = *bucket;
+    *bucket = s;
+    s->newer = NULL;
+    s->older = st->newest;
+    if (st->newest) {
+        st->newest->newer = s;
+    } else {
+        st->oldest = s;
+    }
+    st->newest = s;
+    st->count++;
+
+    while (st->count > ss->max) {
+        it = st->oldest;
+        sessions_stripe(ss, it->id, it->id_len, &old_bucket);
+        sessions_unlink(st, old_bucket, it);
+        free(it);
+    }
+
+    pthread_mutex_unlock(&st->lock);
+
+    return 0; /* the session itself is not kept */
+}
+SSL_SESSION* session_get(SSL* ssl, const unsigned char* id, int len, int* copy) {
+    SSL_SESSION* rc = NULL;
+    const unsigned char* der;
+    sessions_t* ss;
+    stripe_t* st;
+    session_t** bucket;
+    session_t* s;
+
+    *copy = 0; /* the decoded session belongs to the caller already */
+
+    ss = sessions_get(SSL_get_SSL_CTX(ssl));
+    if (!ss || len <= 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return NULL;
+    }
+
+    st = sessions_stripe(ss, id, len, &bucket);
+
+    pthread_mutex_lock(&st->lock);
+
+    for (s = *bucket; s; s = s->next) {
+        if (s->id_len == (uint32_t) len && !memcmp(s->id, id, len)) {
+            break;
+        }
+    }
+
+    if (s && s->expires <= time(NULL)) {
+        sessions_unlink(st, bucket, s);
+        free(s);
+        s = NULL;
+    }
+
+    if (s) {
+        der = s->der;
+        rc = d2i_SSL_SESSION(NULL, &der, s->der_len);
+    }
+
+    pthread_mutex_unlock(&st->lock);
+
+    return rc;
+}
+void session_remove(SSL_CTX* ctx, SSL_SESSION* sess) {
+    sessions_t* ss;
+    stripe_t* st;
+    session_t** bucket;
+    session_t* s;
+    const unsigned char* id;
+    unsigned int id_len;
+
+    ss = sessions_get(ctx);
+    id = SSL_SESSION_get_id(sess, &id_len);
+    if (!ss || !id_len) {
+        return;
+    }
+
+    st = sessions_stripe(ss, id, id_len, &bucket);
+
+    pthread_mutex_lock(&st->lock);
+
+    for (s = *bucket; s; s = s->next) {
+        if (s->id_len == id_len && !memcmp(s->id, id, id_len)) {
+            sessions_unlink(st, bucket, s);
+            free(s);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&st->lock);
+}
+int ticket_keys_rotate(sessions_t* ss, time_t now) {
+    ticket_key_t key;
+
+    if (RAND_bytes((unsigned char*) &key, sizeof(key)) != 1) {
+        ELOG("Failed to generate a session ticket key");
+        return -1;
+    }
+
+    /* tickets of the previous key are still taken and renewed */
+    memmove(ss->keys + 1, ss->keys, sizeof(ticket_key_t) * (TICKET_KEYS - 1));
+    ss->keys[0] = key;
+    if (ss->nkeys < TICKET_KEYS) {
+        ss->nkeys++;
+    }
+    __atomic_store_n(&ss->rotated, now, __ATOMIC_RELEASE);
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return 0;
+}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc) {
+#else
+int ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc) {
+#endif
+    sessions_t* ss;
+    ticket_key_t key;
+    time_t now;
+    int rc = -1, i = -1;
+
+    ss = sessions_get(SSL_get_SSL_CTX(ssl));
+    now = time(NULL);
+
+    if (now - __atomic_load_n(&ss->rotated, __ATOMIC_ACQUIRE) >= ss->rotate) {
+        pthread_rwlock_wrlock(&ss->keys_lock);
+        if (now - ss->rotated >= ss->rotate) { /* some other thread may have been first */
+            ticket_keys_rotate(ss, now);
+        }
+        pthread_rwlock_unlock(&ss->keys_lock);
+    }
+
+    pthread_rwlock_rdlock(&ss->keys_lock);
+
+    if (enc) {
+        key = ss->keys[0];
+        i = 0;
+    } else {
+        /* only generated keys, an unset slot would match a zero name */
+        for (unsigned k = 0; k < ss->nkeys; k++) {
+            if (!memcmp(ss->keys[k].name, name, sizeof(key.name))) {
+                key = ss->keys[k];
+                i = k;
+                break;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&ss->keys_lock);
+
+    if (i < 0) {
+        return 0; /* unknown or expired key, full handshake */
+    }
+
+    if (enc) {
+        memcpy(name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) {
+            goto out;
+        }
+    } else if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) {
+        goto out;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    {
+        OSSL_PARAM params[3];
+
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+        params[2] = OSSL_PARAM_construct_end();
+        if (EVP_MAC_CTX_set_params(hctx, params) != 1) {
+            goto out;
+        }
+    }
+#else
+    if (HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL) != 1) {
+        goto out;
+    }
+#endif
+
+    /* a ticket of the previous key gets replaced by one of the current key */
+    rc = enc || i == 0 ? 1 : 2;
+
+out:
+    OPENSSL_cleanse(&key, sizeof(key));
+    return rc;
+}
@@ -1,6 +1,9 @@
 #ifndef CRYPTO_H
 #define CRYPTO_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct ssl_ctx_st ssl_ctx_t;
 typedef struct ssl_st ssl_t;
 
@@ -13,10 +16,24 @@ void crypto_alloc();
 void crypto_free();
 
 ssl_ctx_t* crypto_alloc_ctx(crypto_mode_t mode, const char* cert_chain_file, const char* key_file);
+void crypto_free_ctx(ssl_ctx_t* ctx);
+int crypto_enable_ktls(ssl_ctx_t* ctx); /* Returns -1 if OpenSSL has no kTLS */
+void crypto_enable_alpn_h2(ssl_ctx_t* ctx); /* Offer h2 ahead of http/1.1 */
+/*
+ Share the resumption state of a server context between the threads using it:
+ a session cache of cache_size sessions split in locked stripes, and session
+ ticket keys rotated every rotate seconds. Tickets of the previous key are still
+ accepted and renewed. A cache_size of 0 disables the cache, a rotate of 0
+ keeps the keys OpenSSL generated for the context.
+ */
+int crypto_share_sessions(ssl_ctx_t* ctx, uint32_t cache_size, uint32_t timeout, uint32_t rotate);
 ssl_t* crypto_alloc_ssl(ssl_ctx_t* ctx, int fd, crypto_mode_t mode);
 void crypto_free_ssl(ssl_t* ssl);
 int crypto_read(ssl_t* ssl, void* to, int max);
-int crypto_write(ssl_t* ssl, const void* data, int size);
+int crypto_write(ssl_t* ssl, const void* data, size_t size, size_t* written); /* Returns 1 once written */
+int crypto_session_reused(ssl_t* ssl); /* Returns 1 if the handshake resumed a session */
+int crypto_alpn_h2(ssl_t* ssl); /* Returns 1 if the client chose h2 */
+int crypto_ktls_send(ssl_t* ssl); /* Returns 1 if the kernel encrypts what is written to the socket */
 int crypto_error_needs_data_only(ssl_t* ssl, int err); /* Returns 1 if true */
 
 #endif /* CRYPTO_H */
@@ -14,6 +14,7 @@
  */
 
 
+#include <signal.h>
 #include <stdio.h>
 #include "../appster.h"
 #include "../log.h"
@@ -35,6 +36,7 @@ int exec_read(void* data) {
 }
 
 int main() {
+    signal(SIGPIPE, SIG_IGN); /* peers going away are write errors */
     appster_t* a = as_alloc(1);
 
     as_add_route(a, "/read", exec_read, NULL, NULL);
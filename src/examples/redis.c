@@ -13,6 +13,7 @@
  as_redis* returns the reply from the redis.
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include "../appster.h"
 #include "../module/redis.h"
@@ -50,6 +51,7 @@ int main() {
         {NULL}
     };
 
+    signal(SIGPIPE, SIG_IGN); /* peers going away are write errors */
     appster_t* a = as_alloc(1);
     as_module_init(a, as_redis_module_init);
 
@@ -30,6 +30,7 @@
     VALUES ('chair', 'red', 'east', '2011-09-21');
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include "../appster.h"
 #include "../module/sql.h"
@@ -84,6 +85,7 @@ int main() {
         {NULL}
     };
 
+    signal(SIGPIPE, SIG_IGN); /* peers going away are write errors */
     appster_t* a = as_alloc(1);
     as_module_init(a, as_sql_module_init);
 
@@ -11,6 +11,7 @@
 */
 
 
+#include <signal.h>
 #include <stdio.h>
 #include "../appster.h"
 
@@ -32,6 +33,7 @@ int main() {
         {NULL}
     };
 
+    signal(SIGPIPE, SIG_IGN); /* peers going away are write errors */
     appster_t* a = as_alloc(1);
 
 #ifdef HAS_CRYPTO
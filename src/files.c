@@ -0,0 +1,463 @@
+#include "files.h"
+#include "log.h"
+#include "evbuffer.h"
+#include "hashmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define FC_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | \
+                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define FC_DIR_GONE (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)
+#define FC_TYPE_DEFAULT "application/octet-stream"
+
+typedef struct fwatch_s {
+    dev_t dev; /* the directory, whatever path it's reached by */
+    ino_t ino;
+    int wd;
+    uint32_t refs; /* cached files in the directory */
+    char** dirs; /* the paths its files are cached under */
+    uint32_t ndirs;
+} fwatch_t;
+
+typedef struct fentry_s {
+    fc_file_t f; /* first, fc_release gets the entry back from it */
+    struct fentry_s* prev,* next; /* most recently used first */
+    char* path;
+    fwatch_t* watch; /* NULL when the directory is not watched */
+    uint64_t checked; /* when the path was last compared to the file */
+    uint32_t refs; /* the cache and every reply holding the file */
+} fentry_t;
+
+struct file_cache_s {
+    int fd; /* inotify, -1 if not available */
+    uint32_t max_files;
+    uint32_t count;
+    uint32_t revalidate;
+    uint64_t hits;
+    uint64_t misses;
+    hashmap_t* entries; /* path to entry */
+    hashmap_t* inodes; /* device and inode to watch */
+    hashmap_t* watches; /* watch descriptor to watch */
+    fentry_t* head,* tail;
+};
+
+static const struct {
+    const char* ext;
+    const char* type;
+} types[] = {
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "css", "text/css" },
+    { "js", "application/javascript" },
+    { "mjs", "application/javascript" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "txt", "text/plain" },
+    { "csv", "text/csv" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { "mp3", "audio/mpeg" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+};
+
+static fentry_t* entry_open(const char* path, uint64_t now);
+static void entry_cache(file_cache_t* fc, fentry_t* e, const char* path);
+static void entry_touch(file_cache_t* fc, fentry_t* e);
+static void entry_drop(file_cache_t* fc, fentry_t* e);
+static void entry_drop_all(file_cache_t* fc, fwatch_t* w, const char* prefix, size_t len);
+static int entry_changed(const fentry_t* e, const struct stat* st);
+static const char* file_type(const char* path);
+static fwatch_t* watch_get(file_cache_t* fc, const char* path);
+static void watch_put(file_cache_t* fc, fwatch_t* w);
+static int watch_hash(const void* key);
+static int watch_equals(const void* a, const void* b);
+static int inode_hash(const void* key);
+static int inode_equals(const void* a, const void* b);
+
+file_cache_t* fc_alloc(uint32_t max_files, uint32_t revalidate) {
+    file_cache_t* rc;
+
+    rc = calloc(1, sizeof(file_cache_t));
+    rc->max_files = max_files;
+    rc->revalidate = revalidate;
+    rc->entries = hm_alloc(max_files ? max_files : 1, NULL, NULL);
+    rc->inodes = hm_alloc(16, inode_hash, inode_equals);
+    rc->watches = hm_alloc(16, watch_hash, watch_equals);
+
+    rc->fd = max_files ? inotify_init1(IN_NONBLOCK | IN_CLOEXEC) : -1;
+    if (max_files && rc->fd == -1) {
+        ELOG("Failed to watch static files, changes show after %u ms: %s", revalidate, strerror(errno));
+    }
+
+    return rc;
+}
+void fc_free(file_cache_t* fc) {
+    if (!fc) {
+        return;
+    }
+
+    /* replies still holding a file release it once they are done */
+    while (fc->head) {
+        entry_drop(fc, fc->head);
+    }
+
+    if (fc->fd != -1) {
+        close(fc->fd);
+    }
+    hm_free(fc->entries);
+    hm_free(fc->inodes);
+    hm_free(fc->watches);
+    free(fc);
+}
+int fc_fd(file_cache_t* fc) {
+    return fc->fd;
+}
+void fc_notify(file_cache_t* fc) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    char path[PATH_MAX];
+    fentry_t* e;
+    fwatch_t* w;
+    ssize_t n;
+    int len;
+
+    while ((n = read(fc->fd, buf, sizeof(buf))) > 0) {
+        for (char* it = buf; it < buf + n; it += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*) it;
+
+            if (ev->mask & IN_Q_OVERFLOW) { /* events were lost, nothing can be trusted */
+                entry_drop_all(fc, NULL, NULL, 0);
+                continue;
+            }
+
+            w = hm_get(fc->watches, &ev->wd);
+            if (!w) {
+                continue;
+            }
+
+            if (ev->mask & FC_DIR_GONE) {
+                entry_drop_all(fc, w, NULL, 0);
+                continue;
+            }
+            if (!ev->len) {
+                continue;
+            }
+
+            /* the name is looked up under every path of the directory, held while its files go */
+            w->refs++;
+            for (uint32_t i = 0; i < w->ndirs; i++) {
+                len = snprintf(path, sizeof(path), "%s%s%s", w->dirs[i], strcmp(w->dirs[i], "/") ? "/" : "", ev->name);
+                if (len >= (int) sizeof(path)) {
+                    continue;
+                }
+
+                /* a directory moved or removed takes the files below it along */
+                if (ev->mask & IN_ISDIR) {
+                    path[len] = '/';
+                    entry_drop_all(fc, NULL, path, len + 1);
+                    continue;
+                }
+
+                e = hm_get(fc->entries, path);
+                if (e && e->watch == w) {
+                    entry_drop(fc, e);
+                }
+            }
+            watch_put(fc, w);
+        }
+    }
+}
+fc_file_t* fc_open(file_cache_t* fc, const char* path, uint64_t now) {
+    struct stat st;
+    fentry_t* e;
+
+    e = fc->max_files ? hm_get(fc->entries, path) : NULL;
+    if (e && now - e->checked >= fc->revalidate) {
+        if (stat(path, &st) || entry_changed(e, &st)) {
+            entry_drop(fc, e);
+            e = NULL;
+        } else {
+            e->checked = now;
+        }
+    }
+
+    if (e) {
+        entry_touch(fc, e);
+        e->refs++;
+        fc->hits++;
+        return &e->f;
+    }
+
+    fc->misses++;
+    e = entry_open(path, now);
+    if (!e) {
+        return NULL;
+    }
+
+    if (fc->max_files) {
+        entry_cache(fc, e, path);
+    }
+
+    return &e->f;
+}
+void fc_release(fc_file_t* f) {
+    fentry_t* e = (fentry_t*) f;
+
+    if (!e || --e->refs) {
+        return;
+    }
+
+    /* the descriptor is closed by the segment, replies may still be writing it */
+    evbuffer_file_segment_free(e->f.seg);
+    free(e->path);
+    free(e);
+}
+void fc_stats(file_cache_t* fc, uint64_t* hits, uint64_t* misses) {
+    *hits = fc->hits;
+    *misses = fc->misses;
+}
+fentry_t* entry_open(const char* path, uint64_t now) {
+    struct stat st;
+    struct tm tm;
+    fentry_t* rc;
+    int fd, err;
+
+    /* a fifo would block the loop on open */
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st)) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : ENOENT;
+        return NULL;
+    }
+
+    rc = calloc(1, sizeof(fentry_t));
+    rc->f.seg = evbuffer_file_segment_new(fd, 0, st.st_size, EVBUF_FS_CLOSE_ON_FREE);
+    if (!rc->f.seg) {
+        close(fd);
+        free(rc);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    rc->f.st = st;
+    rc->f.type = file_type(path);
+    rc->f.etag_len = snprintf(rc->f.etag, sizeof(rc->f.etag), "\"%lx-%lx\"",
+                              (unsigned long) st.st_mtime, (unsigned long) st.st_size);
+    gmtime_r(&st.st_mtime, &tm);
+    rc->f.modified_len = strftime(rc->f.modified, sizeof(rc->f.modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    rc->checked = now;
+    rc->refs = 1;
+    return rc;
+}
+void entry_cache(file_cache_t* fc, fentry_t* e, const char* path) {
+    while (fc->tail && fc->count >= fc->max_files) {
+        entry_drop(fc, fc->tail);
+    }
+
+    e->path = strdup(path);
+    e->watch = watch_get(fc, path);
+    e->refs++;
+
+    hm_put(fc->entries, e->path, e);
+    e->next = fc->head;
+    if (fc->head) {
+        fc->head->prev = e;
+    } else {
+        fc->tail = e;
+    }
+    fc->head = e;
+    fc->count++;
+}
+void entry_touch(file_cache_t* fc, fentry_t* e) {
+    if (e == fc->head) {
+        return;
+    }
+
+    e->prev->next = e->next;
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        fc->tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = fc->head;
+    fc->head->prev = e;
+    fc->head = e;
+}
+void entry_drop(file_cache_t* fc, fentry_t* e) {
+    hm_remove(fc->entries, e->path);
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        fc->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        fc->tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+    fc->count--;
+
+    watch_put(fc, e->watch);
+    e->watch = NULL;
+    fc_release(&e->f);
+}
+void entry_drop_all(file_cache_t* fc, fwatch_t* w, const char* prefix, size_t len) {
+    fentry_t* next;
+
+    /* w is only compared, it's freed along with its last file */
+    for (fentry_t* e = fc->head; e; e = next) {
+        next = e->next;
+        if ((!w || e->watch == w) && (!prefix || !strncmp(e->path, prefix, len))) {
+            entry_drop(fc, e);
+        }
+    }
+}
+int entry_changed(const fentry_t* e, const struct stat* st) {
+    return e->f.st.st_dev != st->st_dev || e->f.st.st_ino != st->st_ino ||
+           e->f.st.st_size != st->st_size || e->f.st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+           e->f.st.st_mtim.tv_nsec != st->st_mtim.tv_nsec;
+}
+const char* file_type(const char* path) {
+    const char* ext;
+
+    ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) {
+        return FC_TYPE_DEFAULT;
+    }
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcasecmp(types[i].ext, ext + 1)) {
+            return types[i].type;
+        }
+    }
+
+    return FC_TYPE_DEFAULT;
+}
+fwatch_t* watch_get(file_cache_t* fc, const char* path) {
+    const char* slash;
+    struct stat st;
+    fwatch_t key,* rc;
+    char* dir;
+    int wd;
+
+    if (fc->fd == -1) {
+        return NULL;
+    }
+
+    slash = strrchr(path, '/');
+    if (!slash) {
+        dir = strdup(".");
+    } else if (slash == path) {
+        dir = strdup("/");
+    } else {
+        dir = strndup(path, slash - path);
+    }
+
+    /* the same directory by another path shares the watch */
+    if (stat(dir, &st)) {
+        DLOG("Failed to watch %s: %s", dir, strerror(errno));
+        free(dir);
+        return NULL;
+    }
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    rc = hm_get(fc->inodes, &key);
+
+    if (!rc) {
+        wd = inotify_add_watch(fc->fd, dir, FC_EVENTS);
+        if (wd == -1) {
+            DLOG("Failed to watch %s: %s", dir, strerror(errno));
+            free(dir);
+            return NULL;
+        }
+
+        rc = calloc(1, sizeof(fwatch_t));
+        rc->dev = st.st_dev;
+        rc->ino = st.st_ino;
+        rc->wd = wd;
+        hm_put(fc->inodes, rc, rc);
+        hm_put(fc->watches, &rc->wd, rc);
+    }
+    rc->refs++;
+
+    /* events name the file only, it's found under each path the directory was given by */
+    for (uint32_t i = 0; i < rc->ndirs; i++) {
+        if (!strcmp(rc->dirs[i], dir)) {
+            free(dir);
+            return rc;
+        }
+    }
+    rc->dirs = realloc(rc->dirs, (rc->ndirs + 1) * sizeof(char*));
+    rc->dirs[rc->ndirs++] = dir;
+    return rc;
+}
+void watch_put(file_cache_t* fc, fwatch_t* w) {
+    if (!w || --w->refs) {
+        return;
+    }
+
+    /* fails once the directory is gone, the kernel dropped the watch already */
+    inotify_rm_watch(fc->fd, w->wd);
+    hm_remove(fc->inodes, w);
+    hm_remove(fc->watches, &w->wd);
+    for (uint32_t i = 0; i < w->ndirs; i++) {
+        free(w->dirs[i]);
+    }
+    free(w->dirs);
+    free(w);
+}
+int watch_hash(const void* key) {
+    return *(const int*) key;
+}
+int watch_equals(const void* a, const void* b) {
+    return *(const int*) a == *(const int*) b;
+}
+int inode_hash(const void* key) {
+    const fwatch_t* w = key;
+
+    return (int) (w->ino ^ (w->ino >> 32) ^ w->dev);
+}
+int inode_equals(const void* a, const void* b) {
+    const fwatch_t* wa = a,* wb = b;
+
+    return wa->dev == wb->dev && wa->ino == wb->ino;
+}
@@ -0,0 +1,50 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ Cache of open files for static replies. A file is opened and stat'ed once,
+ then kept open with a segment of the whole file that replies add by
+ reference, until it's the least recently used one past the size of the
+ cache. The directories of the cached files are watched with inotify, once
+ whatever path they are reached by, a change drops the file under each of
+ them right away. Files are checked against the path again
+ after the revalidation period, which catches what the watches can not see,
+ like a swapped symlink above them. A cache belongs to a single loop and is
+ not locked.
+ */
+typedef struct file_cache_s file_cache_t;
+
+struct evbuffer_file_segment;
+
+/* Read only outside files.c */
+typedef struct fc_file_s {
+    struct stat st;
+    struct evbuffer_file_segment* seg; /* the whole file */
+    const char* type; /* by the extension */
+    char etag[40];
+    uint32_t etag_len;
+    char modified[32]; /* IMF-fixdate of the modification time */
+    uint32_t modified_len;
+} fc_file_t;
+
+/* max_files 0 opens the files for every request, revalidate is in ms */
+file_cache_t* fc_alloc(uint32_t max_files, uint32_t revalidate);
+void fc_free(file_cache_t* fc);
+/* Readable when watched directories changed, -1 without inotify */
+int fc_fd(file_cache_t* fc);
+/* Drops the files that changed */
+void fc_notify(file_cache_t* fc);
+/*
+ Returns a regular file with a reference the caller has to release, now is
+ the loop time in ms. Returns NULL with errno set otherwise, EISDIR for a
+ directory.
+ */
+fc_file_t* fc_open(file_cache_t* fc, const char* path, uint64_t now);
+void fc_release(fc_file_t* f);
+/* Files found open and files opened */
+void fc_stats(file_cache_t* fc, uint64_t* hits, uint64_t* misses);
+
+#endif /* FILES_H */
@@ -166,3 +166,55 @@ int urldecode(const char* src, char* dst)
     return 1;
 }
 
+
+/* writes the decimal digits without terminating zero, returns the length */
+uint32_t u64toa(uint64_t value, char* dst)
+{
+    static const char digits[201] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+    char tmp[20],* it = tmp + sizeof(tmp);
+    uint32_t len, i;
+
+    while (value >= 100)
+    {
+        i = (value % 100) * 2;
+        value /= 100;
+        *--it = digits[i + 1];
+        *--it = digits[i];
+    }
+
+    if (value >= 10)
+    {
+        i = value * 2;
+        *--it = digits[i + 1];
+        *--it = digits[i];
+    }
+    else
+    {
+        *--it = '0' + value;
+    }
+
+    len = tmp + sizeof(tmp) - it;
+    memcpy(dst, it, len);
+    return len;
+}
+
+uint32_t u64tox(uint64_t value, char* dst)
+{
+    static const char digits[] = "0123456789abcdef";
+    char tmp[16],* it = tmp + sizeof(tmp);
+    uint32_t len;
+
+    do
+    {
+        *--it = digits[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    len = tmp + sizeof(tmp) - it;
+    memcpy(dst, it, len);
+    return len;
+}
@@ -10,5 +10,8 @@ uint32_t from_base64 (const char *str, char* output);
 const char* to_base64(const char* str);
 const char* to_base64_ex(const char* str, uint32_t len);
 int urldecode(const char* src, char* dst);
+/* Do not zero terminate, return the amount of characters written */
+uint32_t u64toa(uint64_t value, char* dst);
+uint32_t u64tox(uint64_t value, char* dst);
 
 #endif /* FORMAT_H */
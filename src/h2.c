@@ -0,0 +1,806 @@
+#include "h2.h"
+#include "hpack.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN (sizeof(PREFACE) - 1)
+#define FRAME_HEADER 9
+#define FRAME_SIZE 16384 /* the most sent and the most accepted */
+#define FRAME_SIZE_MAX 16777215
+#define WINDOW_DEFAULT 65535
+#define WINDOW_MAX 0x7fffffff
+#define STREAM_WINDOW (256 * 1024) /* announced for every stream */
+#define CONNECTION_WINDOW (16 * 1024 * 1024)
+#define BLOCK_MAX (64 * 1024) /* header block with its continuations */
+#define BUCKETS 64
+#define RESET_BURST 100 /* streams reset by the peer beyond max_streams */
+
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+struct h2_stream_s {
+    uint32_t id;
+    int64_t send_window; /* may go below zero when the peer shrinks it */
+    int64_t recv_window;
+    uint32_t unacked; /* consumed, not given back yet */
+    unsigned headers_done:1;
+    unsigned remote_closed:1;
+    unsigned local_closed:1;
+    void* data;
+    h2_stream_t* next;
+};
+
+struct h2_s {
+    h2_callbacks_t cb;
+    void* data;
+    hpack_t* hp;
+    evbuffer_t* in; /* a frame read in part */
+    evbuffer_t* out;
+    h2_stream_t* buckets[BUCKETS];
+    uint32_t max_streams;
+    uint32_t open;
+    uint32_t resets; /* streams the peer reset unanswered, less answered ones */
+    uint32_t last_stream;
+    uint32_t preface;
+    int64_t send_window;
+    int64_t recv_window;
+    uint32_t unacked;
+    uint32_t initial_window; /* of the peer */
+    char* block; /* header block waiting for its continuations */
+    uint32_t block_len;
+    uint32_t block_stream;
+    unsigned block_end_stream:1;
+    unsigned settings_seen:1;
+    unsigned goaway:1;
+    unsigned failed:1;
+};
+
+static int execute_frame(h2_t* h2, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len);
+static int on_data(h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len);
+static int on_headers(h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len);
+static int on_continuation(h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len);
+static int on_block(h2_t* h2);
+static int on_settings(h2_t* h2, const uint8_t* p, uint32_t len);
+static int on_window_update(h2_t* h2, uint32_t id, const uint8_t* p, uint32_t len);
+static int on_rst_stream(h2_t* h2, uint32_t id, const uint8_t* p, uint32_t len);
+static int connection_error(h2_t* h2, uint32_t error);
+static void stream_error(h2_t* h2, h2_stream_t* st, uint32_t error);
+static void ignore_field(void* data, const char* name, uint32_t name_len, const char* value, uint32_t value_len);
+static h2_stream_t* stream_new(h2_t* h2, uint32_t id, void* data);
+static h2_stream_t* stream_find(h2_t* h2, uint32_t id);
+static void stream_unlink(h2_t* h2, h2_stream_t* st);
+static void write_frame(h2_t* h2, uint32_t len, uint8_t type, uint8_t flags, uint32_t id);
+static void write_u32(h2_t* h2, uint32_t value);
+static void write_rst_stream(h2_t* h2, uint32_t id, uint32_t error);
+static void write_window_update(h2_t* h2, uint32_t id, uint32_t increment);
+static uint32_t read_u32(const uint8_t* p);
+
+h2_t* h2_alloc(const h2_callbacks_t* cb, void* data, uint32_t max_streams) {
+    h2_t* h2;
+
+    h2 = calloc(1, sizeof(h2_t));
+    h2->cb = *cb;
+    h2->data = data;
+    h2->hp = hp_alloc(4096);
+    h2->in = evbuffer_new();
+    h2->out = evbuffer_new();
+    h2->max_streams = max_streams;
+    h2->send_window = WINDOW_DEFAULT;
+    h2->recv_window = CONNECTION_WINDOW;
+    h2->initial_window = WINDOW_DEFAULT;
+
+    write_frame(h2, 12, FRAME_SETTINGS, 0, 0);
+    evbuffer_add(h2->out, "\0\x03", 2);
+    write_u32(h2, max_streams);
+    evbuffer_add(h2->out, "\0\x04", 2);
+    write_u32(h2, STREAM_WINDOW);
+    write_window_update(h2, 0, CONNECTION_WINDOW - WINDOW_DEFAULT);
+
+    return h2;
+}
+void h2_free(h2_t* h2) {
+    h2_stream_t* st;
+    int i;
+
+    for (i = 0; i < BUCKETS; i++) {
+        while ((st = h2->buckets[i])) {
+            h2->buckets[i] = st->next;
+            free(st);
+        }
+    }
+
+    hp_free(h2->hp);
+    evbuffer_free(h2->in);
+    evbuffer_free(h2->out);
+    free(h2->block);
+    free(h2);
+}
+evbuffer_t* h2_output(h2_t* h2) {
+    return h2->out;
+}
+int h2_execute(h2_t* h2, const char* data, size_t len) {
+    const uint8_t* it;
+    const uint8_t* end;
+    uint32_t frame_len;
+    int buffered;
+    size_t n;
+
+    if (h2->failed) {
+        return -1;
+    }
+
+    while (h2->preface < PREFACE_LEN && len) {
+        if (*data != PREFACE[h2->preface]) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        h2->preface++;
+        data++;
+        len--;
+    }
+
+    buffered = evbuffer_get_length(h2->in) != 0;
+
+    if (buffered) {
+        evbuffer_add(h2->in, data, len);
+        len = evbuffer_get_length(h2->in);
+        data = (const char*) evbuffer_pullup(h2->in, len);
+    }
+
+    it = (const uint8_t*) data;
+    end = it + len;
+
+    while (end - it >= FRAME_HEADER) {
+        frame_len = it[0] << 16 | it[1] << 8 | it[2];
+
+        if (frame_len > FRAME_SIZE) {
+            return connection_error(h2, H2_FRAME_SIZE_ERROR);
+        }
+
+        if (end - it < FRAME_HEADER + frame_len) {
+            break;
+        }
+
+        if (execute_frame(h2, it[3], it[4], read_u32(it + 5) & WINDOW_MAX,
+                          it + FRAME_HEADER, frame_len)) {
+            return -1;
+        }
+
+        it += FRAME_HEADER + frame_len;
+    }
+
+    n = it - (const uint8_t*) data;
+
+    if (buffered) {
+        evbuffer_drain(h2->in, n);
+    } else {
+        evbuffer_add(h2->in, it, len - n);
+    }
+
+    return 0;
+}
+h2_stream_t* h2_upgrade(h2_t* h2, const char* settings, size_t len, void* stream_data) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint8_t payload[256];
+    uint32_t bits;
+    uint32_t n;
+    int count;
+    const char* c;
+    h2_stream_t* st;
+
+    if (len > sizeof(payload) * 4 / 3) {
+        return NULL;
+    }
+
+    bits = 0;
+    count = 0;
+    n = 0;
+
+    /* base64url without padding, RFC 4648 */
+    for (; len && settings[len - 1] == '='; len--);
+
+    while (len--) {
+        c = memchr(alphabet, *settings++, sizeof(alphabet) - 1);
+
+        if (!c) {
+            return NULL;
+        }
+
+        bits = bits << 6 | (c - alphabet);
+        count += 6;
+
+        if (count >= 8) {
+            count -= 8;
+            payload[n++] = bits >> count;
+        }
+    }
+
+    /* Acknowledged by the 101 reply */
+    if (n % 6 || on_settings(h2, payload, n)) {
+        return NULL;
+    }
+
+    h2->last_stream = 1;
+    st = stream_new(h2, 1, stream_data);
+    st->headers_done = 1;
+    st->remote_closed = 1;
+
+    return st;
+}
+void h2_goaway(h2_t* h2, uint32_t error) {
+    if (h2->goaway && error == H2_NO_ERROR) {
+        return;
+    }
+
+    h2->goaway = 1;
+    write_frame(h2, 8, FRAME_GOAWAY, 0, 0);
+    write_u32(h2, h2->last_stream);
+    write_u32(h2, error);
+}
+void h2_send_headers(h2_t* h2, h2_stream_t* st, evbuffer_t* block, int end_stream) {
+    uint8_t type;
+    uint8_t flags;
+    size_t len;
+    size_t n;
+
+    type = FRAME_HEADERS;
+    flags = end_stream ? FLAG_END_STREAM : 0;
+    len = evbuffer_get_length(block);
+
+    do {
+        n = len < FRAME_SIZE ? len : FRAME_SIZE;
+        len -= n;
+        write_frame(h2, n, type, flags | (len ? 0 : FLAG_END_HEADERS), st->id);
+        evbuffer_remove_buffer(block, h2->out, n);
+        type = FRAME_CONTINUATION;
+        flags = 0;
+    } while (len);
+
+    if (end_stream) {
+        st->local_closed = 1;
+    }
+}
+size_t h2_send_data(h2_t* h2, h2_stream_t* st, evbuffer_t* data, size_t max, int end_stream) {
+    size_t sent;
+    size_t len;
+    size_t n;
+    int last;
+
+    if (st->local_closed) {
+        return 0;
+    }
+
+    len = evbuffer_get_length(data);
+    last = end_stream && max >= len;
+    max = max < len ? max : len;
+    sent = 0;
+
+    while (sent < max) {
+        n = max - sent;
+        n = n < FRAME_SIZE ? n : FRAME_SIZE;
+        n = (int64_t) n < h2->send_window ? n : (size_t) (h2->send_window > 0 ? h2->send_window : 0);
+        n = (int64_t) n < st->send_window ? n : (size_t) (st->send_window > 0 ? st->send_window : 0);
+
+        if (!n) {
+            return sent;
+        }
+
+        sent += n;
+        h2->send_window -= n;
+        st->send_window -= n;
+        write_frame(h2, n, FRAME_DATA, last && sent == max ? FLAG_END_STREAM : 0, st->id);
+        evbuffer_remove_buffer(data, h2->out, n);
+    }
+
+    if (last) {
+        /* END_STREAM takes no window */
+        if (!max) {
+            write_frame(h2, 0, FRAME_DATA, FLAG_END_STREAM, st->id);
+        }
+
+        st->local_closed = 1;
+    }
+
+    return sent;
+}
+void h2_consume(h2_t* h2, h2_stream_t* st, size_t len) {
+    if (st->remote_closed) {
+        return;
+    }
+
+    st->unacked += len;
+
+    if (st->unacked >= STREAM_WINDOW / 2) {
+        write_window_update(h2, st->id, st->unacked);
+        st->recv_window += st->unacked;
+        st->unacked = 0;
+    }
+}
+void h2_close(h2_t* h2, h2_stream_t* st, uint32_t error) {
+    if (!st->local_closed || !st->remote_closed) {
+        write_rst_stream(h2, st->id, error);
+    } else if (h2->resets) {
+        h2->resets--;
+    }
+
+    stream_unlink(h2, st);
+    free(st);
+}
+int h2_local_closed(h2_stream_t* st) {
+    return st->local_closed;
+}
+int execute_frame(h2_t* h2, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len) {
+    if (h2->block_stream && (type != FRAME_CONTINUATION || id != h2->block_stream)) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    if (!h2->settings_seen && type != FRAME_SETTINGS) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        return on_data(h2, flags, id, p, len);
+    case FRAME_HEADERS:
+        return on_headers(h2, flags, id, p, len);
+    case FRAME_CONTINUATION:
+        return on_continuation(h2, flags, id, p, len);
+    case FRAME_PRIORITY:
+        if (!id) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        if (len != 5) {
+            return connection_error(h2, H2_FRAME_SIZE_ERROR);
+        }
+
+        return 0;
+    case FRAME_RST_STREAM:
+        return on_rst_stream(h2, id, p, len);
+    case FRAME_SETTINGS:
+        if (id) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        if (flags & FLAG_ACK) {
+            return len ? connection_error(h2, H2_FRAME_SIZE_ERROR) : 0;
+        }
+
+        if (len % 6) {
+            return connection_error(h2, H2_FRAME_SIZE_ERROR);
+        }
+
+        h2->settings_seen = 1;
+
+        if (on_settings(h2, p, len)) {
+            return -1;
+        }
+
+        write_frame(h2, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+        return 0;
+    case FRAME_PING:
+        if (id) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        if (len != 8) {
+            return connection_error(h2, H2_FRAME_SIZE_ERROR);
+        }
+
+        if (!(flags & FLAG_ACK)) {
+            write_frame(h2, 8, FRAME_PING, FLAG_ACK, 0);
+            evbuffer_add(h2->out, p, 8);
+        }
+
+        return 0;
+    case FRAME_GOAWAY:
+        /* Requests already made are still answered */
+        return id ? connection_error(h2, H2_PROTOCOL_ERROR) : 0;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(h2, id, p, len);
+    case FRAME_PUSH_PROMISE:
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    default:
+        return 0;
+    }
+}
+int on_data(h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len) {
+    h2_stream_t* st;
+    uint32_t pad;
+
+    if (!id || id > h2->last_stream) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    if (len > h2->recv_window) {
+        return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+    }
+
+    /* The connection window is given back right away, streams are bounded */
+    h2->recv_window -= len;
+    h2->unacked += len;
+
+    if (h2->unacked >= CONNECTION_WINDOW / 2) {
+        write_window_update(h2, 0, h2->unacked);
+        h2->recv_window += h2->unacked;
+        h2->unacked = 0;
+    }
+
+    pad = 0;
+
+    if (flags & FLAG_PADDED) {
+        if (!len || p[0] >= len) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        pad = p[0] + 1;
+    }
+
+    st = stream_find(h2, id);
+
+    /* Sent before our reset reached the peer */
+    if (!st) {
+        return 0;
+    }
+
+    if (st->remote_closed || !st->headers_done) {
+        stream_error(h2, st, H2_STREAM_CLOSED);
+        return 0;
+    }
+
+    if (len > st->recv_window) {
+        stream_error(h2, st, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+
+    st->recv_window -= len;
+    st->unacked += pad;
+
+    if (flags & FLAG_END_STREAM) {
+        st->remote_closed = 1;
+    }
+
+    h2->cb.on_data(st->data, (const char*) p + (pad ? 1 : 0), len - pad,
+                   flags & FLAG_END_STREAM);
+
+    return 0;
+}
+int on_headers(h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len) {
+    uint32_t skip;
+    uint32_t pad;
+
+    if (!id || !(id & 1)) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    skip = 0;
+    pad = 0;
+
+    if (flags & FLAG_PADDED) {
+        if (!len) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        pad = p[0];
+        skip = 1;
+    }
+
+    if (flags & FLAG_PRIORITY) {
+        skip += 5;
+    }
+
+    if (skip + pad > len) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    h2->block_len = 0;
+    h2->block_stream = id;
+    h2->block_end_stream = (flags & FLAG_END_STREAM) != 0;
+
+    return on_continuation(h2, flags, id, p + skip, len - skip - pad);
+}
+int on_continuation(h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len) {
+    if (!h2->block_stream) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    if (h2->block_len + len > BLOCK_MAX) {
+        return connection_error(h2, H2_ENHANCE_YOUR_CALM);
+    }
+
+    if (!h2->block) {
+        h2->block = malloc(BLOCK_MAX);
+    }
+
+    memcpy(h2->block + h2->block_len, p, len);
+    h2->block_len += len;
+
+    return flags & FLAG_END_HEADERS ? on_block(h2) : 0;
+}
+int on_block(h2_t* h2) {
+    h2_stream_t* st;
+    hp_field_cb_t cb;
+    void* data;
+    uint32_t id;
+    int end_stream;
+    int rc;
+
+    id = h2->block_stream;
+    end_stream = h2->block_end_stream;
+    h2->block_stream = 0;
+    st = stream_find(h2, id);
+    cb = ignore_field;
+    data = NULL;
+
+    if (st) {
+        /* Trailers, they are decoded and dropped */
+        if (st->remote_closed || !end_stream) {
+            rc = hp_decode(h2->hp, (uint8_t*) h2->block, h2->block_len, cb, data);
+            stream_error(h2, st, st->remote_closed ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+            return rc ? connection_error(h2, H2_COMPRESSION_ERROR) : 0;
+        }
+    } else if (id > h2->last_stream) {
+        h2->last_stream = id;
+
+        if (!h2->goaway && h2->open < h2->max_streams) {
+            st = stream_new(h2, id, NULL);
+            st->data = h2->cb.on_begin(h2->data, st);
+
+            if (!st->data) {
+                stream_unlink(h2, st);
+                free(st);
+                st = NULL;
+            } else {
+                cb = h2->cb.on_header;
+                data = st->data;
+            }
+        }
+
+        if (!st) {
+            write_rst_stream(h2, id, H2_REFUSED_STREAM);
+        }
+    }
+
+    /* Every block goes through the decoder to keep its table in step */
+    if (hp_decode(h2->hp, (uint8_t*) h2->block, h2->block_len, cb, data)) {
+        return connection_error(h2, H2_COMPRESSION_ERROR);
+    }
+
+    if (!st) {
+        return 0;
+    }
+
+    if (end_stream) {
+        st->remote_closed = 1;
+    }
+
+    if (st->headers_done) {
+        h2->cb.on_data(st->data, NULL, 0, 1);
+    } else {
+        st->headers_done = 1;
+        h2->cb.on_headers(st->data, end_stream);
+    }
+
+    return 0;
+}
+int on_settings(h2_t* h2, const uint8_t* p, uint32_t len) {
+    h2_stream_t* st;
+    uint32_t value;
+    int64_t delta;
+    int i;
+
+    for (; len; p += 6, len -= 6) {
+        value = read_u32(p + 2);
+
+        switch (p[0] << 8 | p[1]) {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return connection_error(h2, H2_PROTOCOL_ERROR);
+            }
+
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > WINDOW_MAX) {
+                return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+            }
+
+            delta = (int64_t) value - h2->initial_window;
+            h2->initial_window = value;
+
+            for (i = 0; i < BUCKETS; i++) {
+                for (st = h2->buckets[i]; st; st = st->next) {
+                    st->send_window += delta;
+
+                    if (st->send_window > WINDOW_MAX) {
+                        return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+                    }
+                }
+            }
+
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < FRAME_SIZE || value > FRAME_SIZE_MAX) {
+                return connection_error(h2, H2_PROTOCOL_ERROR);
+            }
+
+            /* Bigger frames only help the peer, they are never sent */
+            break;
+        default:
+            /* The encoder keeps no table and nothing is pushed */
+            break;
+        }
+    }
+
+    return 0;
+}
+int on_window_update(h2_t* h2, uint32_t id, const uint8_t* p, uint32_t len) {
+    h2_stream_t* st;
+    uint32_t increment;
+
+    if (len != 4) {
+        return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+
+    increment = read_u32(p) & WINDOW_MAX;
+
+    if (!id) {
+        if (!increment) {
+            return connection_error(h2, H2_PROTOCOL_ERROR);
+        }
+
+        h2->send_window += increment;
+        return h2->send_window > WINDOW_MAX ? connection_error(h2, H2_FLOW_CONTROL_ERROR) : 0;
+    }
+
+    if (id > h2->last_stream) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    if (!(st = stream_find(h2, id))) {
+        return 0;
+    }
+
+    st->send_window += increment;
+
+    if (!increment) {
+        stream_error(h2, st, H2_PROTOCOL_ERROR);
+    } else if (st->send_window > WINDOW_MAX) {
+        stream_error(h2, st, H2_FLOW_CONTROL_ERROR);
+    }
+
+    return 0;
+}
+int on_rst_stream(h2_t* h2, uint32_t id, const uint8_t* p, uint32_t len) {
+    h2_stream_t* st;
+
+    if (len != 4) {
+        return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    }
+
+    if (!id || id > h2->last_stream) {
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    if (!(st = stream_find(h2, id))) {
+        return 0;
+    }
+
+    /*
+     Every request costs its handler while the reset is free to the peer,
+     one opening and resetting streams in a loop is told to stop.
+     */
+    if (!st->local_closed && ++h2->resets > h2->max_streams + RESET_BURST) {
+        return connection_error(h2, H2_ENHANCE_YOUR_CALM);
+    }
+
+    stream_unlink(h2, st);
+    h2->cb.on_reset(st->data, read_u32(p));
+    free(st);
+
+    return 0;
+}
+int connection_error(h2_t* h2, uint32_t error) {
+    h2_goaway(h2, error);
+    h2->failed = 1;
+    return -1;
+}
+void stream_error(h2_t* h2, h2_stream_t* st, uint32_t error) {
+    write_rst_stream(h2, st->id, error);
+    stream_unlink(h2, st);
+    h2->cb.on_reset(st->data, error);
+    free(st);
+}
+void ignore_field(void* data, const char* name, uint32_t name_len, const char* value, uint32_t value_len) {
+}
+
+h2_stream_t* stream_new(h2_t* h2, uint32_t id, void* data) {
+    h2_stream_t* st;
+    h2_stream_t** bucket;
+
+    st = calloc(1, sizeof(h2_stream_t));
+    st->id = id;
+    st->send_window = h2->initial_window;
+    st->recv_window = STREAM_WINDOW;
+    st->data = data;
+
+    bucket = &h2->buckets[(id >> 1) % BUCKETS];
+    st->next = *bucket;
+    *bucket = st;
+    h2->open++;
+
+    return st;
+}
+h2_stream_t* stream_find(h2_t* h2, uint32_t id) {
+    h2_stream_t* st;
+
+    for (st = h2->buckets[(id >> 1) % BUCKETS]; st && st->id != id; st = st->next);
+
+    return st;
+}
+void stream_unlink(h2_t* h2, h2_stream_t* st) {
+    h2_stream_t** it;
+
+    for (it = &h2->buckets[(st->id >> 1) % BUCKETS]; *it != st; it = &(*it)->next);
+
+    *it = st->next;
+    h2->open--;
+}
+void write_frame(h2_t* h2, uint32_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    uint8_t header[FRAME_HEADER];
+
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    header[5] = id >> 24;
+    header[6] = id >> 16;
+    header[7] = id >> 8;
+    header[8] = id;
+
+    evbuffer_add(h2->out, header, FRAME_HEADER);
+}
+void write_u32(h2_t* h2, uint32_t value) {
+    uint8_t bytes[4];
+
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+
+    evbuffer_add(h2->out, bytes, 4);
+}
+void write_rst_stream(h2_t* h2, uint32_t id, uint32_t error) {
+    write_frame(h2, 4, FRAME_RST_STREAM, 0, id);
+    write_u32(h2, error);
+}
+void write_window_update(h2_t* h2, uint32_t id, uint32_t increment) {
+    write_frame(h2, 4, FRAME_WINDOW_UPDATE, 0, id);
+    write_u32(h2, increment);
+}
+uint32_t read_u32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
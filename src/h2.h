@@ -0,0 +1,84 @@
+#ifndef H2_H
+#define H2_H
+
+#include "evbuffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Server side HTTP/2 framing (RFC 9113). Bytes read from the connection are fed
+ to h2_execute, which answers the connection level frames by itself and
+ reports requests through the callbacks, header blocks are decoded with HPACK
+ on the way. Frames to send are appended to the output buffer of the session,
+ the caller writes it to the connection. Flow control is kept both ways: DATA
+ is only queued within the send windows of the peer and the window of a
+ stream is given back as the caller consumes its body. The callbacks may send
+ on and close any stream, including their own. A session belongs to a single
+ connection and is not locked.
+ */
+typedef struct h2_s h2_t;
+typedef struct h2_stream_s h2_stream_t;
+
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+typedef struct h2_callbacks_s {
+    /* A request starts, returns what the stream carries or NULL to refuse it */
+    void* (*on_begin)(void* data, h2_stream_t* st);
+    void (*on_header)(void* stream_data, const char* name, uint32_t name_len,
+                      const char* value, uint32_t value_len);
+    /* The request headers are complete, trailers are not reported */
+    void (*on_headers)(void* stream_data, int end_stream);
+    void (*on_data)(void* stream_data, const char* at, size_t len, int end_stream);
+    /* The stream was reset by the peer or for an error, it's freed after the call */
+    void (*on_reset)(void* stream_data, uint32_t error);
+} h2_callbacks_t;
+
+/*
+ Queues the server preface, at most max_streams requests are open at once.
+ A peer resetting more than max_streams and a burst of streams before they
+ are answered, less the ones answered meanwhile, gets GOAWAY with
+ ENHANCE_YOUR_CALM.
+ */
+h2_t* h2_alloc(const h2_callbacks_t* cb, void* data, uint32_t max_streams);
+void h2_free(h2_t* h2);
+evbuffer_t* h2_output(h2_t* h2);
+/*
+ Returns -1 on a connection error. GOAWAY is queued and the connection is to
+ be closed once it's written, nothing more is parsed.
+ */
+int h2_execute(h2_t* h2, const char* data, size_t len);
+/*
+ An HTTP/1.1 request upgraded with h2c becomes stream 1, its request is
+ complete already. settings is the HTTP2-Settings header. Returns NULL if the
+ settings are malformed.
+ */
+h2_stream_t* h2_upgrade(h2_t* h2, const char* settings, size_t len, void* stream_data);
+/* Tell the peer no more streams are accepted */
+void h2_goaway(h2_t* h2, uint32_t error);
+
+/* block is a complete HPACK header block, it's drained */
+void h2_send_headers(h2_t* h2, h2_stream_t* st, evbuffer_t* block, int end_stream);
+/*
+ Moves up to max bytes of data into DATA frames, as much as the send windows
+ allow. END_STREAM goes with the last of the data if end_stream is set.
+ Returns the number of bytes moved.
+ */
+size_t h2_send_data(h2_t* h2, h2_stream_t* st, evbuffer_t* data, size_t max, int end_stream);
+/* The body was read this far, the peer can send that much more */
+void h2_consume(h2_t* h2, h2_stream_t* st, size_t len);
+/* Done with the stream, reset with error unless both sides ended it. Frees it */
+void h2_close(h2_t* h2, h2_stream_t* st, uint32_t error);
+/* END_STREAM was sent */
+int h2_local_closed(h2_stream_t* st);
+
+#endif /* H2_H */
@@ -0,0 +1,83 @@
+#include "histogram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HG_SUB_BITS 4
+#define HG_SUB_COUNT (1 << HG_SUB_BITS)
+#define HG_MAX_SHIFT 28 /* values up to 2^32 */
+#define HG_BUCKETS (HG_SUB_COUNT + (HG_MAX_SHIFT + 1) * HG_SUB_COUNT)
+
+struct histogram_s {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HG_BUCKETS];
+};
+
+static uint32_t bucket_index(uint64_t value);
+static uint64_t bucket_min(uint32_t idx);
+
+histogram_t* hg_alloc() {
+    return calloc(1, sizeof(histogram_t));
+}
+void hg_free(histogram_t* h) {
+    free(h);
+}
+void hg_record(histogram_t* h, uint64_t value) {
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+}
+void hg_reset(histogram_t* h) {
+    memset(h, 0, sizeof(histogram_t));
+}
+void hg_merge(histogram_t* dst, const histogram_t* src) {
+    for (uint32_t i = 0; i < HG_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+}
+uint64_t hg_count(const histogram_t* h) {
+    return h->count;
+}
+uint64_t hg_sum(const histogram_t* h) {
+    return h->sum;
+}
+uint64_t hg_count_below(const histogram_t* h, uint64_t max) {
+    uint64_t rc = 0;
+
+    /* a bucket straddling max counts whole, off by less than 1/16 of max */
+    for (uint32_t i = 0; i < HG_BUCKETS && bucket_min(i) <= max; i++) {
+        rc += h->buckets[i];
+    }
+
+    return rc;
+}
+uint32_t bucket_index(uint64_t value) {
+    uint32_t shift;
+
+    /* the first 16 values have a bucket each */
+    if (value < HG_SUB_COUNT) {
+        return value;
+    }
+
+    /* the top bits below the most significant one pick the bucket */
+    shift = 63 - __builtin_clzll(value) - HG_SUB_BITS;
+    if (shift > HG_MAX_SHIFT) {
+        return HG_BUCKETS - 1;
+    }
+
+    return HG_SUB_COUNT + shift * HG_SUB_COUNT + (value >> shift) - HG_SUB_COUNT;
+}
+uint64_t bucket_min(uint32_t idx) {
+    uint32_t shift, sub;
+
+    if (idx < HG_SUB_COUNT) {
+        return idx;
+    }
+
+    shift = (idx - HG_SUB_COUNT) / HG_SUB_COUNT;
+    sub = (idx - HG_SUB_COUNT) % HG_SUB_COUNT;
+    return (uint64_t) (HG_SUB_COUNT + sub) << shift;
+}
@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ Log-linear histogram in the manner of HdrHistogram. Every power of two is
+ split into 16 buckets of equal width, so a value is known to within 1/16 of
+ itself from 1 to 2^32, larger values count in the last bucket. Recording is
+ a shift and an increment. A histogram is written by a single thread without
+ locking, others merging it see approximate counts.
+ */
+typedef struct histogram_s histogram_t;
+
+histogram_t* hg_alloc();
+void hg_free(histogram_t* h);
+void hg_record(histogram_t* h, uint64_t value);
+void hg_reset(histogram_t* h);
+/* Adds the counts of src to dst */
+void hg_merge(histogram_t* dst, const histogram_t* src);
+uint64_t hg_count(const histogram_t* h);
+uint64_t hg_sum(const histogram_t* h);
+/*
+ Values at most max, by the buckets starting at most at max. The bucket
+ holding max counts whole, values above max in it are off by less than 1/16.
+ */
+uint64_t hg_count_below(const histogram_t* h, uint64_t max);
+
+#endif /* HISTOGRAM_H */
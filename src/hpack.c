@@ -0,0 +1,471 @@
+#include "hpack.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define ENTRY_OVERHEAD 32 /* counted for every entry by the table size */
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+#define STATIC_ENTRIES 61
+
+typedef struct entry_s {
+    uint32_t name_len;
+    uint32_t value_len;
+    char data[]; /* name followed by the value */
+} entry_t;
+
+struct hpack_s {
+    entry_t** ring; /* dynamic table, newest entry at head - 1 */
+    uint32_t slots;
+    uint32_t head;
+    uint32_t count;
+    uint32_t size;
+    uint32_t max_size; /* lowered by the peer with size updates */
+    uint32_t limit; /* announced, size updates can't go over it */
+    char* buf; /* huffman decoded strings of the block being decoded */
+    size_t buf_size;
+    size_t buf_used;
+};
+
+static const struct {
+    const char* name;
+    const char* value;
+} static_table[STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/*
+ Code lengths of the symbols, the code itself is canonical (RFC 7541 B) so
+ the decoding tables are derived from the lengths alone.
+ */
+static const uint8_t huffman_bits[HUFFMAN_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* symbols ordered by code, first code and number of codes of every length */
+static uint16_t huffman_symbols[HUFFMAN_EOS + 1];
+static uint32_t huffman_first[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_offset[HUFFMAN_MAX_BITS + 1];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init();
+static int huffman_decode(const uint8_t* in, size_t len, char* out, size_t* out_len);
+static int read_int(const uint8_t** it, const uint8_t* end, unsigned prefix, uint32_t* rc);
+static int read_string(hpack_t* hp, const uint8_t** it, const uint8_t* end, const char** str, uint32_t* len);
+static int table_get(hpack_t* hp, uint32_t idx, const char** name, uint32_t* name_len, const char** value, uint32_t* value_len);
+static entry_t* table_add(hpack_t* hp, const char* name, uint32_t name_len, const char* value, uint32_t value_len);
+static void table_evict(hpack_t* hp, uint32_t size);
+static void write_int(evbuffer_t* out, uint8_t flags, unsigned prefix, uint32_t value);
+static int static_name(const char* name, uint32_t len);
+
+hpack_t* hp_alloc(uint32_t table_size) {
+    hpack_t* rc;
+
+    pthread_once(&huffman_once, huffman_init);
+
+    rc = calloc(1, sizeof(hpack_t));
+    rc->limit = table_size;
+    rc->max_size = table_size;
+    rc->slots = table_size / ENTRY_OVERHEAD + 1; /* no entry is smaller */
+    rc->ring = calloc(rc->slots, sizeof(entry_t*));
+    return rc;
+}
+void hp_free(hpack_t* hp) {
+    if (!hp) {
+        return;
+    }
+
+    table_evict(hp, 0);
+    free(hp->ring);
+    free(hp->buf);
+    free(hp);
+}
+int hp_decode(hpack_t* hp, const uint8_t* in, size_t len, hp_field_cb_t cb, void* data) {
+    const uint8_t* it = in,* end = in + len;
+    const char* name,* value;
+    uint32_t name_len, value_len, idx;
+    entry_t* e;
+    unsigned prefix;
+    int add;
+
+    /* a huffman string never decodes to more than 8/5 of its size */
+    if (hp->buf_size < 2 * len) {
+        free(hp->buf);
+        hp->buf_size = 2 * len;
+        hp->buf = malloc(hp->buf_size);
+    }
+    hp->buf_used = 0;
+
+    while (it < end) {
+        if (*it & 0x80) { /* indexed field */
+            if (read_int(&it, end, 7, &idx) ||
+                table_get(hp, idx, &name, &name_len, &value, &value_len)) {
+                return -1;
+            }
+            cb(data, name, name_len, value, value_len);
+            continue;
+        }
+
+        if ((*it & 0xe0) == 0x20) { /* dynamic table size update */
+            if (read_int(&it, end, 5, &idx) || idx > hp->limit) {
+                return -1;
+            }
+            hp->max_size = idx;
+            table_evict(hp, idx);
+            continue;
+        }
+
+        /* literal with incremental indexing, without indexing or never indexed */
+        add = (*it & 0xc0) == 0x40;
+        prefix = add ? 6 : 4;
+
+        if (read_int(&it, end, prefix, &idx)) {
+            return -1;
+        }
+        if (idx) {
+            if (table_get(hp, idx, &name, &name_len, &value, &value_len)) {
+                return -1;
+            }
+        } else if (read_string(hp, &it, end, &name, &name_len)) {
+            return -1;
+        }
+        if (read_string(hp, &it, end, &value, &value_len)) {
+            return -1;
+        }
+
+        /* the name may be an entry that is evicted by this one, copy first */
+        e = NULL;
+        if (add) {
+            e = table_add(hp, name, name_len, value, value_len);
+            if (e) {
+                name = e->data;
+                value = e->data + e->name_len;
+            }
+        }
+
+        cb(data, name, name_len, value, value_len);
+
+        if (add && !e) { /* not an error, a field over the table size empties it */
+            table_evict(hp, 0);
+        }
+    }
+
+    return 0;
+}
+void hp_encode(evbuffer_t* out, const char* name, uint32_t name_len,
+               const char* value, uint32_t value_len) {
+    char lower[256];
+    int idx;
+
+    idx = static_name(name, name_len);
+    if (idx) {
+        write_int(out, 0x00, 4, idx);
+    } else {
+        write_int(out, 0x00, 4, 0);
+        write_int(out, 0x00, 7, name_len);
+        for (uint32_t i = 0; i < name_len; i += sizeof(lower)) {
+            uint32_t n = name_len - i < sizeof(lower) ? name_len - i : sizeof(lower);
+            for (uint32_t j = 0; j < n; j++) {
+                lower[j] = tolower((unsigned char) name[i + j]);
+            }
+            evbuffer_add(out, lower, n);
+        }
+    }
+
+    write_int(out, 0x00, 7, value_len);
+    evbuffer_add(out, value, value_len);
+}
+void hp_encode_status(evbuffer_t* out, int status) {
+    static const int common[] = { 200, 204, 206, 304, 400, 404, 500 };
+    char value[4];
+
+    for (int i = 0; i < 7; i++) { /* static entries 8 to 14, a single byte */
+        if (common[i] == status) {
+            write_int(out, 0x80, 7, i + 8);
+            return;
+        }
+    }
+
+    value[0] = '0' + status / 100 % 10;
+    value[1] = '0' + status / 10 % 10;
+    value[2] = '0' + status % 10;
+    write_int(out, 0x00, 4, 8);
+    write_int(out, 0x00, 7, 3);
+    evbuffer_add(out, value, 3);
+}
+
+void huffman_init() {
+    uint32_t code = 0, n = 0;
+
+    for (unsigned bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+        huffman_first[bits] = code;
+        huffman_offset[bits] = n;
+        for (unsigned sym = 0; sym <= HUFFMAN_EOS; sym++) {
+            if (huffman_bits[sym] == bits) {
+                huffman_symbols[n++] = sym;
+                code++;
+            }
+        }
+        huffman_count[bits] = n - huffman_offset[bits];
+        code <<= 1;
+    }
+}
+int huffman_decode(const uint8_t* in, size_t len, char* out, size_t* out_len) {
+    uint32_t code = 0, sym;
+    unsigned bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            bits++;
+
+            if (code - huffman_first[bits] < huffman_count[bits]) {
+                sym = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+                if (sym == HUFFMAN_EOS) {
+                    return -1;
+                }
+                out[n++] = sym;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX_BITS) {
+                return -1;
+            }
+        }
+    }
+
+    /* the padding is the most significant bits of EOS, all ones and less than a byte */
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+
+    *out_len = n;
+    return 0;
+}
+int read_int(const uint8_t** it, const uint8_t* end, unsigned prefix, uint32_t* rc) {
+    uint32_t max = (1u << prefix) - 1, value;
+    unsigned shift = 0;
+    uint8_t b;
+
+    if (*it >= end) {
+        return -1;
+    }
+
+    value = *(*it)++ & max;
+    if (value < max) {
+        *rc = value;
+        return 0;
+    }
+
+    do {
+        if (*it >= end || shift > 21) { /* nothing legitimate is over 2^28 */
+            return -1;
+        }
+        b = *(*it)++;
+        value += (uint32_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    *rc = value;
+    return 0;
+}
+int read_string(hpack_t* hp, const uint8_t** it, const uint8_t* end, const char** str, uint32_t* len) {
+    size_t n;
+    int huffman;
+
+    if (*it >= end) {
+        return -1;
+    }
+
+    huffman = **it & 0x80;
+    if (read_int(it, end, 7, len) || *len > (size_t) (end - *it)) {
+        return -1;
+    }
+
+    if (!huffman) {
+        *str = (const char*) *it;
+        *it += *len;
+        return 0;
+    }
+
+    if (huffman_decode(*it, *len, hp->buf + hp->buf_used, &n)) {
+        return -1;
+    }
+
+    *str = hp->buf + hp->buf_used;
+    hp->buf_used += n;
+    *it += *len;
+    *len = n;
+    return 0;
+}
+int table_get(hpack_t* hp, uint32_t idx, const char** name, uint32_t* name_len, const char** value, uint32_t* value_len) {
+    entry_t* e;
+
+    if (!idx) {
+        return -1;
+    }
+
+    if (idx <= STATIC_ENTRIES) {
+        *name = static_table[idx - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[idx - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+
+    idx -= STATIC_ENTRIES + 1;
+    if (idx >= hp->count) {
+        return -1;
+    }
+
+    e = hp->ring[(hp->head + hp->slots - 1 - idx) % hp->slots];
+    *name = e->data;
+    *name_len = e->name_len;
+    *value = e->data + e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+entry_t* table_add(hpack_t* hp, const char* name, uint32_t name_len, const char* value, uint32_t value_len) {
+    uint64_t size;
+    entry_t* e;
+
+    size = (uint64_t) name_len + value_len + ENTRY_OVERHEAD;
+    if (size > hp->max_size) {
+        return NULL;
+    }
+
+    e = malloc(sizeof(entry_t) + name_len + value_len);
+    e->name_len = name_len;
+    e->value_len = value_len;
+    memcpy(e->data, name, name_len);
+    memcpy(e->data + name_len, value, value_len);
+
+    table_evict(hp, hp->max_size - size);
+
+    hp->ring[hp->head] = e;
+    hp->head = (hp->head + 1) % hp->slots;
+    hp->count++;
+    hp->size += size;
+    return e;
+}
+void table_evict(hpack_t* hp, uint32_t size) {
+    entry_t* e;
+    uint32_t oldest;
+
+    while (hp->count && hp->size > size) {
+        oldest = (hp->head + hp->slots - hp->count) % hp->slots;
+        e = hp->ring[oldest];
+        hp->ring[oldest] = NULL;
+        hp->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+        hp->count--;
+        free(e);
+    }
+}
+void write_int(evbuffer_t* out, uint8_t flags, unsigned prefix, uint32_t value) {
+    uint8_t buf[8];
+    uint32_t max = (1u << prefix) - 1;
+    int n = 0;
+
+    if (value < max) {
+        buf[n++] = flags | value;
+    } else {
+        buf[n++] = flags | max;
+        value -= max;
+        while (value >= 0x80) {
+            buf[n++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        buf[n++] = value;
+    }
+
+    evbuffer_add(out, buf, n);
+}
+int static_name(const char* name, uint32_t len) {
+    for (int i = 0; i < STATIC_ENTRIES; i++) {
+        if (!strncasecmp(static_table[i].name, name, len) && !static_table[i].name[len]) {
+            return i + 1; /* the first entry of a name has an empty value or is a pseudo header */
+        }
+    }
+
+    return 0;
+}
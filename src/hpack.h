@@ -0,0 +1,33 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include "evbuffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ HPACK header compression (RFC 7541). The decoder keeps the dynamic table of
+ the peer's header blocks and hands every decoded field to a callback, names
+ and values are only valid during the call. The encoder never adds to the
+ dynamic table, fields are written as static table references or as literals
+ without indexing, so it keeps no state and replies can be encoded in any
+ order. A decoder belongs to a single connection and is not locked.
+ */
+typedef struct hpack_s hpack_t;
+
+typedef void (*hp_field_cb_t)(void* data, const char* name, uint32_t name_len,
+                              const char* value, uint32_t value_len);
+
+/* The table size is the one announced to the peer, 4096 unless changed */
+hpack_t* hp_alloc(uint32_t table_size);
+void hp_free(hpack_t* hp);
+/* Decodes a complete header block, returns -1 on a compression error */
+int hp_decode(hpack_t* hp, const uint8_t* in, size_t len, hp_field_cb_t cb, void* data);
+
+/* Append a field to a header block, names are lowercased */
+void hp_encode(evbuffer_t* out, const char* name, uint32_t name_len,
+               const char* value, uint32_t value_len);
+void hp_encode_status(evbuffer_t* out, int status);
+
+#endif /* HPACK_H */
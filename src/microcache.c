@@ -0,0 +1,253 @@
+#include "microcache.h"
+#include "hashmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct centry_s {
+    mc_entry_t entry; /* first, the public part stands for the entry */
+    struct centry_s* prev,* next; /* most recently used first */
+    char* key;
+    uint64_t expires;
+    uint32_t refs; /* the cache and every reply holding the body */
+    size_t size; /* counted against the cache */
+    char data[]; /* key, head and body */
+} centry_t;
+
+struct mc_fill_s {
+    char* key;
+    mc_waiter_t* waiters;
+};
+
+struct microcache_s {
+    uint32_t ttl;
+    hashmap_t* entries;
+    hashmap_t* fills;
+    centry_t* head,* tail;
+    size_t size;
+    size_t used;
+};
+
+static void entry_unlink(microcache_t* mc, centry_t* e);
+static void entry_unref(centry_t* e);
+static void entry_released(const void* data, size_t len, void* extra);
+static int free_fill(const void* key, void* value, void* context);
+
+microcache_t* mc_alloc(uint32_t ttl, size_t size) {
+    microcache_t* rc;
+
+    rc = calloc(1, sizeof(microcache_t));
+    rc->ttl = ttl;
+    rc->size = size;
+    rc->entries = hm_alloc(64, NULL, NULL);
+    rc->fills = hm_alloc(16, NULL, NULL);
+    return rc;
+}
+void mc_free(microcache_t* mc) {
+    if (!mc) {
+        return;
+    }
+
+    /* replies still holding a body free it once they are done */
+    while (mc->head) {
+        entry_unlink(mc, mc->head);
+    }
+
+    hm_foreach(mc->fills, free_fill, NULL);
+    hm_free(mc->fills);
+    hm_free(mc->entries);
+    free(mc);
+}
+int mc_lookup(microcache_t* mc, const char* key, uint64_t now, mc_entry_t** entry, mc_fill_t** fill) {
+    centry_t* e;
+
+    e = hm_get(mc->entries, key);
+    if (e && e->expires <= now) {
+        entry_unlink(mc, e);
+        e = NULL;
+    }
+
+    if (e) {
+        /* to the front of the line */
+        if (e != mc->head) {
+            e->prev->next = e->next;
+            if (e->next) {
+                e->next->prev = e->prev;
+            } else {
+                mc->tail = e->prev;
+            }
+            e->prev = NULL;
+            e->next = mc->head;
+            mc->head->prev = e;
+            mc->head = e;
+        }
+
+        *entry = &e->entry;
+        return MC_HIT;
+    }
+
+    *fill = hm_get(mc->fills, key);
+    if (*fill) {
+        return MC_WAIT;
+    }
+
+    *fill = calloc(1, sizeof(mc_fill_t));
+    (*fill)->key = strdup(key);
+    hm_put(mc->fills, (*fill)->key, *fill);
+    return MC_FILL;
+}
+void mc_wait(mc_fill_t* fill, mc_waiter_t* w, void* data) {
+    w->fill = fill;
+    w->data = data;
+    w->prev = NULL;
+    w->next = fill->waiters;
+    if (fill->waiters) {
+        fill->waiters->prev = w;
+    }
+    fill->waiters = w;
+}
+void mc_unwait(mc_waiter_t* w) {
+    if (!w->fill) {
+        return;
+    }
+
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        w->fill->waiters = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    }
+
+    w->fill = NULL;
+}
+mc_entry_t* mc_put(microcache_t* mc, mc_fill_t* fill, const mc_entry_t* reply, evbuffer_t* body, uint64_t now) {
+    centry_t* e,* old;
+    size_t key_len, body_len, size;
+    char* it;
+
+    key_len = strlen(fill->key) + 1;
+    body_len = body ? evbuffer_get_length(body) : 0;
+    size = sizeof(centry_t) + key_len + reply->head_len + body_len;
+    if (size > mc->size) {
+        return NULL;
+    }
+
+    e = malloc(size);
+    e->entry = *reply;
+    e->expires = now + mc->ttl;
+    e->refs = 1;
+    e->size = size;
+
+    it = e->data;
+    e->key = it;
+    memcpy(it, fill->key, key_len);
+    it += key_len;
+    e->entry.head = it;
+    memcpy(it, reply->head, reply->head_len);
+    it += reply->head_len;
+    e->entry.body = it;
+    e->entry.body_len = body_len;
+    if (body_len) {
+        evbuffer_copyout(body, it, body_len);
+    }
+
+    old = hm_get(mc->entries, e->key);
+    if (old) {
+        entry_unlink(mc, old);
+    }
+
+    while (mc->tail && mc->used + size > mc->size) {
+        entry_unlink(mc, mc->tail);
+    }
+
+    hm_put(mc->entries, e->key, e);
+    e->prev = NULL;
+    e->next = mc->head;
+    if (mc->head) {
+        mc->head->prev = e;
+    } else {
+        mc->tail = e;
+    }
+    mc->head = e;
+    mc->used += size;
+
+    return &e->entry;
+}
+void mc_finish(microcache_t* mc, mc_fill_t* fill, mc_entry_t* entry, mc_wake_cb_t cb) {
+    centry_t* e = (centry_t*) entry;
+    mc_waiter_t* w;
+
+    hm_remove(mc->fills, fill->key);
+
+    /* a waiter could drop the entry, it's kept until all of them are done */
+    if (e) {
+        e->refs++;
+    }
+
+    while ((w = fill->waiters)) {
+        mc_unwait(w);
+        cb(w->data, entry);
+    }
+
+    if (e) {
+        entry_unref(e);
+    }
+
+    free(fill->key);
+    free(fill);
+}
+int mc_add_body(mc_entry_t* entry, evbuffer_t* out) {
+    centry_t* e = (centry_t*) entry;
+
+    if (!entry->body_len) {
+        return 0;
+    }
+
+    if (evbuffer_add_reference(out, entry->body, entry->body_len, entry_released, e)) {
+        return -1;
+    }
+
+    e->refs++;
+    return 0;
+}
+void entry_unlink(microcache_t* mc, centry_t* e) {
+    hm_remove(mc->entries, e->key);
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        mc->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        mc->tail = e->prev;
+    }
+
+    mc->used -= e->size;
+    entry_unref(e);
+}
+void entry_unref(centry_t* e) {
+    if (--e->refs) {
+        return;
+    }
+
+    free(e);
+}
+void entry_released(const void* data, size_t len, void* extra) {
+    entry_unref(extra);
+}
+int free_fill(const void* key, void* value, void* context) {
+    mc_fill_t* fill = value;
+
+    /* nobody is left to finish it, the waiters are gone with their loop */
+    while (fill->waiters) {
+        mc_unwait(fill->waiters);
+    }
+
+    free(fill->key);
+    free(fill);
+    return 1;
+}
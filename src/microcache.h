@@ -0,0 +1,67 @@
+#ifndef MICROCACHE_H
+#define MICROCACHE_H
+
+#include "evbuffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Short lived cache of route replies. Replies are kept by a key the caller
+ makes of the request for ttl milliseconds, the least recently used ones are
+ dropped past the size of the cache. Bodies are added to replies by
+ reference, the memory goes once the cache and the last reply let go of it.
+ A miss starts a fill: the first request runs the route, the ones with the
+ same key that come meanwhile wait on the fill and get the reply it leaves in
+ the cache. A cache belongs to a single loop and is not locked.
+ */
+typedef struct microcache_s microcache_t;
+typedef struct mc_fill_s mc_fill_t;
+
+/* Read only outside microcache.c */
+typedef struct mc_entry_s {
+    int status;
+    int encoding; /* content coding of the body */
+    int vary; /* the coding depends on Accept-Encoding */
+    const char* head; /* header lines, each ends with CRLF */
+    uint32_t head_len;
+    const char* body;
+    size_t body_len;
+} mc_entry_t;
+
+/* Embedded in whatever waits for a fill, fill is set while it does */
+typedef struct mc_waiter_s {
+    struct mc_waiter_s* prev,* next;
+    mc_fill_t* fill;
+    void* data;
+} mc_waiter_t;
+
+/* Called for every waiter of a fill, entry is NULL when nothing was kept */
+typedef void (*mc_wake_cb_t) (void* data, mc_entry_t* entry);
+
+#define MC_HIT 0 /* the entry is fresh */
+#define MC_FILL 1 /* a new fill, the caller runs the route and finishes it */
+#define MC_WAIT 2 /* another request fills it, wait on the fill */
+
+/* ttl is in ms, size in bytes of keys, headers and bodies */
+microcache_t* mc_alloc(uint32_t ttl, size_t size);
+void mc_free(microcache_t* mc);
+/*
+ now is the loop time in ms. Sets entry on a hit, it's good until the cache
+ is used again, and fill otherwise.
+ */
+int mc_lookup(microcache_t* mc, const char* key, uint64_t now, mc_entry_t** entry, mc_fill_t** fill);
+void mc_wait(mc_fill_t* fill, mc_waiter_t* w, void* data);
+void mc_unwait(mc_waiter_t* w);
+/*
+ Keeps the reply under the key of the fill, status, encoding, vary and the
+ head are taken from reply and the body is copied. Returns the new entry or
+ NULL if it's larger than the whole cache.
+ */
+mc_entry_t* mc_put(microcache_t* mc, mc_fill_t* fill, const mc_entry_t* reply, evbuffer_t* body, uint64_t now);
+/* Hands entry, which may be NULL, to the waiters and frees the fill */
+void mc_finish(microcache_t* mc, mc_fill_t* fill, mc_entry_t* entry, mc_wake_cb_t cb);
+/* Adds the body to out by reference, returns -1 on error */
+int mc_add_body(mc_entry_t* entry, evbuffer_t* out);
+
+#endif /* MICROCACHE_H */
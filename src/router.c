@@ -0,0 +1,332 @@
+#include "router.h"
+#include "schema.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct handler_s {
+    int method;
+    schema_t* sh;
+} handler_t;
+
+typedef struct node_s {
+    char* prefix; /* static label, empty for capture nodes */
+    uint32_t len;
+    uint32_t nchildren;
+    char* firsts; /* first byte of each static child, built on freeze */
+    struct node_s** children;
+    struct node_s* param; /* ':' capture of one segment */
+    struct node_s* rest; /* '*' capture of the remaining path */
+    uint32_t nhandlers;
+    handler_t* handlers;
+} node_t;
+
+struct router_s {
+    node_t* root;
+    unsigned frozen:1;
+};
+
+static node_t* node_alloc(const char* prefix, uint32_t len);
+static void node_free(node_t* n);
+static void node_freeze(node_t* n);
+static void node_foreach(node_t* n, void (*cb)(schema_t* sh, void* user_data), void* user_data);
+static node_t* node_add_static(node_t* n, const char* s, uint32_t len);
+static schema_t* node_handler(node_t* n, int method, uint64_t* allow);
+static node_t* node_match(node_t* n, int method, const char* path, uint32_t off, uint32_t len, rt_capture_t* caps, uint32_t depth, uint32_t* ncaps, uint64_t* allow);
+
+router_t* rt_alloc() {
+    router_t* rc;
+
+    rc = calloc(1, sizeof(router_t));
+    rc->root = node_alloc("", 0);
+    return rc;
+}
+void rt_free(router_t* rt) {
+    if (!rt) {
+        return;
+    }
+
+    node_free(rt->root);
+    free(rt);
+}
+int rt_add(router_t* rt, int method, const char* path, schema_t* sh) {
+    const char* it,* end;
+    uint32_t ncaps = 0;
+    node_t* n;
+
+    lassert(!rt->frozen);
+    lassert(path[0] == '/');
+
+    /* the whole path is checked before the tree is touched */
+    for (it = path; *it; it = end) {
+        end = it + 1;
+        if (*it != ':' && *it != '*') {
+            continue;
+        }
+
+        if (it[-1] != '/') {
+            ELOG("Capture must start a segment in '%s'", path);
+            return -1;
+        }
+
+        while (*end && *end != '/') end++;
+
+        if (end == it + 1) {
+            ELOG("Unnamed capture in '%s'", path);
+            return -1;
+        }
+        if (*it == '*' && *end) {
+            ELOG("Rest capture must be the last segment in '%s'", path);
+            return -1;
+        }
+        if (ncaps == RT_MAX_CAPTURES) {
+            ELOG("Too many captures in '%s'", path);
+            return -1;
+        }
+        if (sh_bind_capture(sh, it + 1, end - it - 1)) {
+            ELOG("Capture '%.*s' is not in the schema of '%s'", (int) (end - it - 1), it + 1, path);
+            return -1;
+        }
+
+        ncaps++;
+    }
+
+    /* a duplicate only walks nodes that exist already */
+    n = rt->root;
+    for (it = path; *it; it = end) {
+        if (*it == ':' || *it == '*') {
+            end = it + 1;
+            while (*end && *end != '/') end++;
+
+            if (*it == ':') {
+                if (!n->param) {
+                    n->param = node_alloc("", 0);
+                }
+                n = n->param;
+            } else {
+                if (!n->rest) {
+                    n->rest = node_alloc("", 0);
+                }
+                n = n->rest;
+            }
+        } else {
+            end = it;
+            while (*end && *end != ':' && *end != '*') end++;
+
+            n = node_add_static(n, it, end - it);
+        }
+    }
+
+    for (uint32_t i = 0; i < n->nhandlers; i++) {
+        if (n->handlers[i].method == method) {
+            ELOG("Route '%s' already exists", path);
+            return -1;
+        }
+    }
+
+    n->handlers = realloc(n->handlers, (n->nhandlers + 1) * sizeof(handler_t));
+    n->handlers[n->nhandlers].method = method;
+    n->handlers[n->nhandlers].sh = sh;
+    n->nhandlers++;
+    return 0;
+}
+void rt_freeze(router_t* rt) {
+    if (rt->frozen) {
+        return;
+    }
+
+    node_freeze(rt->root);
+    rt->frozen = 1;
+}
+void rt_foreach(router_t* rt, void (*cb)(schema_t* sh, void* user_data), void* user_data) {
+    node_foreach(rt->root, cb, user_data);
+}
+schema_t* rt_find(router_t* rt, int method, const char* path, uint32_t len, rt_capture_t* caps, uint32_t* ncaps, uint64_t* allow) {
+    node_t* n;
+
+    lassert(rt->frozen);
+
+    *ncaps = 0;
+    *allow = 0;
+    n = node_match(rt->root, method, path, 0, len, caps, 0, ncaps, allow);
+    return n ? node_handler(n, method, NULL) : NULL;
+}
+
+node_t* node_alloc(const char* prefix, uint32_t len) {
+    node_t* rc;
+
+    rc = calloc(1, sizeof(node_t));
+    rc->prefix = strndup(prefix, len);
+    rc->len = len;
+    return rc;
+}
+void node_free(node_t* n) {
+    if (!n) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < n->nchildren; i++) {
+        node_free(n->children[i]);
+    }
+    for (uint32_t i = 0; i < n->nhandlers; i++) {
+        sh_free(n->handlers[i].sh);
+    }
+
+    node_free(n->param);
+    node_free(n->rest);
+    free(n->handlers);
+    free(n->children);
+    free(n->firsts);
+    free(n->prefix);
+    free(n);
+}
+void node_freeze(node_t* n) {
+    if (!n) {
+        return;
+    }
+
+    n->firsts = malloc(n->nchildren + 1);
+    for (uint32_t i = 0; i < n->nchildren; i++) {
+        n->firsts[i] = n->children[i]->prefix[0];
+        node_freeze(n->children[i]);
+    }
+
+    node_freeze(n->param);
+    node_freeze(n->rest);
+}
+void node_foreach(node_t* n, void (*cb)(schema_t* sh, void* user_data), void* user_data) {
+    if (!n) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < n->nhandlers; i++) {
+        cb(n->handlers[i].sh, user_data);
+    }
+    for (uint32_t i = 0; i < n->nchildren; i++) {
+        node_foreach(n->children[i], cb, user_data);
+    }
+
+    node_foreach(n->param, cb, user_data);
+    node_foreach(n->rest, cb, user_data);
+}
+node_t* node_add_static(node_t* n, const char* s, uint32_t len) {
+    node_t* child,* mid;
+    uint32_t common, i;
+
+    while (len) {
+        child = NULL;
+        for (i = 0; i < n->nchildren; i++) {
+            if (n->children[i]->prefix[0] == s[0]) {
+                child = n->children[i];
+                break;
+            }
+        }
+
+        if (!child) {
+            child = node_alloc(s, len);
+            n->children = realloc(n->children, (n->nchildren + 1) * sizeof(node_t*));
+            n->children[n->nchildren++] = child;
+            return child;
+        }
+
+        common = 0;
+        while (common < child->len && common < len && child->prefix[common] == s[common]) {
+            common++;
+        }
+
+        if (common < child->len) { /* split the edge */
+            mid = node_alloc(child->prefix, common);
+            mid->children = malloc(sizeof(node_t*));
+            mid->children[0] = child;
+            mid->nchildren = 1;
+
+            child->len -= common;
+            memmove(child->prefix, child->prefix + common, child->len + 1);
+
+            n->children[i] = mid;
+            child = mid;
+        }
+
+        n = child;
+        s += common;
+        len -= common;
+    }
+
+    return n;
+}
+schema_t* node_handler(node_t* n, int method, uint64_t* allow) {
+    schema_t* any = NULL;
+
+    for (uint32_t i = 0; i < n->nhandlers; i++) {
+        if (n->handlers[i].method == method) {
+            return n->handlers[i].sh;
+        }
+        if (n->handlers[i].method == RT_ANY_METHOD) {
+            any = n->handlers[i].sh;
+        }
+    }
+
+    /* the path is routed for other methods only */
+    if (!any && allow) {
+        for (uint32_t i = 0; i < n->nhandlers; i++) {
+            *allow |= 1ULL << n->handlers[i].method;
+        }
+    }
+
+    return any;
+}
+node_t* node_match(node_t* n, int method, const char* path, uint32_t off, uint32_t len, rt_capture_t* caps, uint32_t depth, uint32_t* ncaps, uint64_t* allow) {
+    node_t* child,* rc;
+    const char* sep;
+    uint32_t seg;
+
+    if (off == len) {
+        if (node_handler(n, method, allow)) {
+            *ncaps = depth;
+            return n;
+        }
+        /* the rest capture may be empty, a trailing slash matches it */
+        if (n->rest && node_handler(n->rest, method, allow)) {
+            caps[depth].offset = off;
+            caps[depth].len = 0;
+            *ncaps = depth + 1;
+            return n->rest;
+        }
+        return NULL;
+    }
+
+    /* static children first, at most one can match */
+    sep = memchr(n->firsts, path[off], n->nchildren);
+    if (sep) {
+        child = n->children[sep - n->firsts];
+        if (child->len <= len - off && !memcmp(child->prefix, path + off, child->len)) {
+            rc = node_match(child, method, path, off + child->len, len, caps, depth, ncaps, allow);
+            if (rc) {
+                return rc;
+            }
+        }
+    }
+
+    if (n->param) {
+        sep = memchr(path + off, '/', len - off);
+        seg = sep ? (uint32_t) (sep - path) - off : len - off;
+        if (seg) {
+            caps[depth].offset = off;
+            caps[depth].len = seg;
+            rc = node_match(n->param, method, path, off + seg, len, caps, depth + 1, ncaps, allow);
+            if (rc) {
+                return rc;
+            }
+        }
+    }
+
+    if (n->rest && node_handler(n->rest, method, allow)) {
+        caps[depth].offset = off;
+        caps[depth].len = len - off;
+        *ncaps = depth + 1;
+        return n->rest;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdint.h>
+
+/*
+ Compressed radix tree mapping a method and a path to a route schema. Path
+ segments starting with ':' capture a single segment, a segment starting with
+ '*' captures the rest of the path, which may be empty, and must be the last
+ one. Static segments win over captures. Captures are returned as they are
+ in the path, parse_arguments percent-decodes them. Routes are added before
+ serving; once frozen the tree is only read, so all loops share it without
+ locking. Lookups do not allocate.
+ */
+#define RT_ANY_METHOD -1
+#define RT_MAX_CAPTURES 16
+
+typedef struct router_s router_t;
+typedef struct schema_s schema_t;
+
+typedef struct rt_capture_s {
+    uint32_t offset; /* from the start of the looked up path */
+    uint32_t len;
+} rt_capture_t;
+
+router_t* rt_alloc();
+/* Frees the routes together with their schemas */
+void rt_free(router_t* rt);
+/*
+ The router takes the ownership of the schema. Captures are bound to the
+ schema arguments of the same name in the order they appear in the path.
+ Returns -1 if the path is malformed, a capture is not in the schema or the
+ method and path are already routed, the tree is left as it was.
+ */
+int rt_add(router_t* rt, int method, const char* path, schema_t* sh);
+void rt_freeze(router_t* rt);
+/* Calls cb with the schema of every route */
+void rt_foreach(router_t* rt, void (*cb)(schema_t* sh, void* user_data), void* user_data);
+/*
+ The path is not required to be zero terminated. caps holds RT_MAX_CAPTURES.
+ When nothing is found, allow has a bit set for every method the path is
+ routed for, 1 << method.
+ */
+schema_t* rt_find(router_t* rt, int method, const char* path, uint32_t len, rt_capture_t* caps, uint32_t* ncaps, uint64_t* allow);
+
+#endif /* ROUTER_H */
@@ -2,8 +2,12 @@
 #include "hashmap.h"
 #include "log.h"
 #include "format.h"
+#include "arena.h"
 
-typedef value_t* (*parse_cb_t) (const char* raw);
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef value_t* (*parse_cb_t) (arena_t* ar, const char* raw);
 
 typedef struct string_list_s {
     uint32_t len;
@@ -45,24 +49,33 @@ typedef struct argument_s {
 
 struct schema_s {
     hashmap_t* args;
+    argument_t** captures; /* in path order */
+    uint32_t ncaptures;
     uint32_t max_index;
     char* path;
     as_route_cb_t cb;
     void* user_data;
+    size_t stack_size;
+    uint32_t index;
+    uint32_t max_inflight;
+    uint32_t cache_ttl;
+    size_t cache_size;
+    int method;
 };
 
 static int free_arguments(const void* key, void* value, void* context);
-static void free_value(value_t* val);
 static int check_arguments(const void* key, void* value, void* context);
-static value_t* parse_flag(const char* raw);
-static value_t* parse_integer(const char* raw);
-static value_t* parse_number(const char* raw);
-static value_t* parse_string(const char* raw);
-static value_t* parse_encoded_string(const char* raw);
-static value_t* parse_integer_list(const char* raw);
-static value_t* parse_number_list(const char* raw);
-static value_t* parse_string_list(const char* raw);
-static value_t* parse_encoded_string_list(const char* raw);
+static int key_printf(char** it, char* end, const char* fmt, ...);
+static int key_string(char** it, char* end, const char* s, uint32_t len);
+static value_t* parse_flag(arena_t* ar, const char* raw);
+static value_t* parse_integer(arena_t* ar, const char* raw);
+static value_t* parse_number(arena_t* ar, const char* raw);
+static value_t* parse_string(arena_t* ar, const char* raw);
+static value_t* parse_encoded_string(arena_t* ar, const char* raw);
+static value_t* parse_integer_list(arena_t* ar, const char* raw);
+static value_t* parse_number_list(arena_t* ar, const char* raw);
+static value_t* parse_string_list(arena_t* ar, const char* raw);
+static value_t* parse_encoded_string_list(arena_t* ar, const char* raw);
 
 static parse_cb_t p_parse_function[] = {
     parse_flag,
@@ -109,15 +122,48 @@ void sh_free(schema_t* s) {
     hm_foreach(s->args, free_arguments, NULL);
     hm_free(s->args);
 
+    free(s->captures);
     free(s->path);
     free(s);
 }
-value_t** sh_parse(schema_t* sh, char* args) {
+int sh_bind_capture(schema_t* sh, const char* key, uint32_t len) {
+    char name[len + 1];
+    argument_t* arg;
+
+    memcpy(name, key, len);
+    name[len] = 0;
+
+    arg = hm_get(sh->args, name);
+    if (!arg) {
+        return -1;
+    }
+
+    sh->captures = realloc(sh->captures, (sh->ncaptures + 1) * sizeof(argument_t*));
+    sh->captures[sh->ncaptures++] = arg;
+    return 0;
+}
+value_t** sh_parse(schema_t* sh, char* args, char** captures, arena_t* ar) {
     char* it,* s,* t;
     value_t** rc,* value;
     argument_t* arg;
 
-    rc = calloc(sh->max_index, sizeof(value_t*));
+    rc = ar_calloc(ar, sh->max_index, sizeof(value_t*));
+
+    /* a capture that doesn't parse as its type fails the request, an empty rest is absent */
+    for (uint32_t i = 0; i < sh->ncaptures; i++) {
+        arg = sh->captures[i];
+        if (!*captures[i]) {
+            continue;
+        }
+
+        value = arg->parse_function(ar, captures[i]);
+        if (!value) {
+            DLOG("Invalid path capture %d", arg->index);
+            return NULL;
+        }
+
+        rc[arg->index] = value;
+    }
 
     if (args) {
         for (it = strtok_r(args, "&", &s); it; it = strtok_r(NULL, "&", &s)) {
@@ -126,37 +172,21 @@ value_t** sh_parse(schema_t* sh, char* args) {
                 continue;
             }
 
-            value = arg->parse_function(strtok_r(NULL, "", &t));
+            value = arg->parse_function(ar, strtok_r(NULL, "", &t));
             if (!value && arg->is_required) {
                 DLOG("Missing required value %d", arg->index);
-                goto fail;
+                return NULL;
             }
 
-            free_value(rc[arg->index]); /* no duplicates! */
-            rc[arg->index] = value;
+            rc[arg->index] = value; /* no duplicates! */
         }
     }
 
     /* check required items */
     if (!hm_foreach(sh->args, check_arguments, rc))
-        goto fail;
+        return NULL; /* the values are reclaimed with the arena */
 
     return rc;
-
-fail:
-    sh_free_values(sh, rc);
-    return NULL;
-}
-void sh_free_values(schema_t* sh, value_t** val) {
-    if (!val) {
-        return;
-    }
-
-    for (uint32_t i = 0; i < sh->max_index; i++) {
-        free_value(val[i]);
-    }
-
-    free(val);
 }
 int sh_call_cb(schema_t* sh) {
     return sh->cb(sh->user_data);
@@ -164,6 +194,99 @@ int sh_call_cb(schema_t* sh) {
 const char* sh_get_path(schema_t* sh) {
     return sh->path;
 }
+void sh_set_stack_size(schema_t* sh, size_t size) {
+    sh->stack_size = size;
+}
+size_t sh_get_stack_size(schema_t* sh) {
+    return sh->stack_size;
+}
+void sh_set_index(schema_t* sh, uint32_t index) {
+    sh->index = index;
+}
+uint32_t sh_get_index(schema_t* sh) {
+    return sh->index;
+}
+void sh_set_max_inflight(schema_t* sh, uint32_t max) {
+    sh->max_inflight = max;
+}
+uint32_t sh_get_max_inflight(schema_t* sh) {
+    return sh->max_inflight;
+}
+void sh_set_method(schema_t* sh, int method) {
+    sh->method = method;
+}
+int sh_get_method(schema_t* sh) {
+    return sh->method;
+}
+void sh_set_cache(schema_t* sh, uint32_t ttl, size_t size) {
+    sh->cache_ttl = ttl;
+    sh->cache_size = size;
+}
+uint32_t sh_get_cache_ttl(schema_t* sh) {
+    return sh->cache_ttl;
+}
+size_t sh_get_cache_size(schema_t* sh) {
+    return sh->cache_size;
+}
+int sh_key(schema_t* sh, value_t** vals, char* dst, uint32_t size) {
+    char* it = dst,* end = dst + size - 1; /* room for the \0 */
+    value_t* v;
+    int err = 0;
+
+    /*
+     Every index in order, whatever the order of the query, with the values as
+     they were parsed: ?a=01&b=x and ?b=x&a=1 make the same key for integers.
+     Strings are prefixed with their length so no value can pass for two.
+     */
+    for (uint32_t i = 0; i < sh->max_index && !err; i++) {
+        v = vals[i];
+        if (!v) {
+            err = key_printf(&it, end, "-");
+            continue;
+        }
+
+        switch (v->type) {
+        case AVT_FLAG:
+            err = key_printf(&it, end, "f%d;", v->value.flag);
+            break;
+        case AVT_INTEGER:
+            err = key_printf(&it, end, "i%llu;", (unsigned long long) v->value.integer);
+            break;
+        case AVT_NUMBER:
+            err = key_printf(&it, end, "n%.17g;", v->value.number);
+            break;
+        case AVT_INTEGER_LIST:
+            err = key_printf(&it, end, "I%u:", v->len);
+            for (uint32_t j = 0; j < v->len && !err; j++) {
+                err = key_printf(&it, end, "%llu;", (unsigned long long) v->value.integer_list[j]);
+            }
+            break;
+        case AVT_NUMBER_LIST:
+            err = key_printf(&it, end, "N%u:", v->len);
+            for (uint32_t j = 0; j < v->len && !err; j++) {
+                err = key_printf(&it, end, "%.17g;", v->value.number_list[j]);
+            }
+            break;
+        case AVT_STRING_LIST:
+            err = key_printf(&it, end, "S%u:", v->len);
+            for (uint32_t j = 0; j < v->len && !err; j++) {
+                err = key_string(&it, end, v->value.string_list[j].string,
+                                 v->value.string_list[j].len);
+            }
+            break;
+        default: /* strings, their length counts the \0 */
+            err = key_string(&it, end, v->value.string, v->len - 1);
+            break;
+        }
+    }
+
+    if (err) {
+        return -1;
+    }
+
+    *it = 0;
+    return it - dst;
+}
 int sh_arg_exists(schema_t* sh, value_t** vals, uint32_t idx) {
     lassert(sh->max_index >= idx);
     return !!vals[idx];
@@ -257,15 +380,6 @@ int free_arguments(const void* key, void* value, void* context) {
     free(value);
     return 1;
 }
-void free_value(value_t* val) {
-    if (!val) {
-        return;
-    }
-
-    if (val->type == AVT_STRING_LIST)
-        free(val->value.string_list);
-    free(val);
-}
 int check_arguments(const void* key, void* value, void* context) {
     value_t** vals;
     argument_t* arg;
@@ -278,7 +392,42 @@ int check_arguments(const void* key, void* value, void* context) {
     }
     return 1;
 }
-value_t* parse_flag(const char* raw) {
+int key_printf(char** it, char* end, const char* fmt, ...) {
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(*it, end - *it + 1, fmt, args);
+    va_end(args);
+
+    if (n < 0 || n > end - *it) {
+        return -1;
+    }
+
+    *it += n;
+    return 0;
+}
+int key_string(char** it, char* end, const char* s, uint32_t len) {
+    if (key_printf(it, end, "s%u:", len)) {
+        return -1;
+    }
+
+    /* a decoded string may hold a \0, the key is a C string */
+    for (uint32_t i = 0; i < len; i++) {
+        if (*it + 2 > end) {
+            return -1;
+        }
+        if (!s[i] || s[i] == '\\') {
+            *(*it)++ = '\\';
+            *(*it)++ = s[i] ? '\\' : '0';
+        } else {
+            *(*it)++ = s[i];
+        }
+    }
+
+    return 0;
+}
+value_t* parse_flag(arena_t* ar, const char* raw) {
     int is = 0, len;
     value_t* rc;
 
@@ -292,13 +441,13 @@ value_t* parse_flag(const char* raw) {
         return NULL;
     }
 
-    rc = malloc(sizeof(value_t));
+    rc = ar_malloc(ar, sizeof(value_t));
     rc->value.flag = is;
     rc->len = 0;
     rc->type = AVT_FLAG;
     return rc;
 }
-value_t* parse_integer(const char* raw) {
+value_t* parse_integer(arena_t* ar, const char* raw) {
     uint64_t i = 0;
     value_t* rc;
     char* end;
@@ -313,13 +462,13 @@ value_t* parse_integer(const char* raw) {
         return NULL;
     }
 
-    rc = malloc(sizeof(value_t));
+    rc = ar_malloc(ar, sizeof(value_t));
     rc->value.integer = i;
     rc->len = 0;
     rc->type = AVT_INTEGER;
     return rc;
 }
-value_t* parse_number(const char* raw) {
+value_t* parse_number(arena_t* ar, const char* raw) {
     double n = 0;
     value_t* rc;
     char* end;
@@ -334,13 +483,13 @@ value_t* parse_number(const char* raw) {
         return NULL;
     }
 
-    rc = malloc(sizeof(value_t));
+    rc = ar_malloc(ar, sizeof(value_t));
     rc->value.number = n;
     rc->len = 0;
     rc->type = AVT_NUMBER;
     return rc;
 }
-value_t* parse_string(const char* raw) {
+value_t* parse_string(arena_t* ar, const char* raw) {
     int len;
     value_t* rc;
 
@@ -350,13 +499,13 @@ value_t* parse_string(const char* raw) {
 
     len ++; /* \0 */
 
-    rc = malloc(sizeof(value_t) + len);
+    rc = ar_malloc(ar, sizeof(value_t) + len);
     rc->len = len;
     rc->type = AVT_STRING;
     memcpy(rc->value.string, raw, len);
     return rc;
 }
-value_t* parse_encoded_string(const char* raw) {
+value_t* parse_encoded_string(arena_t* ar, const char* raw) {
     int len;
     value_t* rc;
 
@@ -366,13 +515,13 @@ value_t* parse_encoded_string(const char* raw) {
 
     len = base64_decoded_len(raw, len) + 1;
 
-    rc = malloc(sizeof(value_t) + len);
+    rc = ar_malloc(ar, sizeof(value_t) + len);
     rc->len = len;
     rc->type = AVT_STRING;
     from_base64(raw, rc->value.string);
     return rc;
 }
-value_t* parse_integer_list(const char* raw) {
+value_t* parse_integer_list(arena_t* ar, const char* raw) {
     int len, total = 0;
     value_t* rc;
     uint64_t i[4096];
@@ -393,13 +542,13 @@ value_t* parse_integer_list(const char* raw) {
         r = end;
     } while (r && *(r++));
 
-    rc = malloc(sizeof(value_t) + (total * sizeof(uint64_t)));
+    rc = ar_malloc(ar, sizeof(value_t) + (total * sizeof(uint64_t)));
     rc->len = total;
     rc->type = AVT_INTEGER_LIST;
     memcpy(rc->value.integer_list, i, total * sizeof(uint64_t));
     return rc;
 }
-value_t* parse_number_list(const char* raw) {
+value_t* parse_number_list(arena_t* ar, const char* raw) {
     int len, total = 0;
     value_t* rc;
     double n[4096];
@@ -420,13 +569,13 @@ value_t* parse_number_list(const char* raw) {
         r = end;
     } while (r && *(r++));
 
-    rc = malloc(sizeof(value_t) + (total * sizeof(double)));
+    rc = ar_malloc(ar, sizeof(value_t) + (total * sizeof(double)));
     rc->len = total;
     rc->type = AVT_NUMBER_LIST;
     memcpy(rc->value.number_list, n, total * sizeof(double));
     return rc;
 }
-value_t* parse_string_list(const char* raw) {
+value_t* parse_string_list(arena_t* ar, const char* raw) {
     int len, total = 0, count = 0;
     value_t* rc;
     char dec[8192];
@@ -459,10 +608,10 @@ value_t* parse_string_list(const char* raw) {
         return NULL;
     }
 
-    rc = malloc(sizeof(value_t) + total);
+    rc = ar_malloc(ar, sizeof(value_t) + total);
     rc->len = count;
     rc->type = AVT_STRING_LIST;
-    rc->value.string_list = malloc(sizeof(string_list_t) * count);
+    rc->value.string_list = ar_malloc(ar, sizeof(string_list_t) * count);
     memcpy(rc->value.__container, dec, total);
 
     rc->value.string_list[0].len = lens[0];
@@ -476,7 +625,7 @@ value_t* parse_string_list(const char* raw) {
 
     return rc;
 }
-value_t* parse_encoded_string_list(const char* raw) {
+value_t* parse_encoded_string_list(arena_t* ar, const char* raw) {
     int len, total = 0, count = 0;
     value_t* rc;
     char dec[8192];
@@ -506,10 +655,10 @@ value_t* parse_encoded_string_list(const char* raw) {
         return NULL;
     }
 
-    rc = malloc(sizeof(value_t) + total);
+    rc = ar_malloc(ar, sizeof(value_t) + total);
     rc->len = count;
     rc->type = AVT_STRING_LIST;
-    rc->value.string_list = malloc(sizeof(string_list_t) * count);
+    rc->value.string_list = ar_malloc(ar, sizeof(string_list_t) * count);
     memcpy(rc->value.__container, dec, total);
 
     rc->value.string_list[0].len = lens[0];
@@ -8,14 +8,41 @@
 
 typedef struct schema_s schema_t;
 typedef struct value_s value_t;
+typedef struct arena_s arena_t;
 
 schema_t* sh_alloc(const char* path, const appster_schema_entry_t* entries, as_route_cb_t cb, void* user_data);
 void sh_free(schema_t* s);
 
-value_t** sh_parse(schema_t* sh, char* args);
-void sh_free_values(schema_t* sh, value_t** val);
+/* Bind the next path capture to the argument with the given key */
+int sh_bind_capture(schema_t* sh, const char* key, uint32_t len);
+/*
+ Values are allocated from the arena and live until the arena is reset. The
+ captures array holds a zero terminated string for every bound capture.
+ */
+value_t** sh_parse(schema_t* sh, char* args, char** captures, arena_t* ar);
 int sh_call_cb(schema_t* sh);
 const char* sh_get_path(schema_t* sh);
+/* Stack size of the route coroutine, 0 is the default size */
+void sh_set_stack_size(schema_t* sh, size_t size);
+size_t sh_get_stack_size(schema_t* sh);
+/* Index of the route in the per loop state, assigned on serve */
+void sh_set_index(schema_t* sh, uint32_t index);
+uint32_t sh_get_index(schema_t* sh);
+/* Running coroutines of the route per loop, 0 is no limit */
+void sh_set_max_inflight(schema_t* sh, uint32_t max);
+uint32_t sh_get_max_inflight(schema_t* sh);
+/* Method of the route, RT_ANY_METHOD when it serves every method */
+void sh_set_method(schema_t* sh, int method);
+int sh_get_method(schema_t* sh);
+/* Reply cache of the route per loop, ttl in ms, 0 is no cache */
+void sh_set_cache(schema_t* sh, uint32_t ttl, size_t size);
+uint32_t sh_get_cache_ttl(schema_t* sh);
+size_t sh_get_cache_size(schema_t* sh);
+/*
+ Writes a key of the parsed values to dst, the same for requests that parse
+ to the same values. Returns its length or -1 if it does not fit in size.
+ */
+int sh_key(schema_t* sh, value_t** vals, char* dst, uint32_t size);
 
 int sh_arg_exists(schema_t* sh, value_t** vals, uint32_t idx);
 int sh_arg_flag(schema_t* sh, value_t** vals, uint32_t idx);
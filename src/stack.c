@@ -0,0 +1,279 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE /* MAP_STACK, MAP_HUGETLB */
+#endif
+
+#include "stack.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define STACK_PREFAULT (16 * 1024) /* touched top of a new stack */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct slab_s {
+    struct slab_s* next;
+    char* mem; /* huge pages the stacks are carved from */
+    size_t len;
+    size_t size; /* of its stacks */
+    size_t used; /* carved so far, from the bottom */
+    unsigned stacks; /* in use or pooled, the last one unmaps the slab */
+} slab_t;
+
+typedef struct size_class_s {
+    size_t size;
+    unsigned count;
+    cstack_t* free;
+} size_class_t;
+
+struct stack_pool_s {
+    size_class_t* classes;
+    unsigned nclasses;
+    unsigned keep;
+    size_t page;
+    uint64_t hits;
+    uint64_t misses;
+    slab_t* slabs;
+    unsigned hugepages:1;
+    unsigned hugetlb:1; /* huge pages are reserved, stacks are carved from them */
+};
+
+static size_class_t* size_class(stack_pool_t* sp, size_t size);
+static cstack_t* stack_map(stack_pool_t* sp, size_class_t* sc);
+static cstack_t* stack_carve(stack_pool_t* sp, size_class_t* sc);
+static cstack_t* stack_new(char* mem, size_t size, slab_t* slab);
+static void stack_unmap(stack_pool_t* sp, cstack_t* st);
+static void slab_release(stack_pool_t* sp, slab_t* slab);
+
+stack_pool_t* sp_alloc(unsigned keep, int hugepages) {
+    stack_pool_t* rc;
+
+    rc = calloc(1, sizeof(stack_pool_t));
+    rc->keep = keep;
+    rc->hugepages = !!hugepages;
+#ifndef STACK_GUARD /* a guard page can't be cut out of a huge page */
+    rc->hugetlb = !!hugepages;
+#endif
+    rc->page = sysconf(_SC_PAGESIZE);
+    return rc;
+}
+void sp_free(stack_pool_t* sp) {
+    cstack_t* st;
+    slab_t* slab;
+
+    if (!sp) {
+        return;
+    }
+
+    for (unsigned i = 0; i < sp->nclasses; i++) {
+        while ((st = sp->classes[i].free)) {
+            sp->classes[i].free = st->next;
+            stack_unmap(sp, st);
+        }
+    }
+
+    /* slabs with stacks still in use go as well, nothing runs on them anymore */
+    while ((slab = sp->slabs)) {
+        sp->slabs = slab->next;
+        munmap(slab->mem, slab->len);
+        free(slab);
+    }
+
+    free(sp->classes);
+    free(sp);
+}
+void sp_reserve(stack_pool_t* sp, size_t size, unsigned count) {
+    size_class_t* sc;
+    cstack_t* st;
+
+    sc = size_class(sp, size);
+
+    while (sc->count < count && sc->count < sp->keep) {
+        st = stack_map(sp, sc);
+        if (!st) {
+            return;
+        }
+
+        st->next = sc->free;
+        sc->free = st;
+        sc->count++;
+    }
+}
+cstack_t* sp_get(stack_pool_t* sp, size_t size) {
+    size_class_t* sc;
+    cstack_t* st;
+
+    sc = size_class(sp, size);
+
+    if (sc->free) {
+        st = sc->free;
+        sc->free = st->next;
+        sc->count--;
+        sp->hits++;
+        return st;
+    }
+
+    sp->misses++;
+    return stack_map(sp, sc);
+}
+void sp_put(stack_pool_t* sp, cstack_t* st) {
+    size_class_t* sc;
+
+    if (!st) {
+        return;
+    }
+
+    sc = size_class(sp, st->size);
+
+    if (sc->count >= sp->keep) {
+        stack_unmap(sp, st);
+        return;
+    }
+
+    st->next = sc->free;
+    sc->free = st;
+    sc->count++;
+}
+void sp_stats(stack_pool_t* sp, uint64_t* hits, uint64_t* misses) {
+    *hits = sp ? sp->hits : 0;
+    *misses = sp ? sp->misses : 0;
+}
+
+size_class_t* size_class(stack_pool_t* sp, size_t size) {
+    size = (size + sp->page - 1) & ~(sp->page - 1);
+
+    /* routes use a handful of sizes at most */
+    for (unsigned i = 0; i < sp->nclasses; i++) {
+        if (sp->classes[i].size == size) {
+            return &sp->classes[i];
+        }
+    }
+
+    sp->classes = realloc(sp->classes, (sp->nclasses + 1) * sizeof(size_class_t));
+    memset(&sp->classes[sp->nclasses], 0, sizeof(size_class_t));
+    sp->classes[sp->nclasses].size = size;
+    return &sp->classes[sp->nclasses++];
+}
+cstack_t* stack_map(stack_pool_t* sp, size_class_t* sc) {
+    size_t len, guard = 0;
+    char* mem;
+
+    if (sp->hugetlb) {
+        return stack_carve(sp, sc);
+    }
+
+#ifdef STACK_GUARD
+    guard = sp->page;
+#endif
+
+    len = sc->size + guard;
+
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED) {
+        ELOG("Failed to map a stack of %zu bytes", len);
+        return NULL;
+    }
+
+    if (sp->hugepages) { /* transparent huge pages, if enabled at all */
+        madvise(mem, len, MADV_HUGEPAGE);
+    }
+
+#ifdef STACK_GUARD
+    if (mprotect(mem, guard, PROT_NONE)) {
+        ELOG("Failed to protect the stack guard page");
+    }
+#endif
+
+    return stack_new(mem + guard, sc->size, NULL);
+}
+cstack_t* stack_carve(stack_pool_t* sp, size_class_t* sc) {
+    cstack_t* st;
+    slab_t* slab;
+    size_t len;
+    char* mem;
+
+    /*
+     Stacks are much smaller than a huge page, they are cut one at a time from
+     a mapping of whole huge pages until it's full. The room of a stack
+     dropped past the pool size is only back once the whole slab is.
+     */
+    for (slab = sp->slabs; slab; slab = slab->next) {
+        if (slab->size == sc->size && slab->len - slab->used >= sc->size) {
+            break;
+        }
+    }
+
+    if (!slab) {
+        len = (sc->size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_HUGETLB, -1, 0);
+        if (mem == MAP_FAILED) {
+            ELOG("No huge pages for the stacks, asking for transparent huge pages instead");
+            sp->hugetlb = 0;
+            return stack_map(sp, sc);
+        }
+
+        slab = malloc(sizeof(slab_t));
+        slab->mem = mem;
+        slab->len = len;
+        slab->size = sc->size;
+        slab->used = 0;
+        slab->stacks = 0;
+        slab->next = sp->slabs;
+        sp->slabs = slab;
+    }
+
+    st = stack_new(slab->mem + slab->used, sc->size, slab);
+    slab->used += sc->size;
+    return st;
+}
+cstack_t* stack_new(char* mem, size_t size, slab_t* slab) {
+    cstack_t* rc;
+    size_t touch;
+
+    /* stacks grow down, the coroutine starts at the top */
+    touch = size < STACK_PREFAULT ? size : STACK_PREFAULT;
+    memset(mem + size - touch, 0, touch);
+
+    rc = malloc(sizeof(cstack_t));
+    rc->next = NULL;
+    rc->mem = mem;
+    rc->size = size;
+    rc->slab = slab;
+    if (slab) {
+        slab->stacks++;
+    }
+    return rc;
+}
+void stack_unmap(stack_pool_t* sp, cstack_t* st) {
+    size_t guard = 0;
+
+    if (st->slab) { /* the huge pages go with the last stack cut from them */
+        slab_release(sp, st->slab);
+        free(st);
+        return;
+    }
+
+#ifdef STACK_GUARD
+    guard = sp->page;
+#endif
+
+    munmap((char*) st->mem - guard, st->size + guard);
+    free(st);
+}
+void slab_release(stack_pool_t* sp, slab_t* slab) {
+    slab_t** it;
+
+    if (--slab->stacks) {
+        return;
+    }
+
+    for (it = &sp->slabs; *it != slab; it = &(*it)->next);
+    *it = slab->next;
+
+    munmap(slab->mem, slab->len);
+    free(slab);
+}
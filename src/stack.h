@@ -0,0 +1,38 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Pool of coroutine stacks. Stacks are mapped with mmap and their top is
+ touched up front so a request does not fault on its first calls. Released
+ stacks are kept per size and handed out again. With hugepages the stacks are
+ cut from huge page mappings that are unmapped once none of their stacks is
+ in use or pooled, or get transparent huge pages when none are reserved. With STACK_GUARD defined
+ (debug builds) the lowest page of every stack is inaccessible so an overflow
+ faults right away instead of corrupting memory, huge pages are not cut then.
+ A pool belongs to a single loop and is not locked.
+ */
+typedef struct stack_pool_s stack_pool_t;
+
+struct slab_s;
+
+typedef struct cstack_s {
+    struct cstack_s* next;
+    void* mem; /* usable memory, above the guard page */
+    size_t size;
+    struct slab_s* slab; /* huge page mapping it's cut from, NULL if mapped alone */
+} cstack_t;
+
+/* Up to keep stacks of every size are pooled */
+stack_pool_t* sp_alloc(unsigned keep, int hugepages);
+void sp_free(stack_pool_t* sp);
+/* Map count stacks of the size ahead of time */
+void sp_reserve(stack_pool_t* sp, size_t size, unsigned count);
+/* Returns NULL if the stack can't be mapped */
+cstack_t* sp_get(stack_pool_t* sp, size_t size);
+void sp_put(stack_pool_t* sp, cstack_t* st);
+void sp_stats(stack_pool_t* sp, uint64_t* hits, uint64_t* misses);
+
+#endif /* STACK_H */
@@ -0,0 +1,280 @@
+#include "uring.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring_s {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_flags;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned sq_queued; /* local tail, published on submit */
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    unsigned* cq_overflow;
+    unsigned cq_dropped; /* last seen overflow count */
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring; /* same as sq_ring with a single mapping */
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static struct io_uring_sqe* ring_sqe(uring_t* ur);
+static int ring_setup(unsigned entries, struct io_uring_params* p);
+static int ring_enter(uring_t* ur, unsigned to_submit, unsigned flags);
+
+uring_t* ur_alloc(unsigned entries) {
+    struct io_uring_params p;
+    uring_t* rc;
+    char* sq,* cq;
+
+    rc = calloc(1, sizeof(uring_t));
+
+    rc->fd = ring_setup(entries, &p);
+    if (rc->fd < 0) {
+        ELOG("Failed to set up io_uring %s", strerror(errno));
+        free(rc);
+        return NULL;
+    }
+
+    rc->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    rc->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (rc->cq_ring_size > rc->sq_ring_size) {
+            rc->sq_ring_size = rc->cq_ring_size;
+        }
+        rc->cq_ring_size = rc->sq_ring_size;
+    }
+
+    rc->sq_ring = mmap(NULL, rc->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, rc->fd, IORING_OFF_SQ_RING);
+    if (rc->sq_ring == MAP_FAILED) {
+        rc->sq_ring = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        rc->cq_ring = rc->sq_ring;
+    } else {
+        rc->cq_ring = mmap(NULL, rc->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, rc->fd, IORING_OFF_CQ_RING);
+        if (rc->cq_ring == MAP_FAILED) {
+            rc->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    rc->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    rc->sqes = mmap(NULL, rc->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, rc->fd, IORING_OFF_SQES);
+    if (rc->sqes == MAP_FAILED) {
+        rc->sqes = NULL;
+        goto fail;
+    }
+
+    sq = rc->sq_ring;
+    cq = rc->cq_ring;
+    rc->sq_head = (unsigned*) (sq + p.sq_off.head);
+    rc->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    rc->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    rc->sq_flags = (unsigned*) (sq + p.sq_off.flags);
+    rc->sq_array = (unsigned*) (sq + p.sq_off.array);
+    rc->sq_entries = p.sq_entries;
+    rc->sq_queued = *rc->sq_tail;
+    rc->cq_head = (unsigned*) (cq + p.cq_off.head);
+    rc->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    rc->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    rc->cq_overflow = (unsigned*) (cq + p.cq_off.overflow);
+    rc->cq_dropped = *rc->cq_overflow;
+    rc->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    /* entries are used in ring order, the indirection array never changes */
+    for (unsigned i = 0; i < rc->sq_entries; i++) {
+        rc->sq_array[i] = i;
+    }
+
+    return rc;
+
+fail:
+    ELOG("Failed to map io_uring %s", strerror(errno));
+    ur_free(rc);
+    return NULL;
+}
+void ur_free(uring_t* ur) {
+    if (!ur) {
+        return;
+    }
+
+    if (ur->sqes) {
+        munmap(ur->sqes, ur->sqes_size);
+    }
+    if (ur->cq_ring && ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    }
+    if (ur->sq_ring) {
+        munmap(ur->sq_ring, ur->sq_ring_size);
+    }
+
+    close(ur->fd);
+    free(ur);
+}
+int ur_fd(uring_t* ur) {
+    return ur->fd;
+}
+int ur_submit(uring_t* ur) {
+    unsigned to_submit;
+    int rc, total = 0;
+
+    __atomic_store_n(ur->sq_tail, ur->sq_queued, __ATOMIC_RELEASE);
+
+    /*
+     Entries left over by an earlier short submit are still between the
+     kernel's head and the tail, they go with the ones queued since.
+     */
+    while ((to_submit = ur->sq_queued - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE))) {
+        rc = ring_enter(ur, to_submit, 0);
+        if (rc < 0) {
+            if (errno != EAGAIN && errno != EBUSY) {
+                ELOG("Failed to submit to io_uring %s", strerror(errno));
+                return -1;
+            }
+            break; /* out of resources, the rest goes with the next submit */
+        }
+        if (rc == 0) {
+            break;
+        }
+        total += rc;
+    }
+
+    return total;
+}
+void ur_complete(uring_t* ur) {
+    struct io_uring_cqe* cqe;
+    ur_op_t* op;
+    unsigned head;
+    uint32_t flags;
+    int res;
+
+    head = *ur->cq_head;
+
+    for (;;) {
+        while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ur->cqes[head & *ur->cq_mask];
+            op = (ur_op_t*) (uintptr_t) cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+
+            /* the slot is free before the callback queues more work */
+            __atomic_store_n(ur->cq_head, ++head, __ATOMIC_RELEASE);
+
+            if (op) {
+                op->cb(op, res, flags);
+            }
+        }
+
+        /*
+         Completions that didn't fit in the ring are held by the kernel, ask
+         for them now that the ring is drained.
+         */
+        if (!(__atomic_load_n(ur->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) ||
+            ring_enter(ur, 0, IORING_ENTER_GETEVENTS) < 0) {
+            break;
+        }
+    }
+
+    /* kernels without IORING_FEAT_NODROP lose them instead */
+    if (__atomic_load_n(ur->cq_overflow, __ATOMIC_ACQUIRE) != ur->cq_dropped) {
+        ur->cq_dropped = *ur->cq_overflow;
+        ELOG("io_uring dropped completions, %u in total", ur->cq_dropped);
+    }
+}
+int ur_accept_multishot(uring_t* ur, ur_op_t* op, int fd) {
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(ur);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t) op;
+    return 0;
+}
+int ur_writev(uring_t* ur, ur_op_t* op, int fd, const struct iovec* iov, unsigned cnt) {
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(ur);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = cnt;
+    sqe->user_data = (uintptr_t) op;
+    return 0;
+}
+int ur_cancel(uring_t* ur, ur_op_t* op) {
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(ur);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) op;
+    sqe->user_data = 0; /* nobody waits for the cancel itself */
+    return 0;
+}
+int ur_more(uint32_t flags) {
+    return !!(flags & IORING_CQE_F_MORE);
+}
+
+struct io_uring_sqe* ring_sqe(uring_t* ur) {
+    struct io_uring_sqe* sqe;
+
+    if (ur->sq_queued - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+        ur_submit(ur);
+        if (ur->sq_queued - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &ur->sqes[ur->sq_queued & *ur->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_queued++;
+    return sqe;
+}
+int ring_setup(unsigned entries, struct io_uring_params* p) {
+    memset(p, 0, sizeof(*p));
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+int ring_enter(uring_t* ur, unsigned to_submit, unsigned flags) {
+    int rc;
+
+    do {
+        rc = syscall(__NR_io_uring_enter, ur->fd, to_submit, 0, flags, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
@@ -0,0 +1,38 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ Minimal io_uring ring over the raw system calls. Operations are queued and
+ only submitted by ur_submit, so everything queued during a loop iteration
+ goes to the kernel with a single call. The ring descriptor is readable while
+ completions are waiting, ur_complete runs the callbacks of all of them. The
+ operations are embedded in their owners, which must stay alive until the
+ last completion of the operation. A ring belongs to a single loop and is not
+ locked.
+ */
+typedef struct uring_s uring_t;
+
+typedef struct ur_op_s {
+    void (*cb)(struct ur_op_s* op, int res, uint32_t flags);
+    void* data;
+} ur_op_t;
+
+/* Returns NULL if io_uring is not available */
+uring_t* ur_alloc(unsigned entries);
+void ur_free(uring_t* ur);
+int ur_fd(uring_t* ur);
+int ur_submit(uring_t* ur);
+void ur_complete(uring_t* ur);
+
+/* Queue an operation, return -1 if the ring is full even after submitting */
+int ur_accept_multishot(uring_t* ur, ur_op_t* op, int fd);
+int ur_writev(uring_t* ur, ur_op_t* op, int fd, const struct iovec* iov, unsigned cnt);
+int ur_cancel(uring_t* ur, ur_op_t* op);
+
+/* More completions of a multishot operation follow */
+int ur_more(uint32_t flags);
+
+#endif /* URING_H */
@@ -0,0 +1,124 @@
+#include "wheel.h"
+
+#include <stdlib.h>
+
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4 /* 2^32 ticks ahead at most */
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct timer_wheel_s {
+    tw_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t now; /* next tick to run */
+    uint32_t tick;
+};
+
+static void wheel_place(timer_wheel_t* tw, tw_timer_t* t);
+static void wheel_cascade(timer_wheel_t* tw, unsigned level, unsigned slot);
+
+timer_wheel_t* tw_alloc(uint32_t tick, uint64_t now) {
+    timer_wheel_t* rc;
+
+    rc = calloc(1, sizeof(timer_wheel_t));
+    rc->tick = tick ? tick : 1;
+    rc->now = now / rc->tick + 1; /* the current tick is over */
+    return rc;
+}
+void tw_free(timer_wheel_t* tw) {
+    /* the timers belong to their owners */
+    free(tw);
+}
+void tw_arm(timer_wheel_t* tw, tw_timer_t* t, uint64_t timeout) {
+    uint64_t ticks;
+
+    tw_cancel(t);
+
+    ticks = (timeout + tw->tick - 1) / tw->tick;
+    if (ticks >= WHEEL_SPAN) {
+        ticks = WHEEL_SPAN - 1;
+    }
+
+    t->expires = tw->now + ticks;
+    wheel_place(tw, t);
+}
+void tw_cancel(tw_timer_t* t) {
+    if (!t->pprev) {
+        return;
+    }
+
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+
+    t->next = NULL;
+    t->pprev = NULL;
+}
+void tw_advance(timer_wheel_t* tw, uint64_t now, tw_cb_t cb) {
+    tw_timer_t* head,* t;
+    unsigned slot;
+
+    now /= tw->tick;
+
+    while (tw->now <= now) {
+        slot = tw->now & WHEEL_MASK;
+
+        /* a lap of a level is over, bring the next slot of the level above down */
+        for (unsigned level = 1; !slot && level < WHEEL_LEVELS; level++) {
+            slot = (tw->now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+            wheel_cascade(tw, level, slot);
+        }
+
+        slot = tw->now & WHEEL_MASK;
+        tw->now++;
+
+        /* callbacks may cancel the timers that are still due */
+        head = tw->slots[0][slot];
+        tw->slots[0][slot] = NULL;
+        if (head) {
+            head->pprev = &head;
+        }
+
+        while ((t = head)) {
+            tw_cancel(t);
+            cb(t);
+        }
+    }
+}
+
+void wheel_place(timer_wheel_t* tw, tw_timer_t* t) {
+    tw_timer_t** slot;
+    uint64_t delta;
+    unsigned level = 0;
+
+    if (t->expires < tw->now) { /* due already, run on the next tick */
+        slot = &tw->slots[0][tw->now & WHEEL_MASK];
+    } else {
+        delta = t->expires - tw->now;
+        while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_BITS))) {
+            level++;
+        }
+        slot = &tw->slots[level][(t->expires >> (level * WHEEL_BITS)) & WHEEL_MASK];
+    }
+
+    t->next = *slot;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+void wheel_cascade(timer_wheel_t* tw, unsigned level, unsigned slot) {
+    tw_timer_t* head,* t;
+
+    head = tw->slots[level][slot];
+    tw->slots[level][slot] = NULL;
+
+    while ((t = head)) {
+        head = t->next;
+        t->next = NULL;
+        t->pprev = NULL;
+        wheel_place(tw, t);
+    }
+}
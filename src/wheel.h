@@ -0,0 +1,36 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+/*
+ Hierarchical timer wheel. Timers are embedded in their owners and linked into
+ the slot of the tick they expire on, so arming and canceling never allocate
+ and take constant time. Far timers sit on the coarser levels and move down as
+ the wheel turns. Times are in milliseconds and rounded up to whole ticks, the
+ wheel is driven by calling tw_advance with the current time, usually from a
+ repeating timer of one tick. A wheel belongs to a single loop and is not
+ locked.
+ */
+typedef struct timer_wheel_s timer_wheel_t;
+
+typedef struct tw_timer_s {
+    struct tw_timer_s* next;
+    struct tw_timer_s** pprev; /* NULL when not armed */
+    uint64_t expires; /* tick */
+    void* data;
+} tw_timer_t;
+
+typedef void (*tw_cb_t)(tw_timer_t* t);
+
+timer_wheel_t* tw_alloc(uint32_t tick, uint64_t now);
+void tw_free(timer_wheel_t* tw);
+/* Re-arms the timer if it's armed already */
+void tw_arm(timer_wheel_t* tw, tw_timer_t* t, uint64_t timeout);
+void tw_cancel(tw_timer_t* t);
+/* Calls cb for every timer expired by now, the timer is not armed anymore */
+void tw_advance(timer_wheel_t* tw, uint64_t now, tw_cb_t cb);
+
+#define tw_armed(t) ((t)->pprev != NULL)
+
+#endif /* WHEEL_H */
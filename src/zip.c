@@ -0,0 +1,305 @@
+#include "zip.h"
+#include "hashmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define ZIP_KEEP 16 /* idle streams kept of each encoding */
+#define ZIP_WINDOW_BITS 15
+#define ZIP_MEM_LEVEL 8
+#define ZIP_OUT_CHUNK (16 * 1024)
+#define ZIP_PEEK 16
+
+static const int flushes[] = { Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+
+struct zstream_s {
+    z_stream z;
+    struct zstream_s* next;
+    int encoding;
+};
+
+typedef struct zentry_s {
+    struct zentry_s* prev,* next; /* most recently used first */
+    char* key; /* encoding followed by the path */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint32_t refs; /* the cache and every reply holding the data */
+    size_t len;
+    char data[];
+} zentry_t;
+
+struct zip_s {
+    int level;
+    zstream_t* idle[3]; /* by encoding */
+    uint32_t idle_count[3];
+    hashmap_t* entries;
+    zentry_t* head,* tail;
+    size_t cache_size;
+    size_t cache_used;
+};
+
+static int zip_run(zstream_t* zs, void* data, size_t len, evbuffer_t* out, int flush);
+static char* entry_key(const char* path, int encoding);
+static void entry_unlink(zip_t* zp, zentry_t* e);
+static void entry_unref(zentry_t* e);
+static void entry_released(const void* data, size_t len, void* extra);
+static int entry_fresh(const zentry_t* e, const struct stat* st);
+
+zip_t* zp_alloc(int level, size_t cache_size) {
+    zip_t* rc;
+
+    rc = calloc(1, sizeof(zip_t));
+    rc->level = level;
+    rc->cache_size = cache_size;
+    rc->entries = hm_alloc(64, NULL, NULL);
+    return rc;
+}
+void zp_free(zip_t* zp) {
+    zstream_t* zs;
+
+    if (!zp) {
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        while ((zs = zp->idle[i])) {
+            zp->idle[i] = zs->next;
+            deflateEnd(&zs->z);
+            free(zs);
+        }
+    }
+
+    /* replies still holding a variant free it once they are done */
+    while (zp->head) {
+        entry_unlink(zp, zp->head);
+    }
+
+    hm_free(zp->entries);
+    free(zp);
+}
+zstream_t* zp_get(zip_t* zp, int encoding) {
+    zstream_t* rc;
+    int bits;
+
+    rc = zp->idle[encoding];
+    if (rc) {
+        zp->idle[encoding] = rc->next;
+        zp->idle_count[encoding]--;
+        return rc;
+    }
+
+    rc = calloc(1, sizeof(zstream_t));
+    rc->encoding = encoding;
+
+    /* 16 more window bits ask zlib for a gzip wrapper */
+    bits = encoding == ZIP_GZIP ? ZIP_WINDOW_BITS + 16 : ZIP_WINDOW_BITS;
+    if (deflateInit2(&rc->z, zp->level, Z_DEFLATED, bits, ZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(rc);
+        return NULL;
+    }
+
+    return rc;
+}
+void zp_put(zip_t* zp, zstream_t* zs) {
+    if (!zs) {
+        return;
+    }
+
+    if (zp->idle_count[zs->encoding] == ZIP_KEEP || deflateReset(&zs->z) != Z_OK) {
+        deflateEnd(&zs->z);
+        free(zs);
+        return;
+    }
+
+    zs->next = zp->idle[zs->encoding];
+    zp->idle[zs->encoding] = zs;
+    zp->idle_count[zs->encoding]++;
+}
+int zp_deflate(zstream_t* zs, evbuffer_t* in, size_t len, evbuffer_t* out, int flush) {
+    struct evbuffer_iovec vec[ZIP_PEEK];
+    struct evbuffer_ptr pos;
+    size_t left = len, take;
+    int n;
+
+    /* an empty input still has to pass through for the flush */
+    if (!len) {
+        return zip_run(zs, NULL, 0, out, flush);
+    }
+
+    /* the chains are compressed in place, the flush goes with the last one */
+    evbuffer_ptr_set(in, &pos, 0, EVBUFFER_PTR_SET);
+    while (left) {
+        n = evbuffer_peek(in, left, &pos, vec, ZIP_PEEK);
+        n = n < ZIP_PEEK ? n : ZIP_PEEK;
+
+        for (int i = 0; i < n && left; i++) {
+            take = vec[i].iov_len < left ? vec[i].iov_len : left;
+            left -= take;
+            if (zip_run(zs, vec[i].iov_base, take, out, left ? ZIP_MORE : flush)) {
+                return -1;
+            }
+        }
+
+        if (left) {
+            evbuffer_ptr_set(in, &pos, len - left, EVBUFFER_PTR_SET);
+        }
+    }
+
+    return 0;
+}
+int zp_cache_get(zip_t* zp, const char* path, int encoding, const struct stat* st, evbuffer_t* out) {
+    zentry_t* e;
+    char* key;
+
+    if (!zp->cache_size) {
+        return -1;
+    }
+
+    key = entry_key(path, encoding);
+    e = hm_get(zp->entries, key);
+    free(key);
+
+    if (!e) {
+        return -1;
+    }
+    if (!entry_fresh(e, st)) {
+        entry_unlink(zp, e);
+        return -1;
+    }
+
+    if (evbuffer_add_reference(out, e->data, e->len, entry_released, e)) {
+        return -1;
+    }
+    e->refs++;
+
+    /* to the front of the line */
+    if (e != zp->head) {
+        e->prev->next = e->next;
+        if (e->next) {
+            e->next->prev = e->prev;
+        } else {
+            zp->tail = e->prev;
+        }
+        e->prev = NULL;
+        e->next = zp->head;
+        zp->head->prev = e;
+        zp->head = e;
+    }
+
+    return 0;
+}
+void zp_cache_put(zip_t* zp, const char* path, int encoding, const struct stat* st, evbuffer_t* data) {
+    zentry_t* e,* old;
+    size_t len;
+
+    len = evbuffer_get_length(data);
+    if (!zp->cache_size || len > zp_cache_limit(zp)) {
+        return;
+    }
+
+    e = malloc(sizeof(zentry_t) + len);
+    e->key = entry_key(path, encoding);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->refs = 1;
+    e->len = len;
+    evbuffer_copyout(data, e->data, len);
+
+    old = hm_get(zp->entries, e->key);
+    if (old) {
+        entry_unlink(zp, old);
+    }
+
+    while (zp->tail && zp->cache_used + len > zp->cache_size) {
+        entry_unlink(zp, zp->tail);
+    }
+
+    hm_put(zp->entries, e->key, e);
+    e->prev = NULL;
+    e->next = zp->head;
+    if (zp->head) {
+        zp->head->prev = e;
+    } else {
+        zp->tail = e;
+    }
+    zp->head = e;
+    zp->cache_used += len;
+}
+size_t zp_cache_limit(zip_t* zp) {
+    /* a single file should not flush out the whole cache */
+    return zp->cache_size / 4;
+}
+char* entry_key(const char* path, int encoding) {
+    size_t len;
+    char* rc;
+
+    len = strlen(path);
+    rc = malloc(len + 2);
+    rc[0] = '0' + encoding;
+    memcpy(rc + 1, path, len + 1);
+    return rc;
+}
+void entry_unlink(zip_t* zp, zentry_t* e) {
+    hm_remove(zp->entries, e->key);
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        zp->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        zp->tail = e->prev;
+    }
+
+    zp->cache_used -= e->len;
+    entry_unref(e);
+}
+void entry_unref(zentry_t* e) {
+    if (--e->refs) {
+        return;
+    }
+
+    free(e->key);
+    free(e);
+}
+void entry_released(const void* data, size_t len, void* extra) {
+    entry_unref(extra);
+}
+int zip_run(zstream_t* zs, void* data, size_t len, evbuffer_t* out, int flush) {
+    struct evbuffer_iovec space;
+    int rc;
+
+    zs->z.next_in = data;
+    zs->z.avail_in = len;
+
+    /* zlib fills the output completely as long as it has more to give */
+    do {
+        if (evbuffer_reserve_space(out, ZIP_OUT_CHUNK, &space, 1) < 1) {
+            return -1;
+        }
+
+        zs->z.next_out = space.iov_base;
+        zs->z.avail_out = space.iov_len;
+        rc = deflate(&zs->z, flushes[flush]);
+        if (rc == Z_STREAM_ERROR) {
+            return -1;
+        }
+
+        space.iov_len -= zs->z.avail_out;
+        evbuffer_commit_space(out, &space, 1);
+    } while (zs->z.avail_in || (!zs->z.avail_out && rc != Z_STREAM_END) ||
+             (flush == ZIP_FINISH && rc != Z_STREAM_END));
+
+    return 0;
+}
+int entry_fresh(const zentry_t* e, const struct stat* st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
@@ -0,0 +1,49 @@
+#ifndef ZIP_H
+#define ZIP_H
+
+#include "evbuffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ Reply compression with zlib. Deflate streams are pooled and reset instead
+ of freed, so a reply does not allocate the few hundred kilobytes of zlib
+ state. The cache keeps compressed variants of files by path, checked
+ against the size and modification time of the file on every hit, and adds
+ them to replies by reference. Least recently used variants are dropped
+ past the size of the cache. A pool belongs to a single loop and is not
+ locked.
+ */
+typedef struct zip_s zip_t;
+typedef struct zstream_s zstream_t;
+
+#define ZIP_IDENTITY 0
+#define ZIP_GZIP 1
+#define ZIP_DEFLATE 2 /* zlib format, which is what HTTP calls deflate */
+
+#define ZIP_MORE 0 /* more data follows */
+#define ZIP_FLUSH 1 /* what was given can be decompressed */
+#define ZIP_FINISH 2
+
+/* level is the zlib one, cache_size 0 disables the cache */
+zip_t* zp_alloc(int level, size_t cache_size);
+void zp_free(zip_t* zp);
+/* Returns NULL if zlib fails to allocate */
+zstream_t* zp_get(zip_t* zp, int encoding);
+void zp_put(zip_t* zp, zstream_t* zs);
+/*
+ Compress the first len bytes of in to out, in is left alone. flush is one of
+ the modes above. Returns -1 on error.
+ */
+int zp_deflate(zstream_t* zs, evbuffer_t* in, size_t len, evbuffer_t* out, int flush);
+
+/* Adds the variant to out and returns 0, -1 if there is no fresh one */
+int zp_cache_get(zip_t* zp, const char* path, int encoding, const struct stat* st, evbuffer_t* out);
+/* The compressed data is copied, out of the cache if it's too big */
+void zp_cache_put(zip_t* zp, const char* path, int encoding, const struct stat* st, evbuffer_t* data);
+/* Largest file worth compressing for the cache, 0 without a cache */
+size_t zp_cache_limit(zip_t* zp);
+
+#endif /* ZIP_H */